@@ -7,27 +7,138 @@
  */
 
 #include "base64.h"
+#include "cpu.h"
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
-#include <assert.h>
 
 static const unsigned char base64_table[65] =
 	"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
 
-static const unsigned char base62_table[] =
-	"0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz";
+#ifdef PSBT_X86
+#include <immintrin.h>
+
+#define SSSE3 __attribute__((target("ssse3")))
+#define AVX2 __attribute__((target("avx2")))
+
+/*
+ * Vector encoders for the base64 alphabet, after Wojciech Mula and Daniel
+ * Lemire, "Faster Base64 Encoding and Decoding Using AVX2 Instructions".
+ * Each step reads a full vector but only consumes 12 (24) bytes of it, and
+ * produces 16 (32) characters. Returns the number of input bytes consumed.
+ */
+
+static SSSE3 __m128i
+base64_enc_reshuffle_ssse3(__m128i in)
+{
+	const __m128i shuf = _mm_setr_epi8(
+		1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10);
+	__m128i t0, t1, t2, t3;
+
+	// spread each 3-byte group over 4 bytes, then move every 6-bit
+	// field to the bottom of its own byte
+	in = _mm_shuffle_epi8(in, shuf);
+	t0 = _mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00));
+	t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+	t2 = _mm_and_si128(in, _mm_set1_epi32(0x003f03f0));
+	t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+
+	return _mm_or_si128(t1, t3);
+}
+
+static SSSE3 __m128i
+base64_enc_translate_ssse3(__m128i in)
+{
+	const __m128i lut = _mm_setr_epi8(
+		65, 71, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4, -19, -16, 0, 0);
+	__m128i indices = _mm_subs_epu8(in, _mm_set1_epi8(51));
+	__m128i mask = _mm_cmpgt_epi8(in, _mm_set1_epi8(25));
+
+	indices = _mm_sub_epi8(indices, mask);
+
+	return _mm_add_epi8(in, _mm_shuffle_epi8(lut, indices));
+}
+
+static SSSE3 size_t
+base64_encode_ssse3(const unsigned char *src, size_t len, unsigned char *out)
+{
+	__m128i str;
+	size_t i = 0, o = 0;
+
+	while (len - i >= 16) {
+		str = _mm_loadu_si128((const __m128i *)(src + i));
+		str = base64_enc_translate_ssse3(base64_enc_reshuffle_ssse3(str));
+		_mm_storeu_si128((__m128i *)(out + o), str);
+		i += 12;
+		o += 16;
+	}
+
+	return i;
+}
+
+static AVX2 size_t
+base64_encode_avx2(const unsigned char *src, size_t len, unsigned char *out)
+{
+	const __m256i shuf = _mm256_setr_epi8(
+		1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10,
+		1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10);
+	const __m256i lut = _mm256_setr_epi8(
+		65, 71, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4, -19, -16, 0, 0,
+		65, 71, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4, -19, -16, 0, 0);
+	__m256i str, t0, t1, t2, t3, indices, mask;
+	size_t i = 0, o = 0;
+
+	while (len - i >= 28) {
+		// 12 bytes into each 128-bit lane
+		str = _mm256_inserti128_si256(
+			_mm256_castsi128_si256(
+				_mm_loadu_si128((const __m128i *)(src + i))),
+			_mm_loadu_si128((const __m128i *)(src + i + 12)), 1);
+
+		str = _mm256_shuffle_epi8(str, shuf);
+		t0 = _mm256_and_si256(str, _mm256_set1_epi32(0x0fc0fc00));
+		t1 = _mm256_mulhi_epu16(t0, _mm256_set1_epi32(0x04000040));
+		t2 = _mm256_and_si256(str, _mm256_set1_epi32(0x003f03f0));
+		t3 = _mm256_mullo_epi16(t2, _mm256_set1_epi32(0x01000010));
+		str = _mm256_or_si256(t1, t3);
+
+		indices = _mm256_subs_epu8(str, _mm256_set1_epi8(51));
+		mask = _mm256_cmpgt_epi8(str, _mm256_set1_epi8(25));
+		indices = _mm256_sub_epi8(indices, mask);
+		str = _mm256_add_epi8(str, _mm256_shuffle_epi8(lut, indices));
+
+		_mm256_storeu_si256((__m256i *)(out + o), str);
+		i += 24;
+		o += 32;
+	}
+
+	return i;
+}
+
+#endif /* PSBT_X86 */
+
+/**
+ * base64_encoded_length - Number of characters base64_encode produces
+ * @len: Length of the data to be encoded
+ * Returns: Encoded length, not counting the nul terminator
+ */
+size_t base64_encoded_length(size_t len)
+{
+	return (len + 2) / 3 * 4;
+}
 
 /**
  * base64_encode - Base64 encode
  * @src: Data to be encoded
  * @len: Length of the data to be encoded
+ * @out: Pointer to output buffer
+ * @out_capacity: Size of the output buffer, at least
+ *	base64_encoded_length(len) + 1
  * @out_len: Pointer to output length variable, or %NULL if not used
- * Returns: Allocated buffer of out_len bytes of encoded data,
- * or %NULL on failure
+ * Returns: out, or %NULL on failure
  *
- * Caller is responsible for freeing the returned buffer. Returned buffer is
- * nul terminated to make it easier to use as a C string. The nul terminator is
- * not included in out_len.
+ * Returned buffer is nul terminated to make it easier to use as a C string.
+ * The nul terminator is not included in out_len.
  */
 
 unsigned char * base_encode(const unsigned char *src, size_t len,
@@ -38,10 +149,10 @@ unsigned char * base_encode(const unsigned char *src, size_t len,
 	const unsigned char *end, *in;
 	size_t olen;
 
-	olen = len * 4 / 3 + 4; /* 3-byte blocks to 4-byte */
-	olen++; /* nul termination */
-	if (olen < len)
+	if (len > (SIZE_MAX - 1) / 4 * 3 - 2)
 		return NULL; /* integer overflow */
+	olen = base64_encoded_length(len); /* 3-byte blocks to 4-byte */
+	olen++; /* nul termination */
 	if (olen > out_capacity)
 		return NULL; /* buffer overflow */
 	if (out == NULL)
@@ -50,6 +161,21 @@ unsigned char * base_encode(const unsigned char *src, size_t len,
 	end = src + len;
 	in = src;
 	pos = out;
+
+#ifdef PSBT_X86
+	if (base_table == base64_table) {
+		unsigned int cpu = cpu_features();
+		size_t n = 0;
+
+		if (cpu & CPU_AVX2)
+			n = base64_encode_avx2(in, len, pos);
+		if (cpu & CPU_SSSE3)
+			n += base64_encode_ssse3(in + n, len - n, pos + n / 3 * 4);
+		in += n;
+		pos += n / 3 * 4;
+	}
+#endif
+
 	while (end - in >= 3) {
 		*pos++ = base_table[in[0] >> 2];
 		*pos++ = base_table[((in[0] & 0x03) << 4) | (in[1] >> 4)];
@@ -83,87 +209,271 @@ base64_encode(const unsigned char *src, size_t len, unsigned char *out,
 	return base_encode(src, len, out, out_capacity, out_len, base64_table);
 }
 
-unsigned char *
-base62_encode(const unsigned char *src, size_t len, unsigned char *out,
-	      size_t out_capacity, size_t *out_len) {
-	return base_encode(src, len, out, out_capacity, out_len, base62_table);
+
+#define XX 0xff /* invalid */
+#define WS 0xfe /* whitespace, skipped */
+#define PD 0xfd /* padding */
+
+static const unsigned char base64_dtable[256] = {
+	XX, XX, XX, XX, XX, XX, XX, XX, XX, WS, WS, XX, XX, WS, XX, XX,
+	XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+	WS, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, 62, XX, XX, XX, 63,
+	52, 53, 54, 55, 56, 57, 58, 59, 60, 61, XX, XX, XX, PD, XX, XX,
+	XX,  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14,
+	15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, XX, XX, XX, XX, XX,
+	XX, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36, 37, 38, 39, 40,
+	41, 42, 43, 44, 45, 46, 47, 48, 49, 50, 51, XX, XX, XX, XX, XX,
+	XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+	XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+	XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+	XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+	XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+	XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+	XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+	XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+};
+
+#ifdef PSBT_X86
+
+/*
+ * Vector decoders after Wojciech Mula and Daniel Lemire, "Faster Base64
+ * Encoding and Decoding Using AVX2 Instructions". They only handle blocks
+ * made up entirely of alphabet characters and return the number of input
+ * bytes consumed; whitespace, padding and errors are left to the scalar
+ * loop. Every block stores a full vector, so out_room must cover it.
+ */
+
+static SSSE3 size_t
+base64_decode_ssse3(const unsigned char *src, size_t len, unsigned char *out,
+		    size_t out_room)
+{
+	const __m128i lut_lo = _mm_setr_epi8(
+		0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+		0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a);
+	const __m128i lut_hi = _mm_setr_epi8(
+		0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+		0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+	const __m128i lut_roll = _mm_setr_epi8(
+		0, 16, 19, 4, -65, -65, -71, -71,
+		0,  0,  0, 0,   0,   0,   0,   0);
+	const __m128i pack = _mm_setr_epi8(
+		2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+	const __m128i mask_2f = _mm_set1_epi8(0x2f);
+	__m128i str, hi_nibbles, lo_nibbles, bad, roll;
+	size_t i = 0, o = 0;
+
+	while (len - i >= 16 && out_room - o >= 16) {
+		str = _mm_loadu_si128((const __m128i *)(src + i));
+
+		hi_nibbles = _mm_and_si128(_mm_srli_epi32(str, 4), mask_2f);
+		lo_nibbles = _mm_and_si128(str, mask_2f);
+		bad = _mm_and_si128(_mm_shuffle_epi8(lut_lo, lo_nibbles),
+				    _mm_shuffle_epi8(lut_hi, hi_nibbles));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(bad, _mm_setzero_si128()))
+		    != 0xffff)
+			break;
+
+		roll = _mm_shuffle_epi8(lut_roll,
+					_mm_add_epi8(_mm_cmpeq_epi8(str, mask_2f),
+						     hi_nibbles));
+		str = _mm_add_epi8(str, roll);
+
+		// pack four 6-bit values into 24 bits
+		str = _mm_maddubs_epi16(str, _mm_set1_epi32(0x01400140));
+		str = _mm_madd_epi16(str, _mm_set1_epi32(0x00011000));
+		str = _mm_shuffle_epi8(str, pack);
+
+		_mm_storeu_si128((__m128i *)(out + o), str);
+		i += 16;
+		o += 12;
+	}
+
+	return i;
+}
+
+static AVX2 size_t
+base64_decode_avx2(const unsigned char *src, size_t len, unsigned char *out,
+		   size_t out_room)
+{
+	const __m256i lut_lo = _mm256_setr_epi8(
+		0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+		0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a,
+		0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+		0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a);
+	const __m256i lut_hi = _mm256_setr_epi8(
+		0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+		0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+		0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+		0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+	const __m256i lut_roll = _mm256_setr_epi8(
+		0, 16, 19, 4, -65, -65, -71, -71,
+		0,  0,  0, 0,   0,   0,   0,   0,
+		0, 16, 19, 4, -65, -65, -71, -71,
+		0,  0,  0, 0,   0,   0,   0,   0);
+	const __m256i pack = _mm256_setr_epi8(
+		2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+		2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+	const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 7, 7);
+	const __m256i mask_2f = _mm256_set1_epi8(0x2f);
+	__m256i str, hi_nibbles, lo_nibbles, bad, roll;
+	size_t i = 0, o = 0;
+
+	while (len - i >= 32 && out_room - o >= 32) {
+		str = _mm256_loadu_si256((const __m256i *)(src + i));
+
+		hi_nibbles = _mm256_and_si256(_mm256_srli_epi32(str, 4), mask_2f);
+		lo_nibbles = _mm256_and_si256(str, mask_2f);
+		bad = _mm256_and_si256(_mm256_shuffle_epi8(lut_lo, lo_nibbles),
+				       _mm256_shuffle_epi8(lut_hi, hi_nibbles));
+		if (!_mm256_testz_si256(bad, bad))
+			break;
+
+		roll = _mm256_shuffle_epi8(lut_roll,
+					   _mm256_add_epi8(_mm256_cmpeq_epi8(str, mask_2f),
+							   hi_nibbles));
+		str = _mm256_add_epi8(str, roll);
+
+		str = _mm256_maddubs_epi16(str, _mm256_set1_epi32(0x01400140));
+		str = _mm256_madd_epi16(str, _mm256_set1_epi32(0x00011000));
+		str = _mm256_shuffle_epi8(str, pack);
+		// close the gap between the two 12-byte lanes
+		str = _mm256_permutevar8x32_epi32(str, lanes);
+
+		_mm256_storeu_si256((__m256i *)(out + o), str);
+		i += 32;
+		o += 24;
+	}
+
+	return i;
+}
+
+#endif /* PSBT_X86 */
+
+void base64_decoder_init(struct base64_decoder *dec) {
+	dec->count = 0;
+	dec->pad = 0;
+	dec->done = 0;
 }
 
+/*
+ * Single pass over src. Alphabet runs go through the vector kernels
+ * whenever we are on a quantum boundary, anything else is handled one
+ * character at a time here.
+ */
+int
+base64_decode_update(struct base64_decoder *dec, const unsigned char *src,
+		     size_t len, unsigned char *out, size_t out_capacity,
+		     size_t *out_size)
+{
+	unsigned char c, *block = dec->block;
+	size_t i = 0, o = 0, n, scalar_end = 0;
+#ifdef PSBT_X86
+	unsigned int cpu = cpu_features();
+#endif
+
+	while (i < len) {
+#ifdef PSBT_X86
+		if (dec->count == 0 && !dec->done && i >= scalar_end) {
+			n = 0;
+			if (cpu & CPU_AVX2)
+				n = base64_decode_avx2(src + i, len - i, out + o,
+						       out_capacity - o);
+			if (cpu & CPU_SSSE3)
+				n += base64_decode_ssse3(src + i + n, len - i - n,
+							 out + o + n / 4 * 3,
+							 out_capacity - o - n / 4 * 3);
+			i += n;
+			o += n / 4 * 3;
+			// the kernels stopped on something they can't
+			// handle, work through it before trying again
+			scalar_end = i + 32;
+			if (i == len)
+				break;
+		}
+#endif
+		c = base64_dtable[src[i++]];
+
+		if (c == WS)
+			continue;
+
+		if (c == XX || dec->done)
+			return 0;
+
+		if (c == PD) {
+			// at least two data characters per quantum
+			if (dec->count < 2)
+				return 0;
+			dec->pad++;
+			c = 0;
+		}
+		else if (dec->pad) {
+			// data after padding
+			return 0;
+		}
+
+		block[dec->count++] = c;
+		if (dec->count < 4)
+			continue;
+
+		n = 3 - dec->pad;
+		if (out_capacity - o < n)
+			return 0;
+
+		// non-canonical trailing bits
+		if ((dec->pad == 1 && (block[2] & 0x03)) ||
+		    (dec->pad == 2 && (block[1] & 0x0f)))
+			return 0;
+
+		out[o++] = (block[0] << 2) | (block[1] >> 4);
+		if (n > 1)
+			out[o++] = (block[1] << 4) | (block[2] >> 2);
+		if (n > 2)
+			out[o++] = (block[2] << 6) | block[3];
+
+		dec->count = 0;
+		if (dec->pad)
+			dec->done = 1;
+	}
+
+	*out_size = o;
+	return 1;
+}
 
 /**
  * base64_decode - Base64 decode
  * @src: Data to be decoded
  * @len: Length of the data to be decoded
  * @out: Pointer to output buffer
- * @out_len: Pointer to output length variable
- * Returns: Allocated buffer of out_len bytes of decoded data,
- * or %NULL on failure
+ * @out_capacity: Size of the output buffer
+ * @out_size: Pointer to output length variable
+ * Returns: out on success, or %NULL on failure
  *
- * Caller is responsible for freeing the returned buffer.
+ * Whitespace (space, tab, CR, LF) is skipped and a trailing nul terminator is
+ * ignored. Any other character outside the alphabet, misplaced or missing
+ * padding, non-zero trailing bits and running out of output space are
+ * errors.
  */
 unsigned char * base64_decode(const unsigned char *src, size_t len,
 			      unsigned char *out, size_t out_capacity,
 			      size_t *out_size)
 {
-	unsigned char dtable[256], *pos, block[4], tmp;
-	size_t i, count, olen;
-	int pad = 0;
-
-	memset(dtable, 0x80, 256);
-	for (i = 0; i < sizeof(base64_table) - 1; i++)
-		dtable[base64_table[i]] = (unsigned char) i;
-	dtable['='] = 0;
-
-	count = 0;
-	for (i = 0; i < len; i++) {
-		if (dtable[src[i]] != 0x80)
-			count++;
-	}
+	struct base64_decoder dec;
+	size_t olen;
 
-	if (count == 0 || count % 4)
+	if (out == NULL)
 		return NULL;
 
-	olen = count / 4 * 3;
+	if (len > 0 && src[len - 1] == '\0')
+		len--;
 
-	if (out_capacity < olen)
+	base64_decoder_init(&dec);
+	if (!base64_decode_update(&dec, src, len, out, out_capacity, &olen))
 		return NULL;
 
-	pos = out;
-	if (out == NULL)
+	// incomplete quantum or nothing decoded
+	if (dec.count != 0 || (olen == 0 && !dec.done))
 		return NULL;
 
-	count = 0;
-	for (i = 0; i < len; i++) {
-		tmp = dtable[src[i]];
-		if (tmp == 0x80)
-			continue;
-
-		if (src[i] == '=')
-			pad++;
-		block[count] = tmp;
-		count++;
-		if (count == 4) {
-			*pos++ = (block[0] << 2) | (block[1] >> 4);
-			assert((size_t)(pos - out) < out_capacity);
-			*pos++ = (block[1] << 4) | (block[2] >> 2);
-			assert((size_t)(pos - out) < out_capacity);
-			*pos++ = (block[2] << 6) | block[3];
-			assert((size_t)(pos - out) < out_capacity);
-			count = 0;
-			if (pad) {
-				if (pad == 1)
-					pos--;
-				else if (pad == 2)
-					pos -= 2;
-				else {
-					/* Invalid padding */
-					return NULL;
-				}
-				break;
-			}
-		}
-	}
-
-	*out_size = pos - out;
+	*out_size = olen;
 	return out;
 }
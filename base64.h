@@ -11,9 +11,7 @@
 
 #include <stddef.h>
 
-unsigned char * base62_encode(const unsigned char *src, size_t len,
-			      unsigned char *out, size_t out_capacity,
-			      size_t *out_len);
+size_t base64_encoded_length(size_t len);
 unsigned char * base64_encode(const unsigned char *src, size_t len,
 			      unsigned char *out, size_t out_capacity,
 			      size_t *out_len);
@@ -21,4 +19,21 @@ unsigned char * base64_decode(const unsigned char *src, size_t len,
 			      unsigned char *out, size_t out_capacity,
 			      size_t *out_size);
 
+/*
+ * Incremental decoding, src may be split anywhere. Each call writes at most
+ * len / 4 * 3 + 3 bytes to out. After the last chunk the input is complete
+ * when no partial quantum is left in count.
+ */
+struct base64_decoder {
+	unsigned char block[4];
+	int count;
+	int pad;
+	int done;
+};
+
+void base64_decoder_init(struct base64_decoder *dec);
+int base64_decode_update(struct base64_decoder *dec, const unsigned char *src,
+			 size_t len, unsigned char *out, size_t out_capacity,
+			 size_t *out_size);
+
 #endif /* BASE64_H */
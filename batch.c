@@ -0,0 +1,204 @@
+
+#define _DEFAULT_SOURCE
+
+#include <pthread.h>
+#include <unistd.h>
+
+#include "psbt.h"
+#include "parser.h"
+
+/*
+ * Items are split into one contiguous range per worker with about the same
+ * number of input bytes. Workers take items from the front of their own
+ * range and, once it is empty, steal from the back of someone else's.
+ */
+
+struct batch_worker {
+	pthread_mutex_t lock;
+	pthread_t thread;
+	size_t next;
+	size_t end;
+	struct batch *batch;
+};
+
+struct batch {
+	struct psbt_batch_item *items;
+	psbt_elem_handler *handler;
+	struct batch_worker *workers;
+	unsigned int num_workers;
+};
+
+static void batch_read_item(struct psbt_batch_item *item,
+			    psbt_elem_handler *handler)
+{
+	enum psbt_result res;
+	size_t len;
+
+	if (!item->encoded) {
+		res = psbt_read_view(item->src, item->src_size, &item->psbt,
+				     handler, item->user_data);
+		goto done;
+	}
+
+	res = psbt_decode((const char *)item->src, item->src_size, item->buf,
+			  item->buf_size, &len);
+	if (res != PSBT_OK) {
+		psbt_fail(res);
+		goto done;
+	}
+
+	psbt_init(&item->psbt, item->buf, item->buf_size);
+	res = psbt_read(item->buf, len, &item->psbt, handler, item->user_data);
+
+done:
+	item->result = res;
+	if (res != PSBT_OK)
+		item->error = *psbt_last_error();
+}
+
+static int batch_take(struct batch_worker *w, size_t *item) {
+	int found = 0;
+
+	pthread_mutex_lock(&w->lock);
+	if (w->next < w->end) {
+		*item = w->next++;
+		found = 1;
+	}
+	pthread_mutex_unlock(&w->lock);
+
+	return found;
+}
+
+static int batch_steal(struct batch_worker *w, size_t *item) {
+	int found = 0;
+
+	pthread_mutex_lock(&w->lock);
+	if (w->next < w->end) {
+		*item = --w->end;
+		found = 1;
+	}
+	pthread_mutex_unlock(&w->lock);
+
+	return found;
+}
+
+/* the next item for worker self, own range first */
+static int batch_next(struct batch_worker *self, size_t *item) {
+	struct batch *batch = self->batch;
+	unsigned int i, n = batch->num_workers;
+	unsigned int me = self - batch->workers;
+
+	if (batch_take(self, item))
+		return 1;
+
+	for (i = 1; i < n; i++) {
+		if (batch_steal(&batch->workers[(me + i) % n], item))
+			return 1;
+	}
+
+	return 0;
+}
+
+static void *batch_work(void *arg) {
+	struct batch_worker *self = (struct batch_worker *)arg;
+	struct batch *batch = self->batch;
+	size_t item;
+
+	while (batch_next(self, &item))
+		batch_read_item(&batch->items[item], batch->handler);
+
+	return NULL;
+}
+
+/* give each worker a range holding about 1/n of the input bytes */
+static void batch_partition(struct batch *batch, size_t num_items) {
+	unsigned int n = batch->num_workers, w = 0;
+	size_t i, total = 0, sum = 0;
+
+	for (i = 0; i < num_items; i++)
+		total += batch->items[i].src_size;
+
+	batch->workers[0].next = 0;
+	for (i = 0; i < num_items; i++) {
+		sum += batch->items[i].src_size;
+		// close the current range once it reaches its share
+		while (w + 1 < n && sum * n >= total * (w + 1)) {
+			batch->workers[w].end = i + 1;
+			batch->workers[++w].next = i + 1;
+		}
+	}
+
+	for (; w < n; w++) {
+		batch->workers[w].end = num_items;
+		if (w + 1 < n)
+			batch->workers[w + 1].next = num_items;
+	}
+}
+
+unsigned int psbt_batch_threads(void) {
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (n < 1)
+		return 1;
+	if (n > PSBT_BATCH_MAX_THREADS)
+		return PSBT_BATCH_MAX_THREADS;
+	return (unsigned int)n;
+}
+
+enum psbt_result
+psbt_read_batch(struct psbt_batch_item *items, size_t num_items,
+		psbt_elem_handler *elem_handler, unsigned int threads)
+{
+	struct batch_worker workers[PSBT_BATCH_MAX_THREADS];
+	struct batch batch;
+	unsigned int i, started;
+	size_t j;
+
+	if (num_items == 0)
+		return PSBT_OK;
+
+	if (threads == 0)
+		threads = psbt_batch_threads();
+	if (threads > PSBT_BATCH_MAX_THREADS)
+		threads = PSBT_BATCH_MAX_THREADS;
+	if (threads > num_items)
+		threads = num_items;
+
+	batch.items = items;
+	batch.handler = elem_handler;
+	batch.workers = workers;
+	batch.num_workers = threads;
+
+	for (i = 0; i < threads; i++) {
+		pthread_mutex_init(&workers[i].lock, NULL);
+		workers[i].batch = &batch;
+	}
+
+	batch_partition(&batch, num_items);
+
+	// the calling thread is worker 0. if a thread can't be started its
+	// range is simply stolen by the others
+	for (started = 1; started < threads; started++) {
+		if (pthread_create(&workers[started].thread, NULL, batch_work,
+				   &workers[started]) != 0)
+			break;
+	}
+
+	batch_work(&workers[0]);
+
+	for (i = 1; i < started; i++)
+		pthread_join(workers[i].thread, NULL);
+
+	for (i = 0; i < threads; i++)
+		pthread_mutex_destroy(&workers[i].lock);
+
+	for (j = 0; j < num_items; j++) {
+		if (items[j].result != PSBT_OK) {
+			psbt_errmsg = "psbt_read_batch: some items failed, "
+				"see their result and error";
+			return psbt_fail(items[j].result);
+		}
+	}
+
+	return PSBT_OK;
+}
@@ -114,7 +114,7 @@ int main(int argc, char *argv[])
 	res = psbt_read(buffer, psbt_len, &psbt, print_rec, NULL);
 	CHECK(res);
 
-	res = psbt_encode(&psbt, PSBT_ENCODING_BASE62, buffer, 4096, &out_len);
+	res = psbt_encode(&psbt, PSBT_ENCODING_BASE64, buffer, 4096, &out_len);
 	CHECK(res);
 
 	/* printf("%.*s", (int)out_len, buffer); */
@@ -6,6 +6,7 @@
 #include <string.h>
 
 #include "compactsize.h"
+#include "parser.h"
 
 u32 compactsize_peek_length(u8 chsize) {
 	if (chsize < 253)
@@ -77,15 +78,15 @@ void compactsize_write(u8 *dest, u64 size)
 	}
 	else if (size <= USHRT_MAX) {
 		serialize_u8(dest, 253);
-		serialize_u16(dest, size);
+		serialize_u16(dest + 1, size);
 	}
 	else if (size <= UINT_MAX) {
 		serialize_u8(dest, 254);
-		serialize_u32(dest, size);
+		serialize_u32(dest + 1, size);
 	}
 	else {
 		serialize_u8(dest, 255);
-		serialize_u64(dest, size);
+		serialize_u64(dest + 1, size);
 	}
 }
 
@@ -93,7 +94,7 @@ void compactsize_write(u8 *dest, u64 size)
 
 #define READERR(msg) \
 	{if (err)				\
-		*err = PSBT_COMPACT_READ_ERROR; \
+		*err = psbt_fail(PSBT_COMPACT_READ_ERROR); \
 	psbt_errmsg = msg; \
 	return -1;}
 
@@ -0,0 +1,67 @@
+
+#include "cpu.h"
+
+#ifdef PSBT_X86
+#include <cpuid.h>
+
+#define CPU_PROBED (1u << 31)
+
+static unsigned int features = 0;
+
+static int os_saves_ymm(void) {
+	unsigned int lo, hi;
+
+	__asm__ ("xgetbv" : "=a" (lo), "=d" (hi) : "c" (0));
+
+	// XMM and YMM state must both be enabled by the OS
+	return (lo & 0x6) == 0x6;
+}
+
+static unsigned int cpu_probe(void) {
+	unsigned int eax, ebx, ecx, edx;
+	unsigned int found = 0;
+
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+		return 0;
+
+	if (ecx & bit_SSSE3)
+		found |= CPU_SSSE3;
+
+	if (ecx & bit_SSE4_1)
+		found |= CPU_SSE41;
+
+	if (!(ecx & bit_OSXSAVE) || !os_saves_ymm())
+		return found;
+
+	if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+		return found;
+
+	if (ebx & bit_AVX2)
+		found |= CPU_AVX2;
+
+	if ((ebx & bit_SHA) && (found & CPU_SSE41))
+		found |= CPU_SHA;
+
+	return found;
+}
+
+unsigned int cpu_features(void) {
+	unsigned int f = __atomic_load_n(&features, __ATOMIC_RELAXED);
+
+	if (f & CPU_PROBED)
+		return f & ~CPU_PROBED;
+
+	// racing threads compute the same value, so a plain store is fine
+	f = cpu_probe();
+	__atomic_store_n(&features, f | CPU_PROBED, __ATOMIC_RELAXED);
+
+	return f;
+}
+
+#else
+
+unsigned int cpu_features(void) {
+	return 0;
+}
+
+#endif
@@ -0,0 +1,18 @@
+
+#ifndef PSBT_CPU_H
+#define PSBT_CPU_H
+
+#if defined(__x86_64__) || defined(__i386__)
+#define PSBT_X86 1
+#endif
+
+enum cpu_feature {
+	CPU_SSSE3 = 1 << 0,
+	CPU_SSE41 = 1 << 1,
+	CPU_AVX2  = 1 << 2,
+	CPU_SHA   = 1 << 3,
+};
+
+unsigned int cpu_features(void);
+
+#endif /* PSBT_CPU_H */
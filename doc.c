@@ -0,0 +1,198 @@
+
+#include <stdint.h>
+#include <string.h>
+
+#include "psbt.h"
+#include "parser.h"
+#include "common.h"
+
+struct doc_arena {
+	u8 *pos;
+	u8 *end;
+};
+
+struct doc_filler {
+	struct psbt_doc *doc;
+	unsigned int inputs;
+	unsigned int outputs;
+};
+
+static u8 *doc_align(u8 *p) {
+	return (u8 *)(((uintptr_t)p + 7) & ~(uintptr_t)7);
+}
+
+/* n elems of size from the arena, NULL when it is used up */
+static void *doc_alloc(struct doc_arena *arena, size_t n, size_t size) {
+	u8 *p = doc_align(arena->pos);
+
+	if (p > arena->end || n > (size_t)(arena->end - p) / size)
+		return NULL;
+
+	arena->pos = p + n * size;
+	return p;
+}
+
+static void doc_fill(struct psbt_txelem *elem) {
+	struct doc_filler *f = (struct doc_filler *)elem->user_data;
+	struct psbt_doc *doc = f->doc;
+	struct psbt_txin *txin;
+	struct psbt_txout *txout;
+
+	switch (elem->elem_type) {
+	case PSBT_TXELEM_TXIN:
+		txin = elem->elem.txin;
+		doc->prevout_offsets[f->inputs] = txin->txid - doc->tape.data;
+		doc->prevout_indexes[f->inputs] = txin->index;
+		doc->sequences[f->inputs] = txin->sequence_number;
+		f->inputs++;
+		return;
+	case PSBT_TXELEM_TXOUT:
+		txout = elem->elem.txout;
+		doc->amounts[f->outputs] = txout->amount;
+		doc->script_offsets[f->outputs] = txout->script - doc->tape.data;
+		doc->script_sizes[f->outputs] = txout->script_len;
+		f->outputs++;
+		return;
+	default:
+		return;
+	}
+}
+
+void
+psbt_doc_init(struct psbt_doc *doc, void *block, size_t block_size) {
+	memset(doc, 0, sizeof(*doc));
+	doc->block = block;
+	doc->block_size = block_size;
+}
+
+enum psbt_result
+psbt_doc_build(struct psbt_doc *doc, const unsigned char *src,
+	       size_t src_size)
+{
+	struct doc_arena arena;
+	struct doc_filler filler = { .doc = doc, .inputs = 0, .outputs = 0 };
+	struct psbt_tape_rec *recs;
+	struct psbt_record rec;
+	enum psbt_result res;
+	unsigned int i, map, num_maps, ins, outs;
+
+	arena.pos = doc_align((u8 *)doc->block);
+	arena.end = (u8 *)doc->block + doc->block_size;
+	if (arena.pos > arena.end)
+		arena.pos = arena.end;
+
+	rec.val = NULL;
+	rec.val_size = 0;
+
+	// the tape takes what it needs from the front, the rest of the
+	// arrays are sized from its counts
+	recs = (struct psbt_tape_rec *)arena.pos;
+	psbt_tape_init(&doc->tape, recs,
+		       (arena.end - arena.pos) / sizeof(*recs));
+
+	res = psbt_tape_scan(&doc->tape, src, src_size);
+	if (res == PSBT_OOB_WRITE)
+		goto too_small;
+	if (res != PSBT_OK)
+		return res;
+
+	arena.pos += doc->tape.num_recs * sizeof(*recs);
+	doc->tape.capacity = doc->tape.num_recs;
+
+	ins = doc->tape.num_inputs;
+	outs = doc->tape.num_outputs;
+	num_maps = 1 + ins + outs;
+
+	doc->maps = doc_alloc(&arena, num_maps, sizeof(*doc->maps));
+	doc->amounts = doc_alloc(&arena, outs, sizeof(*doc->amounts));
+	doc->script_offsets = doc_alloc(&arena, outs,
+					sizeof(*doc->script_offsets));
+	doc->script_sizes = doc_alloc(&arena, outs, sizeof(*doc->script_sizes));
+	doc->prevout_offsets = doc_alloc(&arena, ins,
+					 sizeof(*doc->prevout_offsets));
+	doc->prevout_indexes = doc_alloc(&arena, ins,
+					 sizeof(*doc->prevout_indexes));
+	doc->sequences = doc_alloc(&arena, ins, sizeof(*doc->sequences));
+
+	if (!doc->maps || !doc->amounts || !doc->script_offsets ||
+	    !doc->script_sizes || !doc->prevout_offsets ||
+	    !doc->prevout_indexes || !doc->sequences)
+		goto too_small;
+
+	// tape records are in map order, so each map is one range
+	memset(doc->maps, 0, num_maps * sizeof(*doc->maps));
+	for (i = 0; i < doc->tape.num_recs; i++) {
+		switch (recs[i].scope) {
+		case PSBT_SCOPE_GLOBAL:
+			map = 0;
+			break;
+		case PSBT_SCOPE_INPUTS:
+			map = 1 + recs[i].index;
+			break;
+		default:
+			map = 1 + ins + recs[i].index;
+			break;
+		}
+
+		if (doc->maps[map].num_recs++ == 0)
+			doc->maps[map].first_rec = i;
+
+		if (recs[i].scope == PSBT_SCOPE_GLOBAL &&
+		    recs[i].type == PSBT_GLOBAL_UNSIGNED_TX)
+			psbt_tape_record(&doc->tape, &recs[i], &rec);
+	}
+
+	if (ins == 0 && outs == 0)
+		return PSBT_OK;
+
+	return psbt_btc_unsigned_tx_parse(rec.val, rec.val_size, &filler,
+					  doc_fill);
+
+too_small:
+	psbt_errmsg = "psbt_doc_build: block is too small, see "
+		"PSBT_DOC_BLOCK_SIZE";
+	return psbt_fail(PSBT_OOB_WRITE);
+}
+
+const struct psbt_doc_map *
+psbt_doc_input_map(const struct psbt_doc *doc, unsigned int n) {
+	return n < doc->tape.num_inputs ? &doc->maps[1 + n] : NULL;
+}
+
+const struct psbt_doc_map *
+psbt_doc_output_map(const struct psbt_doc *doc, unsigned int n) {
+	return n < doc->tape.num_outputs
+		? &doc->maps[1 + doc->tape.num_inputs + n]
+		: NULL;
+}
+
+uint64_t
+psbt_doc_output_total(const struct psbt_doc *doc) {
+	uint64_t total = 0;
+	unsigned int i;
+
+	for (i = 0; i < doc->tape.num_outputs; i++)
+		total += doc->amounts[i];
+
+	return total;
+}
+
+unsigned int
+psbt_doc_inputs_without(const struct psbt_doc *doc, unsigned char type,
+			unsigned int *inputs)
+{
+	const struct psbt_doc_map *map;
+	unsigned int i, j, n = 0;
+
+	for (i = 0; i < doc->tape.num_inputs; i++) {
+		map = &doc->maps[1 + i];
+		for (j = 0; j < map->num_recs; j++) {
+			if (doc->tape.recs[map->first_rec + j].type == type)
+				break;
+		}
+		if (j == map->num_recs)
+			inputs[n++] = i;
+	}
+
+	return n;
+}
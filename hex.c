@@ -0,0 +1,221 @@
+
+#include "hex.h"
+#include "cpu.h"
+#include "common.h"
+
+static const unsigned char hex_table[16] = "0123456789abcdef";
+
+static const signed char hex_dtable[256] = {
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	 0,  1,  2,  3,  4,  5,  6,  7,  8,  9, -1, -1, -1, -1, -1, -1,
+	-1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+};
+
+#ifdef PSBT_X86
+#include <immintrin.h>
+
+#define SSE41 __attribute__((target("sse4.1")))
+#define AVX2 __attribute__((target("avx2")))
+
+/*
+ * The vector kernels work on whole blocks only and return how many input
+ * bytes they consumed. Decoders stop in front of the first block holding a
+ * non-hex character, the scalar loop then picks up from there and reports
+ * the error.
+ */
+
+static SSE41 __m128i
+hex_nibbles_sse41(__m128i v, __m128i *bad) {
+	const __m128i digit =
+		_mm_sub_epi8(v, _mm_set1_epi8('0'));
+	const __m128i alpha =
+		_mm_sub_epi8(_mm_or_si128(v, _mm_set1_epi8(0x20)),
+			     _mm_set1_epi8('a'));
+	const __m128i is_digit =
+		_mm_cmpeq_epi8(_mm_min_epu8(digit, _mm_set1_epi8(9)), digit);
+	const __m128i is_alpha =
+		_mm_cmpeq_epi8(_mm_min_epu8(alpha, _mm_set1_epi8(5)), alpha);
+
+	*bad = _mm_or_si128(*bad, _mm_xor_si128(_mm_or_si128(is_digit, is_alpha),
+						_mm_set1_epi8(-1)));
+
+	return _mm_blendv_epi8(_mm_add_epi8(alpha, _mm_set1_epi8(10)), digit,
+			       is_digit);
+}
+
+static SSE41 size_t
+hex_decode_sse41(const u8 *src, size_t len, u8 *dest) {
+	const __m128i weights = _mm_set1_epi16(0x0110);
+	__m128i a, b, bad;
+	size_t i;
+
+	for (i = 0; i + 32 <= len; i += 32) {
+		bad = _mm_setzero_si128();
+		a = hex_nibbles_sse41(_mm_loadu_si128((const __m128i *)(src + i)),
+				      &bad);
+		b = hex_nibbles_sse41(_mm_loadu_si128((const __m128i *)(src + i + 16)),
+				      &bad);
+		if (!_mm_testz_si128(bad, bad))
+			break;
+
+		// (hi << 4) | lo for each pair of nibbles
+		a = _mm_maddubs_epi16(a, weights);
+		b = _mm_maddubs_epi16(b, weights);
+		_mm_storeu_si128((__m128i *)(dest + i / 2), _mm_packus_epi16(a, b));
+	}
+
+	return i;
+}
+
+static SSE41 size_t
+hex_encode_sse41(const u8 *src, size_t len, u8 *dest) {
+	const __m128i lut = _mm_loadu_si128((const __m128i *)hex_table);
+	const __m128i mask = _mm_set1_epi8(0x0f);
+	__m128i v, hi, lo;
+	size_t i;
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		v = _mm_loadu_si128((const __m128i *)(src + i));
+		hi = _mm_shuffle_epi8(lut, _mm_and_si128(_mm_srli_epi16(v, 4), mask));
+		lo = _mm_shuffle_epi8(lut, _mm_and_si128(v, mask));
+		_mm_storeu_si128((__m128i *)(dest + i * 2),
+				 _mm_unpacklo_epi8(hi, lo));
+		_mm_storeu_si128((__m128i *)(dest + i * 2 + 16),
+				 _mm_unpackhi_epi8(hi, lo));
+	}
+
+	return i;
+}
+
+static AVX2 __m256i
+hex_nibbles_avx2(__m256i v, __m256i *bad) {
+	const __m256i digit =
+		_mm256_sub_epi8(v, _mm256_set1_epi8('0'));
+	const __m256i alpha =
+		_mm256_sub_epi8(_mm256_or_si256(v, _mm256_set1_epi8(0x20)),
+				_mm256_set1_epi8('a'));
+	const __m256i is_digit =
+		_mm256_cmpeq_epi8(_mm256_min_epu8(digit, _mm256_set1_epi8(9)),
+				  digit);
+	const __m256i is_alpha =
+		_mm256_cmpeq_epi8(_mm256_min_epu8(alpha, _mm256_set1_epi8(5)),
+				  alpha);
+
+	*bad = _mm256_or_si256(*bad,
+			       _mm256_xor_si256(_mm256_or_si256(is_digit, is_alpha),
+						_mm256_set1_epi8(-1)));
+
+	return _mm256_blendv_epi8(_mm256_add_epi8(alpha, _mm256_set1_epi8(10)),
+				  digit, is_digit);
+}
+
+static AVX2 size_t
+hex_decode_avx2(const u8 *src, size_t len, u8 *dest) {
+	const __m256i weights = _mm256_set1_epi16(0x0110);
+	__m256i a, b, bad;
+	size_t i;
+
+	for (i = 0; i + 64 <= len; i += 64) {
+		bad = _mm256_setzero_si256();
+		a = hex_nibbles_avx2(_mm256_loadu_si256((const __m256i *)(src + i)),
+				     &bad);
+		b = hex_nibbles_avx2(_mm256_loadu_si256((const __m256i *)(src + i + 32)),
+				     &bad);
+		if (!_mm256_testz_si256(bad, bad))
+			break;
+
+		a = _mm256_maddubs_epi16(a, weights);
+		b = _mm256_maddubs_epi16(b, weights);
+
+		// packus works per 128-bit lane, put the quadwords back in order
+		_mm256_storeu_si256((__m256i *)(dest + i / 2),
+				    _mm256_permute4x64_epi64(_mm256_packus_epi16(a, b),
+							     0xd8));
+	}
+
+	return i;
+}
+
+static AVX2 size_t
+hex_encode_avx2(const u8 *src, size_t len, u8 *dest) {
+	const __m256i lut =
+		_mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)hex_table));
+	const __m256i mask = _mm256_set1_epi8(0x0f);
+	__m256i v, hi, lo, a, b;
+	size_t i;
+
+	for (i = 0; i + 32 <= len; i += 32) {
+		v = _mm256_loadu_si256((const __m256i *)(src + i));
+		hi = _mm256_shuffle_epi8(lut, _mm256_and_si256(_mm256_srli_epi16(v, 4),
+							       mask));
+		lo = _mm256_shuffle_epi8(lut, _mm256_and_si256(v, mask));
+		a = _mm256_unpacklo_epi8(hi, lo);
+		b = _mm256_unpackhi_epi8(hi, lo);
+		_mm256_storeu_si256((__m256i *)(dest + i * 2),
+				    _mm256_permute2x128_si256(a, b, 0x20));
+		_mm256_storeu_si256((__m256i *)(dest + i * 2 + 32),
+				    _mm256_permute2x128_si256(a, b, 0x31));
+	}
+
+	return i;
+}
+
+#endif /* PSBT_X86 */
+
+void hex_encode(const unsigned char *src, size_t len, unsigned char *dest) {
+	size_t i = 0;
+
+#ifdef PSBT_X86
+	unsigned int cpu = cpu_features();
+
+	if (cpu & CPU_AVX2)
+		i = hex_encode_avx2(src, len, dest);
+	if (cpu & CPU_SSE41)
+		i += hex_encode_sse41(src + i, len - i, dest + i * 2);
+#endif
+
+	for (; i < len; i++) {
+		dest[i * 2]     = hex_table[src[i] >> 4];
+		dest[i * 2 + 1] = hex_table[src[i] & 0xf];
+	}
+}
+
+int hex_decode(const unsigned char *src, size_t len, unsigned char *dest) {
+	size_t i = 0;
+	int hi, lo;
+
+	if (len % 2 != 0)
+		return 0;
+
+#ifdef PSBT_X86
+	unsigned int cpu = cpu_features();
+
+	if (cpu & CPU_AVX2)
+		i = hex_decode_avx2(src, len, dest);
+	if (cpu & CPU_SSE41)
+		i += hex_decode_sse41(src + i, len - i, dest + i / 2);
+#endif
+
+	for (; i < len; i += 2) {
+		hi = hex_dtable[src[i]];
+		lo = hex_dtable[src[i + 1]];
+		if ((hi | lo) < 0)
+			return 0;
+		dest[i / 2] = (u8)(hi << 4 | lo);
+	}
+
+	return 1;
+}
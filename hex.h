@@ -0,0 +1,14 @@
+
+#ifndef PSBT_HEX_H
+#define PSBT_HEX_H
+
+#include <stddef.h>
+
+/* writes len * 2 lowercase hex characters to dest, no nul terminator */
+void hex_encode(const unsigned char *src, size_t len, unsigned char *dest);
+
+/* decodes len (even) hex characters into len / 2 bytes at dest. returns 0 if
+ * a non-hex character was found, in which case dest is partially written */
+int hex_decode(const unsigned char *src, size_t len, unsigned char *dest);
+
+#endif /* PSBT_HEX_H */
@@ -0,0 +1,213 @@
+
+#include <string.h>
+
+#include "psbt.h"
+#include "parser.h"
+#include "common.h"
+
+struct index_builder {
+	struct psbt_index *idx;
+	unsigned int next_map; /* first map that hasn't been opened yet */
+	int overflow;
+};
+
+/* give maps up to and including last their (empty) record range */
+static void index_open_maps(struct index_builder *b, unsigned int last) {
+	struct psbt_index *idx = b->idx;
+
+	for (; b->next_map <= last; b->next_map++) {
+		idx->maps[b->next_map].first_rec = idx->num_recs;
+		idx->maps[b->next_map].num_recs = 0;
+	}
+}
+
+static void index_elem(struct psbt_elem *elem) {
+	struct index_builder *b = (struct index_builder *)elem->user_data;
+	struct psbt_index *idx = b->idx;
+	struct psbt_index_rec *irec;
+	struct psbt_record *rec;
+	unsigned int map;
+
+	if (elem->type == PSBT_ELEM_TXELEM) {
+		// only the global unsigned tx is forwarded by the parser
+		switch (elem->elem.txelem->elem_type) {
+		case PSBT_TXELEM_TXIN:
+			idx->num_inputs++;
+			break;
+		case PSBT_TXELEM_TXOUT:
+			idx->num_outputs++;
+			break;
+		default:
+			break;
+		}
+		return;
+	}
+
+	rec = elem->elem.rec;
+
+	switch (rec->scope) {
+	case PSBT_SCOPE_GLOBAL:
+		map = 0;
+		break;
+	case PSBT_SCOPE_INPUTS:
+		map = 1 + elem->index;
+		break;
+	case PSBT_SCOPE_OUTPUTS:
+		map = 1 + idx->num_inputs + elem->index;
+		break;
+	default:
+		return;
+	}
+
+	if (b->overflow)
+		return;
+
+	if (map >= idx->maps_capacity || idx->num_recs >= idx->recs_capacity) {
+		b->overflow = 1;
+		return;
+	}
+
+	index_open_maps(b, map);
+
+	irec = &idx->recs[idx->num_recs++];
+	irec->type = rec->type;
+	irec->key_offset = rec->key - idx->data;
+	irec->key_size = rec->key_size;
+	irec->val_offset = rec->val - idx->data;
+	irec->val_size = rec->val_size;
+
+	idx->maps[map].num_recs++;
+}
+
+enum psbt_result
+psbt_index_init(struct psbt_index *idx, struct psbt_index_map *maps,
+		size_t maps_capacity, struct psbt_index_rec *recs,
+		size_t recs_capacity)
+{
+	idx->data = NULL;
+	idx->data_size = 0;
+	idx->maps = maps;
+	idx->maps_capacity = maps_capacity;
+	idx->recs = recs;
+	idx->recs_capacity = recs_capacity;
+	idx->num_recs = 0;
+	idx->num_inputs = 0;
+	idx->num_outputs = 0;
+	return PSBT_OK;
+}
+
+enum psbt_result
+psbt_index_build(struct psbt_index *idx, const unsigned char *src,
+		 size_t src_size)
+{
+	struct index_builder builder = { .idx = idx, .next_map = 0,
+					 .overflow = 0 };
+	struct psbt_index_map *map;
+	struct psbt_index_rec *last;
+	struct psbt psbt;
+	enum psbt_result res;
+	unsigned int i, num_maps, pos;
+
+	idx->data = src;
+	idx->data_size = src_size;
+	idx->num_recs = 0;
+	idx->num_inputs = 0;
+	idx->num_outputs = 0;
+
+	res = psbt_read_view(src, src_size, &psbt, index_elem, &builder);
+	if (res != PSBT_OK)
+		return res;
+
+	num_maps = 1 + idx->num_inputs + idx->num_outputs;
+
+	if (builder.overflow || num_maps > idx->maps_capacity) {
+		psbt_errmsg = "psbt_index_build: index arrays are too small";
+		return psbt_fail(PSBT_OOB_WRITE);
+	}
+
+	index_open_maps(&builder, num_maps - 1);
+
+	// every map ends with a single terminator byte, so map offsets
+	// follow from the records alone
+	pos = sizeof(PSBT_MAGIC) + 1;
+	for (i = 0; i < num_maps; i++) {
+		map = &idx->maps[i];
+		map->offset = pos;
+		if (map->num_recs) {
+			last = &idx->recs[map->first_rec + map->num_recs - 1];
+			pos = last->val_offset + last->val_size;
+		}
+		pos++;
+	}
+
+	return PSBT_OK;
+}
+
+const struct psbt_index_map *
+psbt_index_map(const struct psbt_index *idx, enum psbt_scope scope,
+	       unsigned int n)
+{
+	switch (scope) {
+	case PSBT_SCOPE_GLOBAL:
+		return n == 0 ? &idx->maps[0] : NULL;
+	case PSBT_SCOPE_INPUTS:
+		return n < idx->num_inputs ? &idx->maps[1 + n] : NULL;
+	case PSBT_SCOPE_OUTPUTS:
+		return n < idx->num_outputs
+			? &idx->maps[1 + idx->num_inputs + n]
+			: NULL;
+	}
+
+	return NULL;
+}
+
+const struct psbt_index_map *
+psbt_index_global(const struct psbt_index *idx) {
+	return psbt_index_map(idx, PSBT_SCOPE_GLOBAL, 0);
+}
+
+const struct psbt_index_map *
+psbt_index_input(const struct psbt_index *idx, unsigned int n) {
+	return psbt_index_map(idx, PSBT_SCOPE_INPUTS, n);
+}
+
+const struct psbt_index_map *
+psbt_index_output(const struct psbt_index *idx, unsigned int n) {
+	return psbt_index_map(idx, PSBT_SCOPE_OUTPUTS, n);
+}
+
+const struct psbt_index_rec *
+psbt_index_find(const struct psbt_index *idx, enum psbt_scope scope,
+		unsigned int n, unsigned char type, const unsigned char *key,
+		unsigned int key_size)
+{
+	const struct psbt_index_map *map = psbt_index_map(idx, scope, n);
+	const struct psbt_index_rec *irec;
+	unsigned int i;
+
+	if (map == NULL)
+		return NULL;
+
+	for (i = 0; i < map->num_recs; i++) {
+		irec = &idx->recs[map->first_rec + i];
+		if (irec->type == type && irec->key_size == key_size &&
+		    (key_size == 0 ||
+		     memcmp(idx->data + irec->key_offset, key, key_size) == 0))
+			return irec;
+	}
+
+	return NULL;
+}
+
+void
+psbt_index_record(const struct psbt_index *idx,
+		  const struct psbt_index_rec *irec, enum psbt_scope scope,
+		  struct psbt_record *rec)
+{
+	rec->type = irec->type;
+	rec->key = (unsigned char *)idx->data + irec->key_offset;
+	rec->key_size = irec->key_size;
+	rec->val = (unsigned char *)idx->data + irec->val_offset;
+	rec->val_size = irec->val_size;
+	rec->scope = scope;
+}
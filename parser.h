@@ -0,0 +1,45 @@
+
+#ifndef PSBT_PARSER_H
+#define PSBT_PARSER_H
+
+#include "psbt.h"
+#include "sha256.h"
+
+/* parser internals shared by psbt_read and the incremental parsers */
+
+struct psbt_tx_counter {
+	int inputs;
+	int outputs;
+	void *user_data;
+	psbt_elem_handler *handler;
+};
+
+/*
+ * Hands a complete record to the user. The global unsigned tx is parsed
+ * first to count inputs and outputs, its txelems are forwarded as well.
+ */
+enum psbt_result
+psbt_emit_record(struct psbt_tx_counter *counter, struct psbt_record *rec,
+		 int index);
+
+/* psbt_read_view rejecting duplicate keys like a strict psbt_read */
+enum psbt_result
+psbt_read_view_strict(const unsigned char *src, size_t src_size,
+		      struct psbt *tx, psbt_elem_handler *elem_handler,
+		      void *user_data);
+
+/* records where a parse failed in the calling thread's psbt_last_error */
+enum psbt_result
+psbt_set_error(enum psbt_result res, size_t offset, enum psbt_state state);
+
+/* psbt_set_error for a failure outside the parsers, psbt_errmsg is set */
+enum psbt_result
+psbt_fail(enum psbt_result res);
+
+/* the bytes of a serialized tx that its txid is the hash of, leaving out
+ * the marker, flag and witnesses of a segwit serialization */
+enum psbt_result
+psbt_tx_txid_msg(unsigned char *tx, unsigned int tx_size, int allow_witness,
+		 struct sha256_msg *msg);
+
+#endif /* PSBT_PARSER_H */
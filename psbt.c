@@ -2,7 +2,6 @@
 #define _DEFAULT_SOURCE
 
 #include <stdio.h>
-#include <ctype.h>
 #include <string.h>
 #include <endian.h>
 #include <assert.h>
@@ -10,6 +9,8 @@
 #include "compactsize.h"
 #include "tx.h"
 #include "base64.h"
+#include "hex.h"
+#include "parser.h"
 
 #ifdef DEBUG
   #define debug(...) fprintf(stderr, __VA_ARGS__)
@@ -17,17 +18,29 @@
   #define debug(...)
 #endif
 
-char *psbt_errmsg = NULL;
+PSBT_THREAD_LOCAL char *psbt_errmsg = NULL;
+
+static PSBT_THREAD_LOCAL struct psbt_error last_error;
 
 const unsigned char PSBT_MAGIC[4] = {0x70, 0x73, 0x62, 0x74};
 
 #define ASSERT_SPACE(s) \
 	if (tx->write_pos+(s) > tx->data + tx->data_capacity) { \
 		psbt_errmsg = "write out of bounds " __FILE__ ":" STRINGIZE(__LINE__); \
-		return PSBT_OOB_WRITE; \
+		return psbt_fail(PSBT_OOB_WRITE); \
+	}
+
+#define READ_SPACE(s) \
+	if (tx->write_pos+(s) > tx->data + src_size) { \
+		psbt_errmsg = "read out of bounds " __FILE__ ":" STRINGIZE(__LINE__); \
+		return psbt_fail(PSBT_READ_ERROR); \
 	}
 
 size_t psbt_size(struct psbt *tx) {
+	if (tx->measure)
+		return tx->measured;
+	if (tx->iovs)
+		return tx->iovs->size;
 	return tx->write_pos - tx->data;
 }
 
@@ -38,15 +51,124 @@ static void hex_print(unsigned char *data, size_t len) {
 
 
 
+/* make room for size more bytes in a growable psbt, doubling as we go */
+static enum psbt_result
+psbt_grow(struct psbt *tx, size_t size) {
+	size_t used = tx->write_pos - tx->data;
+	size_t capacity = tx->data_capacity ? tx->data_capacity : 256;
+	u8 *data;
+
+	while (capacity < used + size) {
+		if (capacity > SIZE_MAX / 2) {
+			capacity = used + size;
+			break;
+		}
+		capacity *= 2;
+	}
+
+	data = tx->alloc(tx->alloc_data, tx->data, tx->data_capacity,
+			   capacity);
+	if (data == NULL) {
+		psbt_errmsg = "psbt_grow: allocation failed";
+		return psbt_fail(PSBT_OOB_WRITE);
+	}
+
+	tx->data = data;
+	tx->write_pos = data + used;
+	tx->data_capacity = capacity;
+
+	return PSBT_OK;
+}
+
+/* appends size bytes at base to the iovec list, extending the last entry
+ * when they follow on directly */
+static enum psbt_result
+psbt_iov_add(struct psbt_iovs *iovs, const u8 *base, size_t size) {
+	struct iovec *last;
+
+	if (size == 0)
+		return PSBT_OK;
+
+	if (iovs->count) {
+		last = &iovs->iov[iovs->count - 1];
+		if ((const u8 *)last->iov_base + last->iov_len == base) {
+			last->iov_len += size;
+			iovs->size += size;
+			return PSBT_OK;
+		}
+	}
+
+	if (iovs->count == iovs->capacity) {
+		psbt_errmsg = "psbt_iov_add: out of iovecs";
+		return psbt_fail(PSBT_OOB_WRITE);
+	}
+
+	iovs->iov[iovs->count].iov_base = (void *)base;
+	iovs->iov[iovs->count].iov_len = size;
+	iovs->count++;
+	iovs->size += size;
+
+	return PSBT_OK;
+}
+
+/*
+ * All writer output goes through psbt_reserve. A measuring psbt only counts
+ * the bytes, in which case NULL is returned and nothing may be written.
+ */
+static enum psbt_result
+psbt_reserve(struct psbt *tx, size_t size, u8 **dest) {
+	enum psbt_result res;
+
+	*dest = NULL;
+
+	if (tx->value_len_size) {
+		psbt_errmsg = "psbt_reserve: a value is still being written, "
+			"call psbt_end_value first";
+		return psbt_fail(PSBT_INVALID_STATE);
+	}
+
+	if (tx->measure) {
+		tx->measured += size;
+		return PSBT_OK;
+	}
+
+	if (tx->iovs) {
+		// framing goes in the scratch buffer, referenced by an iovec
+		ASSERT_SPACE(size);
+		res = psbt_iov_add(tx->iovs, tx->write_pos, size);
+		if (res != PSBT_OK)
+			return res;
+		*dest = tx->write_pos;
+		tx->write_pos += size;
+		return PSBT_OK;
+	}
+
+	if (tx->alloc && size > tx->data_capacity - psbt_size(tx)) {
+		res = psbt_grow(tx, size);
+		if (res != PSBT_OK)
+			return res;
+	}
+
+	ASSERT_SPACE(size);
+	*dest = tx->write_pos;
+	tx->write_pos += size;
+
+	return PSBT_OK;
+}
+
 static enum psbt_result
 psbt_write_header(struct psbt *tx) {
-	ASSERT_SPACE(sizeof(PSBT_MAGIC));
-	memcpy(tx->write_pos, PSBT_MAGIC, sizeof(PSBT_MAGIC));
-	tx->write_pos += sizeof(PSBT_MAGIC);
+	enum psbt_result res;
+	u8 *dest;
 
-	ASSERT_SPACE(1);
-	*tx->write_pos = 0xff;
-	tx->write_pos++;
+	res = psbt_reserve(tx, sizeof(PSBT_MAGIC) + 1, &dest);
+	if (res != PSBT_OK)
+		return res;
+
+	if (dest) {
+		memcpy(dest, PSBT_MAGIC, sizeof(PSBT_MAGIC));
+		dest[sizeof(PSBT_MAGIC)] = 0xff;
+	}
 
 	tx->state = PSBT_ST_GLOBAL;
 
@@ -60,9 +182,129 @@ psbt_init(struct psbt *tx, unsigned char *dest, size_t dest_size) {
 	tx->data = dest;
 	tx->data_capacity = dest_size;
 	tx->state = PSBT_ST_INIT;
+	tx->measure = 0;
+	tx->measured = 0;
+	tx->alloc = NULL;
+	tx->alloc_data = NULL;
+	tx->iovs = NULL;
+	tx->value_pos = 0;
+	tx->value_len_size = 0;
+	tx->strict = 0;
+	return PSBT_OK;
+}
+
+void
+psbt_iovs_init(struct psbt_iovs *iovs, struct iovec *iov, size_t capacity,
+	       size_t threshold)
+{
+	iovs->iov = iov;
+	iovs->capacity = capacity;
+	iovs->count = 0;
+	iovs->size = 0;
+	iovs->threshold = threshold;
+}
+
+enum psbt_result
+psbt_init_iov(struct psbt *tx, unsigned char *scratch, size_t scratch_size,
+	      struct psbt_iovs *iovs)
+{
+	psbt_init(tx, scratch, scratch_size);
+	tx->iovs = iovs;
+	return PSBT_OK;
+}
+
+enum psbt_result
+psbt_init_alloc(struct psbt *tx, psbt_realloc *realloc_fn, void *alloc_data) {
+	psbt_init(tx, NULL, 0);
+	tx->alloc = realloc_fn;
+	tx->alloc_data = alloc_data;
+	return PSBT_OK;
+}
+
+void
+psbt_free(struct psbt *tx) {
+	if (tx->alloc && tx->data)
+		tx->alloc(tx->alloc_data, tx->data, tx->data_capacity, 0);
+
+	tx->data = tx->write_pos = NULL;
+	tx->data_capacity = 0;
+}
+
+void
+psbt_arena_init(struct psbt_arena *arena, unsigned char *buf,
+		size_t capacity)
+{
+	arena->buf = buf;
+	arena->capacity = capacity;
+	arena->used = 0;
+	arena->last = NULL;
+}
+
+void *
+psbt_arena_realloc(void *alloc_data, void *ptr, size_t old_size,
+		   size_t new_size)
+{
+	struct psbt_arena *arena = (struct psbt_arena *)alloc_data;
+	size_t start;
+	u8 *dest;
+
+	// the newest block grows and shrinks in place
+	if (ptr != NULL && ptr == arena->last) {
+		start = arena->last - arena->buf;
+		if (new_size > arena->capacity - start)
+			return NULL;
+		arena->used = start + new_size;
+		return new_size ? ptr : NULL;
+	}
+
+	// anything else is only released by psbt_arena_reset
+	if (new_size == 0)
+		return NULL;
+
+	// keep blocks pointer aligned
+	start = (arena->used + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+	if (start > arena->capacity || new_size > arena->capacity - start)
+		return NULL;
+
+	dest = arena->buf + start;
+	if (ptr != NULL)
+		memcpy(dest, ptr, old_size < new_size ? old_size : new_size);
+
+	arena->used = start + new_size;
+	arena->last = dest;
+	return dest;
+}
+
+void
+psbt_arena_reset(struct psbt_arena *arena) {
+	arena->used = 0;
+	arena->last = NULL;
+}
+
+enum psbt_result
+psbt_measure_init(struct psbt *tx) {
+	psbt_init(tx, NULL, 0);
+	tx->measure = 1;
 	return PSBT_OK;
 }
 
+size_t
+psbt_encoded_size(size_t psbt_len, enum psbt_encoding encoding) {
+	switch (encoding) {
+	case PSBT_ENCODING_RAW:
+		return psbt_len;
+	case PSBT_ENCODING_HEX:
+		return psbt_len * 2 + 1;
+	case PSBT_ENCODING_BASE64:
+		return base64_encoded_length(psbt_len) + 1;
+	case PSBT_ENCODING_BASE62:
+	case PSBT_ENCODING_PROTOBUF:
+		break;
+	}
+
+	return 0;
+}
+
 /* enum psbt_result */
 /* psbt_end_transaction(char *dest, size_t dest_len) */
 /* { */
@@ -73,9 +315,16 @@ psbt_init(struct psbt *tx, unsigned char *dest, size_t dest_size) {
 
 enum psbt_result
 psbt_close_records(struct psbt *tx) {
-	ASSERT_SPACE(1);
-	*tx->write_pos = '\0';
-	tx->write_pos++;
+	enum psbt_result res;
+	u8 *dest;
+
+	res = psbt_reserve(tx, 1, &dest);
+	if (res != PSBT_OK)
+		return res;
+
+	if (dest)
+		*dest = '\0';
+
 	return PSBT_OK;
 }
 
@@ -84,9 +333,14 @@ enum psbt_result
 psbt_finalize(struct psbt *tx) {
 	enum psbt_result res;
 
+	if (tx->state == PSBT_ST_OUTPUTS_END) {
+		tx->state = PSBT_ST_FINALIZED;
+		return PSBT_OK;
+	}
+
 	if (tx->state != PSBT_ST_OUTPUTS_NEW && tx->state != PSBT_ST_OUTPUTS) {
 		psbt_errmsg = "psbt_finalize: no output records found";
-		return PSBT_INVALID_STATE;
+		return psbt_fail(PSBT_INVALID_STATE);
 	}
 
 	res = psbt_close_records(tx);
@@ -98,43 +352,99 @@ psbt_finalize(struct psbt *tx) {
 	return PSBT_OK;
 }
 
+static size_t
+psbt_record_size(const struct psbt_record *rec) {
+	return compactsize_length(rec->key_size + 1) + rec->key_size + 1 +
+		compactsize_length(rec->val_size) + rec->val_size;
+}
+
+/* serializes rec at dest, which has psbt_record_size(rec) bytes */
+static u8 *
+psbt_put_record(u8 *dest, const struct psbt_record *rec) {
+	u32 key_size_with_type = rec->key_size + 1;
+
+	// key length, type and key
+	compactsize_write(dest, key_size_with_type);
+	dest += compactsize_length(key_size_with_type);
+	*dest++ = rec->type;
+	if (rec->key_size)
+		memcpy(dest, rec->key, rec->key_size);
+	dest += rec->key_size;
+
+	// value length and value
+	compactsize_write(dest, rec->val_size);
+	dest += compactsize_length(rec->val_size);
+	if (rec->val_size)
+		memcpy(dest, rec->val, rec->val_size);
+
+	return dest + rec->val_size;
+}
+
+/* copies small data into the scratch buffer, references the rest */
+static enum psbt_result
+psbt_iov_data(struct psbt *tx, const u8 *data, size_t size) {
+	enum psbt_result res;
+	u8 *dest;
+
+	if (size >= tx->iovs->threshold)
+		return psbt_iov_add(tx->iovs, data, size);
+
+	res = psbt_reserve(tx, size, &dest);
+	if (res != PSBT_OK)
+		return res;
+
+	if (size)
+		memcpy(dest, data, size);
+
+	return PSBT_OK;
+}
+
 static enum psbt_result
-psbt_write_record(struct psbt *tx, struct psbt_record *rec) {
-	u32 size;
+psbt_iov_record(struct psbt *tx, const struct psbt_record *rec) {
 	u32 key_size_with_type = rec->key_size + 1;
+	u32 key_len = compactsize_length(key_size_with_type);
+	u32 val_len = compactsize_length(rec->val_size);
+	enum psbt_result res;
+	u8 *dest;
 
-	// write key length
-	size = compactsize_length(key_size_with_type);
-	ASSERT_SPACE(size);
-	compactsize_write((u8*)tx->write_pos, key_size_with_type);
-	tx->write_pos += size;
+	res = psbt_reserve(tx, key_len + 1, &dest);
+	if (res != PSBT_OK)
+		return res;
+	compactsize_write(dest, key_size_with_type);
+	dest[key_len] = rec->type;
 
-	// write type
-	ASSERT_SPACE(1);
-	*tx->write_pos++ = rec->type;
+	res = psbt_iov_data(tx, rec->key, rec->key_size);
+	if (res != PSBT_OK)
+		return res;
 
-	// write key
-	ASSERT_SPACE(rec->key_size);
-	memcpy(tx->write_pos, rec->key, rec->key_size);
-	tx->write_pos += rec->key_size;
+	res = psbt_reserve(tx, val_len, &dest);
+	if (res != PSBT_OK)
+		return res;
+	compactsize_write(dest, rec->val_size);
 
-	// write value length
-	size = compactsize_length(rec->val_size);
-	ASSERT_SPACE(size);
-	compactsize_write((u8*)tx->write_pos, rec->val_size);
-	tx->write_pos += size;
+	return psbt_iov_data(tx, rec->val, rec->val_size);
+}
+
+static enum psbt_result
+psbt_write_record(struct psbt *tx, struct psbt_record *rec) {
+	enum psbt_result res;
+	u8 *dest;
+
+	if (tx->iovs)
+		return psbt_iov_record(tx, rec);
+
+	res = psbt_reserve(tx, psbt_record_size(rec), &dest);
+	if (res != PSBT_OK || dest == NULL)
+		return res;
 
-	// write value
-	ASSERT_SPACE(rec->val_size);
-	memcpy(tx->write_pos, rec->val, rec->val_size);
-	tx->write_pos += rec->val_size;
+	psbt_put_record(dest, rec);
 
 	return PSBT_OK;
 }
 
 static enum psbt_result
-psbt_read_header(struct psbt *tx) {
-	ASSERT_SPACE(4);
+psbt_read_header(struct psbt *tx, size_t src_size) {
+	READ_SPACE(sizeof(PSBT_MAGIC) + 1);
 
 	debug("magic %02X %02X %02X %02X\n",
 		*tx->write_pos,
@@ -144,14 +454,14 @@ psbt_read_header(struct psbt *tx) {
 
 	if (memcmp(tx->write_pos, PSBT_MAGIC, sizeof(PSBT_MAGIC)) != 0) {
 		psbt_errmsg = "psbt_read: invalid magic header";
-		return PSBT_READ_ERROR;
+		return psbt_fail(PSBT_READ_ERROR);
 	}
 
 	tx->write_pos += 4;
 
 	if (*tx->write_pos++ != 0xff) {
 		psbt_errmsg = "psbt_read: no 0xff found after magic";
-		return PSBT_READ_ERROR;
+		return psbt_fail(PSBT_READ_ERROR);
 	}
 
 	tx->state = PSBT_ST_GLOBAL;
@@ -202,6 +512,12 @@ psbt_state_tostr(enum psbt_state state) {
 		return "OUTPUTS_NEW";
 	case PSBT_ST_FINALIZED:
 		return "FINALIZED";
+	case PSBT_ST_GLOBAL_END:
+		return "GLOBAL_END";
+	case PSBT_ST_INPUTS_END:
+		return "INPUTS_END";
+	case PSBT_ST_OUTPUTS_END:
+		return "OUTPUTS_END";
 	}
 
 	return "UNKNOWN_STATE";
@@ -268,7 +584,7 @@ psbt_read_record(struct psbt *tx, size_t src_size, struct psbt_record *rec)
 	u32 size_len;
 
 	size_len = compactsize_peek_length(*tx->write_pos);
-	ASSERT_SPACE(size_len);
+	READ_SPACE(size_len);
 	size = compactsize_read(tx->write_pos, &res);
 	assert(size > 0);
 
@@ -282,11 +598,9 @@ psbt_read_record(struct psbt *tx, size_t src_size, struct psbt_record *rec)
 
 	if (tx->write_pos + size > tx->data + src_size) {
 		psbt_errmsg = "psbt_read: record key size too large";
-		return PSBT_READ_ERROR;
+		return psbt_fail(PSBT_READ_ERROR);
 	}
 
-	ASSERT_SPACE(size);
-
 	rec->key_size = size - 1; // don't include type in key size
 	rec->type = *tx->write_pos;
 	rec->key = tx->write_pos + 1;
@@ -313,12 +627,13 @@ psbt_read_record(struct psbt *tx, size_t src_size, struct psbt_record *rec)
 
 		default:
 			psbt_errmsg = "psbt_read_record: invalid record state";
-			return PSBT_INVALID_STATE;
+			return psbt_fail(PSBT_INVALID_STATE);
 	}
 
+	READ_SPACE(1);
 	size_len = compactsize_peek_length(*tx->write_pos);
 
-	ASSERT_SPACE(size_len);
+	READ_SPACE(size_len);
 	size = compactsize_read(tx->write_pos, &res);
 
 	if (res != PSBT_OK)
@@ -328,24 +643,156 @@ psbt_read_record(struct psbt *tx, size_t src_size, struct psbt_record *rec)
 
 	if (tx->write_pos + size > tx->data + src_size) {
 		psbt_errmsg = "psbt_read: record value size too large";
-		return PSBT_READ_ERROR;
+		return psbt_fail(PSBT_READ_ERROR);
 	}
 
 	rec->val_size = size;
 	rec->val = tx->write_pos;
 
-	ASSERT_SPACE(size);
 	tx->write_pos += size;
 
 	return PSBT_OK;
 }
 
-struct psbt_tx_counter {
-	int inputs;
-	int outputs;
-	void *user_data;
-	psbt_elem_handler *handler;
-} counter;
+/*
+ * (type, key) pairs seen in the current map, open addressing. Used to
+ * find duplicate keys. Moving on to the next map bumps a generation
+ * counter instead of clearing the slots. Small enough (32 KiB) to live on
+ * the stack of the call using it.
+ */
+#define KEYSET_SLOTS (PSBT_MAP_MAX_RECORDS * 2)
+
+struct keyset_slot {
+	const u8 *key;
+	u32 key_size;
+	u8 gen;
+	u8 type;
+	u8 tag;   /* top byte of the hash, skips most memcmps */
+	u8 src;   /* psbt_combine source that had the key last */
+};
+
+struct keyset {
+	struct keyset_slot slots[KEYSET_SLOTS];
+	u8 gen;
+	u32 count;
+};
+
+static u32 keyset_hash(const struct psbt_record *rec) {
+	u32 h = 2166136261u ^ rec->type;
+	u32 i;
+
+	h *= 16777619u;
+	for (i = 0; i < rec->key_size; i++) {
+		h ^= rec->key[i];
+		h *= 16777619u;
+	}
+
+	return h;
+}
+
+/*
+ * 1 if the key of rec is new in the current map, 0 if source src already
+ * had it and 2 if only earlier sources did. -1 if the keyset is full and
+ * doesn't have it, it may still be a duplicate then, see map_has_key.
+ */
+static int keyset_add(struct keyset *keys, const struct psbt_record *rec,
+		      u8 src)
+{
+	u32 hash = keyset_hash(rec);
+	u32 i = hash & (KEYSET_SLOTS - 1);
+	u8 tag = hash >> 24;
+	struct keyset_slot *slot;
+
+	for (;; i = (i + 1) & (KEYSET_SLOTS - 1)) {
+		slot = &keys->slots[i];
+
+		if (slot->gen != keys->gen)
+			break;
+
+		if (slot->tag == tag && slot->type == rec->type &&
+		    slot->key_size == rec->key_size &&
+		    memcmp(slot->key, rec->key, rec->key_size) == 0) {
+			if (slot->src == src)
+				return 0;
+			slot->src = src;
+			return 2;
+		}
+	}
+
+	if (keys->count >= PSBT_MAP_MAX_RECORDS)
+		return -1;
+
+	slot->gen = keys->gen;
+	slot->tag = tag;
+	slot->type = rec->type;
+	slot->key = rec->key;
+	slot->key_size = rec->key_size;
+	slot->src = src;
+	keys->count++;
+
+	return 1;
+}
+
+static void keyset_init(struct keyset *keys) {
+	memset(keys->slots, 0, sizeof(keys->slots));
+	keys->gen = 0;
+	keys->count = 0;
+}
+
+static void keyset_next_map(struct keyset *keys) {
+	if (++keys->gen == 0) {
+		memset(keys->slots, 0, sizeof(keys->slots));
+		keys->gen = 1;
+	}
+	keys->count = 0;
+}
+
+/*
+ * Whether the key of rec is among the serialized records in [p, end),
+ * which have all been read before. The fallback once a keyset is full:
+ * slower, but maps of any size are checked.
+ */
+static int map_has_key(const u8 *p, const u8 *end,
+		       const struct psbt_record *rec)
+{
+	enum psbt_result res = PSBT_OK;
+	u64 key_size, val_size;
+
+	while (p < end) {
+		key_size = compactsize_read((u8 *)p, &res);
+		p += compactsize_peek_length(*p);
+		if (key_size == rec->key_size + 1 && p[0] == rec->type &&
+		    memcmp(p + 1, rec->key, rec->key_size) == 0)
+			return 1;
+		p += key_size;
+
+		val_size = compactsize_read((u8 *)p, &res);
+		p += compactsize_peek_length(*p) + val_size;
+	}
+
+	return 0;
+}
+
+/*
+ * strict mode check of a record just read by psbt_parse, the current map
+ * starts at map_start and rec at rec_start
+ */
+static enum psbt_result
+keyset_check(struct keyset *keys, const struct psbt_record *rec,
+	     const u8 *map_start, const u8 *rec_start)
+{
+	int added = keyset_add(keys, rec, 0);
+
+	if (added < 0)
+		added = !map_has_key(map_start, rec_start, rec);
+
+	if (!added) {
+		psbt_errmsg = "psbt_read: duplicate key in map";
+		return psbt_fail(PSBT_READ_ERROR);
+	}
+
+	return PSBT_OK;
+}
 
 static void tx_counter(struct psbt_txelem *elem) {
 	struct psbt_elem psbt_elem;
@@ -373,18 +820,47 @@ static void tx_counter(struct psbt_txelem *elem) {
 }
 
 enum psbt_result
-psbt_read(const unsigned char *src, size_t src_size, struct psbt *tx,
-	  psbt_elem_handler *elem_handler, void* user_data)
+psbt_emit_record(struct psbt_tx_counter *counter, struct psbt_record *rec,
+		 int index)
 {
-	struct psbt_record rec;
+	struct psbt_elem elem;
 	enum psbt_result res;
 
-	struct psbt_elem elem;
-	elem.type = PSBT_ELEM_RECORD;
-	elem.user_data = user_data;
+	if (rec->scope == PSBT_SCOPE_GLOBAL &&
+	    rec->type == PSBT_GLOBAL_UNSIGNED_TX) {
+		// parse transaction for number of inputs/outputs
+		res = psbt_btc_unsigned_tx_parse(rec->val, rec->val_size,
+						 (void*)counter, tx_counter);
+
+		if (res != PSBT_OK)
+			return res;
+	}
+
+	// record callback
+	if (counter->handler) {
+		elem.type = PSBT_ELEM_RECORD;
+		elem.user_data = counter->user_data;
+		elem.index = index;
+		elem.elem.rec = rec;
+		counter->handler(&elem);
+	}
+
+	return PSBT_OK;
+}
+
+/*
+ * Parses the serialized psbt at tx->data. Never writes to it, so tx->data
+ * may point at read-only memory. keys is only used in strict mode.
+ */
+static enum psbt_result
+psbt_parse(struct psbt *tx, size_t src_size, psbt_elem_handler *elem_handler,
+	   void *user_data, struct keyset *keys)
+{
+	struct psbt_record rec;
+	enum psbt_result res;
 
 	int kvs = 0;
-	u8 *end;
+	u8 *end, *map_start = NULL, *rec_start;
 
 	struct psbt_tx_counter counter = {
 		.inputs = 0,
@@ -393,34 +869,21 @@ psbt_read(const unsigned char *src, size_t src_size, struct psbt *tx,
 		.handler = elem_handler,
 	};
 
-	if (tx->state != PSBT_ST_INIT) {
-		psbt_errmsg = "psbt_read: psbt not initialized, use psbt_init first";
-		return PSBT_INVALID_STATE;
-	}
-
-	if (src_size > tx->data_capacity) {
-		psbt_errmsg = "psbt_read: read buffer is larger than psbt capacity";
-		return PSBT_OOB_WRITE;
-	}
-
-	if (src != tx->data)
-		memcpy(tx->data, src, src_size);
-
 	// parsing should try to get this to the finalized state,
 	// otherwise it's an invalid psbt
 	tx->state = PSBT_ST_INIT;
 	tx->write_pos = tx->data;
 
-	// XXX: needed so that the asserts work properly. this is probably fine...
-	tx->data_capacity = src_size;
-
 	end = tx->data + src_size;
 
-	while (tx->state != PSBT_ST_FINALIZED && tx->write_pos <= end) {
+	if (tx->strict)
+		keyset_next_map(keys);
+
+	while (tx->state != PSBT_ST_FINALIZED && tx->write_pos < end) {
 		switch(tx->state) {
 		case PSBT_ST_INIT:
 			debug("reading header at %zu\n", tx->write_pos - tx->data);
-			res = psbt_read_header(tx);
+			res = psbt_read_header(tx, src_size);
 			if (res != PSBT_OK)
 				return res;
 			break;
@@ -430,14 +893,26 @@ psbt_read(const unsigned char *src, size_t src_size, struct psbt *tx,
 		case PSBT_ST_OUTPUTS:
 
 			if (*tx->write_pos == 0) {
+				if (tx->strict)
+					keyset_next_map(keys);
+				map_start = NULL;
+
 				switch (tx->state) {
 				case PSBT_ST_GLOBAL:
-					tx->state = PSBT_ST_INPUTS_NEW;
+					// no maps at all for empty input/output lists
+					if (counter.inputs > 0)
+						tx->state = PSBT_ST_INPUTS_NEW;
+					else if (counter.outputs > 0)
+						tx->state = PSBT_ST_OUTPUTS_NEW;
+					else
+						tx->state = PSBT_ST_FINALIZED;
 					break;
 
 				case PSBT_ST_INPUTS:
 					if (++kvs >= counter.inputs) {
-						tx->state = PSBT_ST_OUTPUTS_NEW;
+						tx->state = counter.outputs > 0
+							? PSBT_ST_OUTPUTS_NEW
+							: PSBT_ST_FINALIZED;
 						kvs = 0;
 					} else
 						tx->state = PSBT_ST_INPUTS_NEW;
@@ -456,30 +931,24 @@ psbt_read(const unsigned char *src, size_t src_size, struct psbt *tx,
 			}
 			else {
 				debug("reading record @ %zu\n", tx->write_pos - tx->data);
+				rec_start = tx->write_pos;
+				if (map_start == NULL)
+					map_start = rec_start;
 				res = psbt_read_record(tx, src_size, &rec);
 
 				if (res != PSBT_OK)
 					return res;
 
-				if (tx->state == PSBT_ST_GLOBAL &&
-				    rec.type == PSBT_GLOBAL_UNSIGNED_TX) {
-					// parse transaction for number of inputs/outputs
-					res = psbt_btc_tx_parse(rec.val,
-								rec.val_size,
-								(void*)&counter,
-								tx_counter);
-
+				if (tx->strict) {
+					res = keyset_check(keys, &rec, map_start,
+							   rec_start);
 					if (res != PSBT_OK)
 						return res;
 				}
 
-				// record callback
-				if (elem_handler) {
-					elem.type = PSBT_ELEM_RECORD;
-					elem.index = kvs;
-					elem.elem.rec = &rec;
-					elem_handler(&elem);
-				}
+				res = psbt_emit_record(&counter, &rec, kvs);
+				if (res != PSBT_OK)
+					return res;
 			}
 
 
@@ -497,6 +966,9 @@ psbt_read(const unsigned char *src, size_t src_size, struct psbt *tx,
 			tx->state = PSBT_ST_INPUTS;
 			break;
 
+		case PSBT_ST_GLOBAL_END:
+		case PSBT_ST_INPUTS_END:
+		case PSBT_ST_OUTPUTS_END:
 		case PSBT_ST_FINALIZED:
 			assert(!"impossible");
 			break;
@@ -505,54 +977,177 @@ psbt_read(const unsigned char *src, size_t src_size, struct psbt *tx,
 
 	if (tx->state != PSBT_ST_FINALIZED) {
 		psbt_errmsg = "psbt_read: invalid psbt";
-		return PSBT_INVALID_STATE;
+		return psbt_fail(PSBT_INVALID_STATE);
 	}
 	else if (tx->state == PSBT_ST_FINALIZED && *tx->write_pos != 0) {
 		psbt_errmsg = "psbt_read: expected null byte at end of psbt";
-		return PSBT_READ_ERROR;
+		return psbt_fail(PSBT_READ_ERROR);
 	}
 
 	tx->write_pos++;
 
+	// same rule as psbt_stream_feed, src holds exactly one psbt
+	if (tx->write_pos != end) {
+		psbt_errmsg = "psbt_read: data after end of psbt";
+		return psbt_fail(PSBT_READ_ERROR);
+	}
+
 	return PSBT_OK;
 }
 
 enum psbt_result
-psbt_write_global_record(struct psbt *tx, struct psbt_record *rec) {
-	if (tx->state == PSBT_ST_INIT) {
-		// write header if we haven't yet
-		psbt_write_header(tx);
-		tx->state = PSBT_ST_GLOBAL;
-	}
-	else if (tx->state != PSBT_ST_GLOBAL) {
-		psbt_errmsg = "psbt_write_global_record: you can only write a "
-			"global record after psbt_init and before "
-			"psbt_write_input_record";
-		return PSBT_INVALID_STATE;
-	}
-
-	return psbt_write_record(tx, rec);
+psbt_set_error(enum psbt_result res, size_t offset, enum psbt_state state) {
+	last_error.result = res;
+	last_error.offset = offset;
+	last_error.state = state;
+	return res;
 }
 
 enum psbt_result
-psbt_new_input_record_set(struct psbt *tx) {
-	enum psbt_result res;
-	if (tx->state == PSBT_ST_GLOBAL
-	 || tx->state == PSBT_ST_INPUTS_NEW
-	 || tx->state == PSBT_ST_INPUTS) {
-		res = psbt_close_records(tx);
-		if (res != PSBT_OK)
-			return res;
-		tx->state = PSBT_ST_INPUTS_NEW;
-		return PSBT_OK;
-	}
-	else if (tx->state != PSBT_ST_INPUTS) {
-		psbt_errmsg = "psbt_new_input_record_set: "
-			"this can only be called after psbt_write_global_record, "
-                        "psbt_new_input_record_set, "
-			"or psbt_write_input_record";
-		return PSBT_INVALID_STATE;
-	}
+psbt_fail(enum psbt_result res) {
+	return psbt_set_error(res, 0, PSBT_ST_INIT);
+}
+
+/* psbt_parse with a keyset of its own for checking duplicate keys */
+static enum psbt_result
+psbt_parse_strict(struct psbt *tx, size_t src_size,
+		  psbt_elem_handler *handler, void *user_data)
+{
+	struct keyset keys;
+
+	keyset_init(&keys);
+	return psbt_parse(tx, src_size, handler, user_data, &keys);
+}
+
+/* psbt_parse, noting where it stopped when it fails */
+static enum psbt_result
+psbt_parse_at(struct psbt *tx, size_t src_size, psbt_elem_handler *handler,
+	      void *user_data)
+{
+	enum psbt_result res;
+
+	if (tx->strict)
+		res = psbt_parse_strict(tx, src_size, handler, user_data);
+	else
+		res = psbt_parse(tx, src_size, handler, user_data, NULL);
+	if (res != PSBT_OK)
+		psbt_set_error(res, tx->write_pos - tx->data, tx->state);
+
+	return res;
+}
+
+enum psbt_result
+psbt_read(const unsigned char *src, size_t src_size, struct psbt *tx,
+	  psbt_elem_handler *elem_handler, void* user_data)
+{
+	if (tx->state != PSBT_ST_INIT) {
+		psbt_errmsg = "psbt_read: psbt not initialized, use psbt_init first";
+		return psbt_set_error(PSBT_INVALID_STATE, 0, tx->state);
+	}
+
+	if (src_size > tx->data_capacity && tx->alloc &&
+	    psbt_grow(tx, src_size) != PSBT_OK)
+		return psbt_set_error(PSBT_OOB_WRITE, 0, tx->state);
+
+	if (src_size > tx->data_capacity) {
+		psbt_errmsg = "psbt_read: read buffer is larger than psbt capacity";
+		return psbt_set_error(PSBT_OOB_WRITE, 0, tx->state);
+	}
+
+	if (src != tx->data)
+		memcpy(tx->data, src, src_size);
+
+	return psbt_parse_at(tx, src_size, elem_handler, user_data);
+}
+
+static void
+psbt_view_init(struct psbt *tx, const unsigned char *src, size_t src_size) {
+	// the parser only reads through data, see psbt_parse
+	tx->data = (unsigned char *)src;
+	tx->data_capacity = src_size;
+	tx->measure = 0;
+	tx->measured = 0;
+	tx->alloc = NULL;
+	tx->alloc_data = NULL;
+	tx->iovs = NULL;
+	tx->value_pos = 0;
+	tx->value_len_size = 0;
+	tx->strict = 0;
+}
+
+enum psbt_result
+psbt_read_view(const unsigned char *src, size_t src_size, struct psbt *tx,
+	       psbt_elem_handler *elem_handler, void *user_data)
+{
+	psbt_view_init(tx, src, src_size);
+	return psbt_parse_at(tx, src_size, elem_handler, user_data);
+}
+
+enum psbt_result
+psbt_read_view_strict(const unsigned char *src, size_t src_size,
+		      struct psbt *tx, psbt_elem_handler *elem_handler,
+		      void *user_data)
+{
+	psbt_view_init(tx, src, src_size);
+	tx->strict = 1;
+	return psbt_parse_at(tx, src_size, elem_handler, user_data);
+}
+
+/* state transitions for writing a record in scope, see psbt_write_global_record */
+static enum psbt_result
+psbt_enter_global(struct psbt *tx) {
+	enum psbt_result res;
+
+	if (tx->state == PSBT_ST_INIT) {
+		// write header if we haven't yet
+		res = psbt_write_header(tx);
+		if (res != PSBT_OK)
+			return res;
+	}
+	else if (tx->state != PSBT_ST_GLOBAL) {
+		psbt_errmsg = "psbt_write_global_record: you can only write a "
+			"global record after psbt_init and before "
+			"psbt_write_input_record";
+		return psbt_fail(PSBT_INVALID_STATE);
+	}
+
+	return PSBT_OK;
+}
+
+enum psbt_result
+psbt_write_global_record(struct psbt *tx, struct psbt_record *rec) {
+	enum psbt_result res;
+
+	res = psbt_enter_global(tx);
+	if (res != PSBT_OK)
+		return res;
+
+	return psbt_write_record(tx, rec);
+}
+
+enum psbt_result
+psbt_new_input_record_set(struct psbt *tx) {
+	enum psbt_result res;
+	if (tx->state == PSBT_ST_GLOBAL_END || tx->state == PSBT_ST_INPUTS_END) {
+		tx->state = PSBT_ST_INPUTS_NEW;
+		return PSBT_OK;
+	}
+	else if (tx->state == PSBT_ST_GLOBAL
+	 || tx->state == PSBT_ST_INPUTS_NEW
+	 || tx->state == PSBT_ST_INPUTS) {
+		res = psbt_close_records(tx);
+		if (res != PSBT_OK)
+			return res;
+		tx->state = PSBT_ST_INPUTS_NEW;
+		return PSBT_OK;
+	}
+	else if (tx->state != PSBT_ST_INPUTS) {
+		psbt_errmsg = "psbt_new_input_record_set: "
+			"this can only be called after psbt_write_global_record, "
+                        "psbt_new_input_record_set, "
+			"or psbt_write_input_record";
+		return psbt_fail(PSBT_INVALID_STATE);
+	}
 
 	return psbt_close_records(tx);
 }
@@ -561,7 +1156,13 @@ psbt_new_input_record_set(struct psbt *tx) {
 enum psbt_result
 psbt_new_output_record_set(struct psbt *tx) {
 	enum psbt_result res;
-	if (tx->state == PSBT_ST_INPUTS
+	if (tx->state == PSBT_ST_GLOBAL_END ||
+	    tx->state == PSBT_ST_INPUTS_END ||
+	    tx->state == PSBT_ST_OUTPUTS_END) {
+		tx->state = PSBT_ST_OUTPUTS_NEW;
+		return PSBT_OK;
+	}
+	else if (tx->state == PSBT_ST_INPUTS
 	    || tx->state == PSBT_ST_INPUTS_NEW
 	    || tx->state == PSBT_ST_OUTPUTS_NEW
 	    || tx->state == PSBT_ST_OUTPUTS)
@@ -575,30 +1176,183 @@ psbt_new_output_record_set(struct psbt *tx) {
 	else if (tx->state != PSBT_ST_OUTPUTS) {
 		psbt_errmsg = "psbt_new_output_record_set: "
 			"this can only be called after writing input records";
-		return PSBT_INVALID_STATE;
+		return psbt_fail(PSBT_INVALID_STATE);
+	}
+
+	return psbt_close_records(tx);
+}
+
+
+/* bytes to write before a new map of scope: header or terminators */
+static enum psbt_result
+psbt_map_prefix(struct psbt *tx, enum psbt_scope scope, size_t *size) {
+	switch (tx->state) {
+	case PSBT_ST_INIT:
+		*size = scope == PSBT_SCOPE_GLOBAL ? sizeof(PSBT_MAGIC) + 1 : 0;
+		return scope == PSBT_SCOPE_GLOBAL ? PSBT_OK : PSBT_INVALID_STATE;
+
+	case PSBT_ST_GLOBAL:
+		// records already written go in the same global map
+		*size = scope == PSBT_SCOPE_GLOBAL ? 0 : 1;
+		return PSBT_OK;
+
+	case PSBT_ST_GLOBAL_END:
+		*size = 0;
+		return scope == PSBT_SCOPE_GLOBAL ? PSBT_INVALID_STATE : PSBT_OK;
+
+	case PSBT_ST_INPUTS:
+		*size = 1;
+		return scope == PSBT_SCOPE_GLOBAL ? PSBT_INVALID_STATE : PSBT_OK;
+
+	case PSBT_ST_INPUTS_NEW:
+		// psbt_new_input_record_set opened an empty input map, an
+		// input map fills it and anything else has to close it
+		*size = scope == PSBT_SCOPE_INPUTS ? 0 : 1;
+		return scope == PSBT_SCOPE_GLOBAL ? PSBT_INVALID_STATE : PSBT_OK;
+
+	case PSBT_ST_INPUTS_END:
+		*size = 0;
+		return scope == PSBT_SCOPE_GLOBAL ? PSBT_INVALID_STATE : PSBT_OK;
+
+	case PSBT_ST_OUTPUTS:
+		*size = 1;
+		return scope == PSBT_SCOPE_OUTPUTS ? PSBT_OK : PSBT_INVALID_STATE;
+
+	case PSBT_ST_OUTPUTS_NEW:
+		*size = 0;
+		return scope == PSBT_SCOPE_OUTPUTS ? PSBT_OK : PSBT_INVALID_STATE;
+
+	case PSBT_ST_OUTPUTS_END:
+		*size = 0;
+		return scope == PSBT_SCOPE_OUTPUTS ? PSBT_OK : PSBT_INVALID_STATE;
+
+	case PSBT_ST_FINALIZED:
+		break;
+	}
+
+	*size = 0;
+	return PSBT_INVALID_STATE;
+}
+
+static void
+psbt_put_prefix(struct psbt *tx, u8 *dest, size_t prefix) {
+	if (tx->state == PSBT_ST_INIT) {
+		memcpy(dest, PSBT_MAGIC, sizeof(PSBT_MAGIC));
+		dest[sizeof(PSBT_MAGIC)] = 0xff;
+	}
+	else if (prefix)
+		*dest = '\0';
+}
+
+static enum psbt_result
+psbt_iov_map(struct psbt *tx, size_t prefix, const struct psbt_record *recs,
+	     size_t num_recs)
+{
+	enum psbt_result res;
+	size_t i;
+	u8 *dest;
+
+	res = psbt_reserve(tx, prefix, &dest);
+	if (res != PSBT_OK)
+		return res;
+	psbt_put_prefix(tx, dest, prefix);
+
+	for (i = 0; i < num_recs; i++) {
+		res = psbt_iov_record(tx, &recs[i]);
+		if (res != PSBT_OK)
+			return res;
 	}
 
 	return psbt_close_records(tx);
 }
 
+enum psbt_result
+psbt_write_map(struct psbt *tx, enum psbt_scope scope,
+	       const struct psbt_record *recs, size_t num_recs)
+{
+	enum psbt_result res;
+	size_t prefix, size, i;
+	u8 *dest;
+
+	res = psbt_map_prefix(tx, scope, &prefix);
+	if (res != PSBT_OK) {
+		psbt_errmsg = "psbt_write_map: maps must be written in global, "
+			"input, output order";
+		return psbt_fail(res);
+	}
+
+	if (tx->iovs) {
+		res = psbt_iov_map(tx, prefix, recs, num_recs);
+		if (res != PSBT_OK)
+			return res;
+		goto done;
+	}
+
+	size = prefix + 1;
+	for (i = 0; i < num_recs; i++)
+		size += psbt_record_size(&recs[i]);
+
+	res = psbt_reserve(tx, size, &dest);
+	if (res != PSBT_OK)
+		return res;
+
+	if (dest) {
+		psbt_put_prefix(tx, dest, prefix);
+		dest += prefix;
+
+		for (i = 0; i < num_recs; i++)
+			dest = psbt_put_record(dest, &recs[i]);
+
+		*dest = '\0';
+	}
+
+done:
+	switch (scope) {
+	case PSBT_SCOPE_GLOBAL:
+		tx->state = PSBT_ST_GLOBAL_END;
+		break;
+	case PSBT_SCOPE_INPUTS:
+		tx->state = PSBT_ST_INPUTS_END;
+		break;
+	case PSBT_SCOPE_OUTPUTS:
+		tx->state = PSBT_ST_OUTPUTS_END;
+		break;
+	}
+
+	return PSBT_OK;
+}
 
 enum psbt_result
 psbt_print(struct psbt *tx, FILE *stream) {
+	enum psbt_result res;
+
 	if (tx->state != PSBT_ST_FINALIZED) {
 		psbt_errmsg = "psbt_print: transaction is not finished";
-		return PSBT_INVALID_STATE;
+		return psbt_fail(PSBT_INVALID_STATE);
 	}
 
-	size_t size = psbt_size(tx);
-	for (size_t i = 0; i < size; ++i)
-		fprintf(stream, "%02x", tx->data[i]);
-	printf("\n");
+	if (tx->measure || tx->iovs) {
+		psbt_errmsg = "psbt_print: psbt is measuring or only "
+			"described by iovecs";
+		return psbt_fail(PSBT_INVALID_STATE);
+	}
+
+	res = psbt_encode_to_file(tx->data, psbt_size(tx), PSBT_ENCODING_HEX,
+				  stream);
+	if (res != PSBT_OK)
+		return res;
+
+	if (fputc('\n', stream) == EOF) {
+		psbt_errmsg = "psbt_print: write failed";
+		return psbt_fail(PSBT_WRITE_ERROR);
+	}
 
 	return PSBT_OK;
 }
 
-enum psbt_result
-psbt_write_input_record(struct psbt *tx, struct psbt_record *rec) {
+/* state transitions for writing a record in scope, see psbt_write_input_record */
+static enum psbt_result
+psbt_enter_inputs(struct psbt *tx) {
 	enum psbt_result res;
 	if (tx->state == PSBT_ST_GLOBAL) {
 		// close global records
@@ -606,19 +1360,36 @@ psbt_write_input_record(struct psbt *tx, struct psbt_record *rec) {
 			return res;
 		tx->state = PSBT_ST_INPUTS;
 	}
+	else if (tx->state == PSBT_ST_GLOBAL_END ||
+		 tx->state == PSBT_ST_INPUTS_END) {
+		// the previous map was closed by psbt_write_map
+		tx->state = PSBT_ST_INPUTS;
+	}
 	else if (tx->state != PSBT_ST_INPUTS && tx->state != PSBT_ST_INPUTS_NEW) {
 		psbt_errmsg = "psbt_write_input_record: attempting to write an "
 			"input record before any global records have been written."
 			" use psbt_write_global_record first";
-		return PSBT_INVALID_STATE;
+		return psbt_fail(PSBT_INVALID_STATE);
 	}
 
+	return PSBT_OK;
+}
+
+enum psbt_result
+psbt_write_input_record(struct psbt *tx, struct psbt_record *rec) {
+	enum psbt_result res;
+
+	res = psbt_enter_inputs(tx);
+	if (res != PSBT_OK)
+		return res;
+
 	return psbt_write_record(tx, rec);
 }
 
 
-enum psbt_result
-psbt_write_output_record(struct psbt *tx, struct psbt_record *rec) {
+/* state transitions for writing a record in scope, see psbt_write_output_record */
+static enum psbt_result
+psbt_enter_outputs(struct psbt *tx) {
 	enum psbt_result res;
 	if (tx->state == PSBT_ST_INPUTS) {
 		// close global records
@@ -626,50 +1397,147 @@ psbt_write_output_record(struct psbt *tx, struct psbt_record *rec) {
 			return res;
 		tx->state = PSBT_ST_OUTPUTS;
 	}
+	else if (tx->state == PSBT_ST_GLOBAL_END ||
+		 tx->state == PSBT_ST_INPUTS_END ||
+		 tx->state == PSBT_ST_OUTPUTS_END) {
+		tx->state = PSBT_ST_OUTPUTS;
+	}
 	else if (tx->state != PSBT_ST_OUTPUTS && tx->state != PSBT_ST_OUTPUTS_NEW) {
 		psbt_errmsg = "psbt_write_input_record: attempting to write an "
 			"input record before any global records have been written."
 			" use psbt_write_global_record first";
-		return PSBT_INVALID_STATE;
+		return psbt_fail(PSBT_INVALID_STATE);
 	}
 
+	return PSBT_OK;
+}
+
+enum psbt_result
+psbt_write_output_record(struct psbt *tx, struct psbt_record *rec) {
+	enum psbt_result res;
+
+	res = psbt_enter_outputs(tx);
+	if (res != PSBT_OK)
+		return res;
+
 	return psbt_write_record(tx, rec);
 }
 
+enum psbt_result
+psbt_begin_value(struct psbt *tx, struct psbt_record *rec, size_t size_hint) {
+	u32 key_size_with_type = rec->key_size + 1;
+	u32 key_len = compactsize_length(key_size_with_type);
+	u32 val_len = compactsize_length(size_hint);
+	enum psbt_result res;
+	u8 *dest;
 
-static inline u8 hexdigit( char hex ) {
-	return (hex <= '9') ? hex - '0' : toupper(hex) - 'A' + 10 ;
+	if (tx->measure || tx->iovs) {
+		psbt_errmsg = "psbt_begin_value: psbt has no buffer to write "
+			"the value into";
+		return psbt_fail(PSBT_INVALID_STATE);
+	}
+
+	switch (rec->scope) {
+	case PSBT_SCOPE_GLOBAL:
+		res = psbt_enter_global(tx);
+		break;
+	case PSBT_SCOPE_INPUTS:
+		res = psbt_enter_inputs(tx);
+		break;
+	case PSBT_SCOPE_OUTPUTS:
+		res = psbt_enter_outputs(tx);
+		break;
+	default:
+		psbt_errmsg = "psbt_begin_value: invalid record scope";
+		return psbt_fail(PSBT_INVALID_STATE);
+	}
+
+	if (res != PSBT_OK)
+		return res;
+
+	res = psbt_reserve(tx, key_len + key_size_with_type + val_len, &dest);
+	if (res != PSBT_OK)
+		return res;
+
+	compactsize_write(dest, key_size_with_type);
+	dest += key_len;
+	*dest++ = rec->type;
+	if (rec->key_size)
+		memcpy(dest, rec->key, rec->key_size);
+
+	// the length is filled in by psbt_end_value
+	tx->value_pos = psbt_size(tx) - val_len;
+	tx->value_len_size = val_len;
+
+	return PSBT_OK;
 }
 
+enum psbt_result
+psbt_value_reserve(struct psbt *tx, size_t size) {
+	if (size <= tx->data_capacity - psbt_size(tx))
+		return PSBT_OK;
+
+	if (tx->alloc)
+		return psbt_grow(tx, size);
+
+	psbt_errmsg = "psbt_value_reserve: out of space";
+	return psbt_fail(PSBT_OOB_WRITE);
+}
+
+enum psbt_result
+psbt_end_value(struct psbt *tx) {
+	size_t reserved = tx->value_len_size;
+	size_t start, size, len;
+	enum psbt_result res;
+	u8 *value;
+
+	if (reserved == 0) {
+		psbt_errmsg = "psbt_end_value: no psbt_begin_value in progress";
+		return psbt_fail(PSBT_INVALID_STATE);
+	}
+
+	start = tx->value_pos;
+	size = psbt_size(tx) - start - reserved;
+	len = compactsize_length(size);
+
+	if (len > reserved) {
+		res = psbt_value_reserve(tx, len - reserved);
+		if (res != PSBT_OK)
+			return res;
+	}
+
+	// move the value once if the hint was off
+	if (len != reserved) {
+		value = tx->data + start;
+		memmove(value + len, value + reserved, size);
+		tx->write_pos = value + len + size;
+	}
+
+	compactsize_write(tx->data + start, size);
+	tx->value_len_size = 0;
+
+	return PSBT_OK;
+}
+
+
 enum psbt_result
 psbt_hex_decode(const char *src, size_t src_size, unsigned char *dest,
 	        size_t dest_size) {
 
-	enum psbt_result res = PSBT_OK;
-
 	if (src_size % 2 != 0) {
 		psbt_errmsg = "psbt_decode: invalid hex string";
-		return PSBT_READ_ERROR;
+		return psbt_fail(PSBT_READ_ERROR);
 	}
 
 	if (dest_size < src_size / 2) {
 		psbt_errmsg = "psbt_decode: dest_size must be at least half the"
 			" size of src_size";
-		return PSBT_READ_ERROR;
+		return psbt_fail(PSBT_READ_ERROR);
 	}
 
-	if (res != PSBT_OK)
-		return res;
-
-	for (size_t i = 0; i < src_size; i += 2) {
-		u8 c1 = src[i];
-		u8 c2 = src[i+1];
-		if (!isxdigit(c1) || !isxdigit(c2)) {
-			psbt_errmsg = "psbt_decode: invalid hex string";
-			return PSBT_READ_ERROR;
-		}
-
-		*dest++ = hexdigit(c1) << 4 | hexdigit(c2);
+	if (!hex_decode((const u8*)src, src_size, dest)) {
+		psbt_errmsg = "psbt_decode: invalid hex string";
+		return psbt_fail(PSBT_READ_ERROR);
 	}
 
 	return PSBT_OK;
@@ -687,42 +1555,33 @@ psbt_decode(const char *src, size_t src_size, unsigned char *dest,
 	// simple sanity check before we look for base64 encoding
 	if (src_size < b64_magic_size) {
 		psbt_errmsg = "psbt_decode: psbt too small";
-		return PSBT_READ_ERROR;
+		return psbt_fail(PSBT_READ_ERROR);
 	}
 
 	// base64 detection
 	if (memcmp(src, "cHNid", b64_magic_size) == 0) {
 		u8 *c = base64_decode((unsigned char*)src, src_size, dest,
 					dest_size, psbt_size);
-		return c == NULL ? PSBT_READ_ERROR : PSBT_OK;
+		if (c == NULL) {
+			psbt_errmsg = "psbt_decode: invalid base64 string";
+			return psbt_fail(PSBT_READ_ERROR);
+		}
+		return PSBT_OK;
 	}
 
 	*psbt_size = src_size / 2;
 	return psbt_hex_decode(src, src_size, dest, dest_size);
 }
 
-static char hexchar(unsigned int val)
-{
-	if (val < 10)
-		return '0' + val;
-	if (val < 16)
-		return 'a' + val - 10;
-	assert(!"hexchar invalid val");
-}
-
 static enum psbt_result
-hex_encode(u8 *buf, size_t bufsize, u8 *dest, size_t dest_size) {
-	size_t i;
-
-	if (dest_size < bufsize * 2 + 1)
-		return PSBT_OOB_WRITE;
-
-	for (i = 0; i < bufsize; i++) {
-		unsigned int c = buf[i];
-		*(dest++) = hexchar(c >> 4);
-		*(dest++) = hexchar(c & 0xF);
+psbt_hex_encode(u8 *buf, size_t bufsize, u8 *dest, size_t dest_size) {
+	if (dest_size < bufsize * 2 + 1) {
+		psbt_errmsg = "psbt_encode: dest buffer too small";
+		return psbt_fail(PSBT_OOB_WRITE);
 	}
-	*dest = '\0';
+
+	hex_encode(buf, bufsize, dest);
+	dest[bufsize * 2] = '\0';
 
 	return PSBT_OK;
 }
@@ -734,7 +1593,8 @@ hex_encode(u8 *buf, size_t bufsize, u8 *dest, size_t dest_size) {
 
 static enum psbt_result
 protobuf_encode(u8 *psbt, size_t psbt_size, u8 *dest, size_t dest_size) {
-	return PSBT_NOT_IMPLEMENTED;
+	psbt_errmsg = "psbt_encode: protobuf is not implemented";
+	return psbt_fail(PSBT_NOT_IMPLEMENTED);
 }
 
 enum psbt_result
@@ -746,30 +1606,34 @@ psbt_encode_raw(unsigned char *psbt_data, size_t psbt_len,
 	enum psbt_result res;
 
 	switch (encoding) {
+	case PSBT_ENCODING_RAW:
+		if (dest_size < psbt_len) {
+			psbt_errmsg = "psbt_encode: dest buffer too small";
+			return psbt_fail(PSBT_OOB_WRITE);
+		}
+		memcpy(dest, psbt_data, psbt_len);
+		*out_len = psbt_len;
+		return PSBT_OK;
 	case PSBT_ENCODING_HEX:
-		res = hex_encode(psbt_data, psbt_len, dest, dest_size);
+		res = psbt_hex_encode(psbt_data, psbt_len, dest, dest_size);
 		*out_len = psbt_len * 2 + 1;
 		return res;
 	case PSBT_ENCODING_BASE64:
 		c = base64_encode(psbt_data, psbt_len, dest, dest_size, out_len);
 		if (c == NULL) {
 			psbt_errmsg = "psbt_encode: base64 encode failure";
-			return PSBT_WRITE_ERROR;
+			return psbt_fail(PSBT_WRITE_ERROR);
 		}
 		return PSBT_OK;
 	case PSBT_ENCODING_BASE62:
-		c = base62_encode(psbt_data, psbt_len, dest, dest_size, out_len);
-		if (c == NULL) {
-			psbt_errmsg = "psbt_encode: base62 encode failure";
-			return PSBT_WRITE_ERROR;
-		}
-		return PSBT_OK;
+		psbt_errmsg = "psbt_encode: base62 is not implemented";
+		return psbt_fail(PSBT_NOT_IMPLEMENTED);
 	case PSBT_ENCODING_PROTOBUF:
 		return protobuf_encode(psbt_data, psbt_len, dest, dest_size);
 	}
 
 	psbt_errmsg = "psbt_encode: invalid psbt_encoding enum value";
-	return PSBT_NOT_IMPLEMENTED;
+	return psbt_fail(PSBT_NOT_IMPLEMENTED);
 }
 
 enum psbt_result
@@ -781,7 +1645,13 @@ psbt_encode(struct psbt *psbt, enum psbt_encoding encoding, unsigned char *dest,
 			"use psbt_read to parse an existing psbt, or the "
 			"psbt_write functions to create one.";
 
-		return PSBT_WRITE_ERROR;
+		return psbt_fail(PSBT_WRITE_ERROR);
+	}
+
+	if (psbt->measure || psbt->iovs) {
+		psbt_errmsg = "psbt_encode: psbt is measuring or only "
+			"described by iovecs";
+		return psbt_fail(PSBT_INVALID_STATE);
 	}
 
 	return psbt_encode_raw(psbt->data, psbt_size(psbt), encoding, dest,
@@ -789,7 +1659,426 @@ psbt_encode(struct psbt *psbt, enum psbt_encoding encoding, unsigned char *dest,
 }
 
 
+static void combine_tx_counter(struct psbt_txelem *elem) {
+	struct psbt_tx_counter *counter =
+		(struct psbt_tx_counter *)elem->user_data;
+
+	if (elem->elem_type == PSBT_TXELEM_TXIN)
+		counter->inputs++;
+	else if (elem->elem_type == PSBT_TXELEM_TXOUT)
+		counter->outputs++;
+}
+
+/* where the current map of each psbt_combine source starts and ends */
+struct combine_span {
+	const u8 *start;
+	const u8 *end;
+};
+
+/*
+ * Like keyset_add for a record of source i that starts at rec_start, but
+ * past a full keyset the maps of i and the sources before it are scanned.
+ */
+static int
+combine_add(struct keyset *keys, const struct psbt_record *rec, size_t i,
+	    const struct combine_span *spans, const u8 *rec_start)
+{
+	int added = keyset_add(keys, rec, (u8)i);
+	size_t j;
+
+	if (added >= 0)
+		return added;
+
+	if (map_has_key(spans[i].start, rec_start, rec))
+		return 0;
+
+	for (j = 0; j < i; j++) {
+		if (map_has_key(spans[j].start, spans[j].end, rec))
+			return 2;
+	}
+
+	return 1;
+}
+
+/*
+ * Copies the records of the current map of source i that out doesn't
+ * have yet and steps over the map terminator. A key that appears twice in
+ * the map of one source is a PSBT_READ_ERROR.
+ */
+static enum psbt_result
+combine_map(struct psbt *srcs, const struct psbt_combine_input *inputs,
+	    size_t i, struct combine_span *spans, struct psbt *out,
+	    struct keyset *keys, struct psbt_record *unsigned_tx)
+{
+	struct psbt *src = &srcs[i], *tx = &srcs[i];
+	size_t src_size = inputs[i].src_size;
+	struct psbt_record rec;
+	enum psbt_result res;
+	const u8 *rec_start;
+
+	spans[i].start = src->write_pos;
+
+	for (;;) {
+		READ_SPACE(1);
+		if (*src->write_pos == 0)
+			break;
+
+		rec_start = src->write_pos;
+		res = psbt_read_record(src, src_size, &rec);
+		if (res != PSBT_OK)
+			return res;
+
+		if (rec.scope == PSBT_SCOPE_GLOBAL &&
+		    rec.type == PSBT_GLOBAL_UNSIGNED_TX && rec.key_size == 0)
+			*unsigned_tx = rec;
+
+		switch (combine_add(keys, &rec, i, spans, rec_start)) {
+		case 0:
+			psbt_errmsg = "psbt_combine: duplicate key in map";
+			return psbt_fail(PSBT_READ_ERROR);
+		case 2:
+			continue;
+		}
+
+		res = psbt_write_record(out, &rec);
+		if (res != PSBT_OK)
+			return res;
+	}
+
+	spans[i].end = src->write_pos;
+	src->write_pos++;
+
+	return PSBT_OK;
+}
+
+enum psbt_result
+psbt_combine(const struct psbt_combine_input *inputs, size_t n,
+	     struct psbt *out)
+{
+	struct combine_span spans[PSBT_COMBINE_MAX_PSBTS];
+	struct psbt srcs[PSBT_COMBINE_MAX_PSBTS];
+	struct keyset keys;
+	struct psbt_record unsigned_tx, first_tx;
+	struct psbt_tx_counter counter;
+	enum psbt_result res;
+	unsigned int map, num_maps;
+	size_t i;
+
+	if (n == 0 || n > PSBT_COMBINE_MAX_PSBTS) {
+		psbt_errmsg = "psbt_combine: between 1 and "
+			STRINGIZE(PSBT_COMBINE_MAX_PSBTS) " psbts can be combined";
+		return psbt_fail(PSBT_INVALID_STATE);
+	}
+
+	for (i = 0; i < n; i++) {
+		psbt_init(&srcs[i], (u8 *)inputs[i].src, inputs[i].src_size);
+		res = psbt_read_header(&srcs[i], inputs[i].src_size);
+		if (res != PSBT_OK)
+			return res;
+		srcs[i].state = PSBT_ST_GLOBAL;
+	}
+
+	res = psbt_enter_global(out);
+	if (res != PSBT_OK)
+		return res;
+
+	// the global maps, which also tell whether the txs agree
+	keyset_init(&keys);
+	keyset_next_map(&keys);
+	for (i = 0; i < n; i++) {
+		unsigned_tx.val = NULL;
+		res = combine_map(srcs, inputs, i, spans, out, &keys,
+				  &unsigned_tx);
+		if (res != PSBT_OK)
+			return res;
+
+		if (unsigned_tx.val == NULL) {
+			psbt_errmsg = "psbt_combine: psbt without an unsigned tx";
+			return psbt_fail(PSBT_READ_ERROR);
+		}
+
+		if (i == 0) {
+			first_tx = unsigned_tx;
+		} else if (unsigned_tx.val_size != first_tx.val_size ||
+			   memcmp(unsigned_tx.val, first_tx.val,
+				  first_tx.val_size) != 0) {
+			psbt_errmsg = "psbt_combine: psbts have different "
+				"unsigned txs";
+			return psbt_fail(PSBT_INVALID_STATE);
+		}
+	}
+
+	counter.inputs = 0;
+	counter.outputs = 0;
+	res = psbt_btc_unsigned_tx_parse(first_tx.val, first_tx.val_size,
+					 &counter, combine_tx_counter);
+	if (res != PSBT_OK)
+		return res;
+
+	num_maps = counter.inputs + counter.outputs;
+
+	for (map = 0; map < num_maps; map++) {
+		if (map < (unsigned int)counter.inputs)
+			res = psbt_new_input_record_set(out);
+		else
+			res = psbt_new_output_record_set(out);
+		if (res != PSBT_OK)
+			return res;
+
+		keyset_next_map(&keys);
+		for (i = 0; i < n; i++) {
+			srcs[i].state = map < (unsigned int)counter.inputs
+				? PSBT_ST_INPUTS
+				: PSBT_ST_OUTPUTS;
+			res = combine_map(srcs, inputs, i, spans, out, &keys,
+					  &unsigned_tx);
+			if (res != PSBT_OK)
+				return res;
+		}
+	}
+
+	// like psbt_read, each source holds exactly one psbt
+	for (i = 0; i < n; i++) {
+		if (srcs[i].write_pos != srcs[i].data + inputs[i].src_size) {
+			psbt_errmsg = "psbt_combine: data after end of psbt";
+			return psbt_fail(PSBT_READ_ERROR);
+		}
+	}
+
+	return psbt_finalize(out);
+}
+
+/* below this many records a bucket is insertion sorted */
+#define CANON_SMALL 16
+
+/* digit d of the key data (type byte, then key) of rec. 0 once the key
+ * has ended, so shorter keys sort before longer ones with that prefix */
+static unsigned int canon_digit(const struct psbt_record *rec, u32 d) {
+	if (d == 0)
+		return 1 + rec->type;
+	if (d > rec->key_size)
+		return 0;
+	return 1 + rec->key[d - 1];
+}
+
+static int canon_cmp(const struct psbt_record *a, const struct psbt_record *b) {
+	u32 len = a->key_size < b->key_size ? a->key_size : b->key_size;
+	int c;
+
+	if (a->type != b->type)
+		return a->type < b->type ? -1 : 1;
+
+	c = memcmp(a->key, b->key, len);
+	if (c != 0)
+		return c;
+
+	return a->key_size < b->key_size ? -1 : a->key_size > b->key_size;
+}
+
+/*
+ * MSD radix sort of recs on their key data from digit d on. Smaller
+ * buckets are sorted recursively and the largest one in the loop, which
+ * keeps the stack to log2(n) frames.
+ */
+static void canon_sort(struct psbt_record **recs, struct psbt_record **tmp,
+		       size_t n, u32 d)
+{
+	size_t count[257], start[257];
+	struct psbt_record *rec;
+	size_t i, j, b, largest;
+
+	while (n >= CANON_SMALL) {
+		memset(count, 0, sizeof(count));
+		for (i = 0; i < n; i++)
+			count[canon_digit(recs[i], d)]++;
+
+		start[0] = 0;
+		for (b = 1; b < 257; b++)
+			start[b] = start[b - 1] + count[b - 1];
+
+		for (i = 0; i < n; i++)
+			tmp[start[canon_digit(recs[i], d)]++] = recs[i];
+		memcpy(recs, tmp, n * sizeof(*recs));
+
+		// bucket 0 holds keys that ended, at most one with no dups
+		largest = 1;
+		for (b = 1; b < 257; b++) {
+			if (count[b] > count[largest])
+				largest = b;
+		}
+
+		for (b = 1; b < 257; b++) {
+			if (b != largest && count[b] > 1)
+				canon_sort(recs + start[b] - count[b], tmp,
+					   count[b], d + 1);
+		}
+
+		recs += start[largest] - count[largest];
+		n = count[largest];
+		d++;
+	}
+
+	for (i = 1; i < n; i++) {
+		rec = recs[i];
+		for (j = i; j > 0 && canon_cmp(recs[j - 1], rec) > 0; j--)
+			recs[j] = recs[j - 1];
+		recs[j] = rec;
+	}
+}
+
+/* the records of one map, carved from the caller's scratch */
+struct canon_recs {
+	struct psbt_record *recs;
+	struct psbt_record **sorted;
+	struct psbt_record **tmp;
+	size_t capacity;
+};
+
+static void
+canon_recs_init(struct canon_recs *map, void *scratch, size_t scratch_size)
+{
+	const size_t per_rec = sizeof(struct psbt_record) +
+		2 * sizeof(struct psbt_record *);
+	u8 *p = (u8 *)(((uintptr_t)scratch + 7) & ~(uintptr_t)7);
+	size_t skip = p - (u8 *)scratch;
+
+	map->capacity = scratch_size > skip ? (scratch_size - skip) / per_rec : 0;
+	map->recs = (struct psbt_record *)p;
+	map->sorted = (struct psbt_record **)(map->recs + map->capacity);
+	map->tmp = map->sorted + map->capacity;
+}
+
+/*
+ * Writes the current map of src to out with its records sorted by key
+ * and steps over the map terminator. Duplicate keys end up next to each
+ * other, so no keyset is needed to find them.
+ */
+static enum psbt_result
+canon_map(struct psbt *src, size_t src_size, struct psbt *out,
+	  struct canon_recs *map, struct psbt_record *unsigned_tx)
+{
+	struct psbt_record *recs = map->recs, **sorted = map->sorted;
+	enum psbt_result res;
+	struct psbt *tx = src;
+	size_t i, n = 0;
+
+	for (;;) {
+		READ_SPACE(1);
+		if (*src->write_pos == 0)
+			break;
+
+		if (n == map->capacity) {
+			psbt_errmsg = "psbt_canonicalize: scratch is too small "
+				"for a map";
+			return psbt_fail(PSBT_OOB_WRITE);
+		}
+
+		res = psbt_read_record(src, src_size, &recs[n]);
+		if (res != PSBT_OK)
+			return res;
+
+		if (recs[n].scope == PSBT_SCOPE_GLOBAL &&
+		    recs[n].type == PSBT_GLOBAL_UNSIGNED_TX &&
+		    recs[n].key_size == 0)
+			*unsigned_tx = recs[n];
+
+		sorted[n] = &recs[n];
+		n++;
+	}
+
+	src->write_pos++;
+
+	canon_sort(sorted, map->tmp, n, 0);
+
+	for (i = 1; i < n; i++) {
+		if (canon_cmp(sorted[i - 1], sorted[i]) == 0) {
+			psbt_errmsg = "psbt_canonicalize: duplicate key in map";
+			return psbt_fail(PSBT_READ_ERROR);
+		}
+	}
+
+	for (i = 0; i < n; i++) {
+		res = psbt_write_record(out, sorted[i]);
+		if (res != PSBT_OK)
+			return res;
+	}
+
+	return PSBT_OK;
+}
+
+enum psbt_result
+psbt_canonicalize(const unsigned char *src, size_t src_size,
+		  struct psbt *out, void *scratch, size_t scratch_size)
+{
+	struct psbt_record unsigned_tx;
+	struct psbt_tx_counter counter;
+	struct canon_recs recs;
+	enum psbt_result res;
+	struct psbt in;
+	unsigned int map;
+
+	canon_recs_init(&recs, scratch, scratch_size);
+
+	psbt_init(&in, (u8 *)src, src_size);
+	res = psbt_read_header(&in, src_size);
+	if (res != PSBT_OK)
+		return res;
+	in.state = PSBT_ST_GLOBAL;
+
+	res = psbt_enter_global(out);
+	if (res != PSBT_OK)
+		return res;
+
+	unsigned_tx.val = NULL;
+	res = canon_map(&in, src_size, out, &recs, &unsigned_tx);
+	if (res != PSBT_OK)
+		return res;
+
+	if (unsigned_tx.val == NULL) {
+		psbt_errmsg = "psbt_canonicalize: psbt without an unsigned tx";
+		return psbt_fail(PSBT_READ_ERROR);
+	}
+
+	counter.inputs = 0;
+	counter.outputs = 0;
+	res = psbt_btc_unsigned_tx_parse(unsigned_tx.val, unsigned_tx.val_size,
+					 &counter, combine_tx_counter);
+	if (res != PSBT_OK)
+		return res;
+
+	for (map = 0; map < (unsigned int)(counter.inputs + counter.outputs);
+	     map++) {
+		if (map < (unsigned int)counter.inputs) {
+			res = psbt_new_input_record_set(out);
+			in.state = PSBT_ST_INPUTS;
+		} else {
+			res = psbt_new_output_record_set(out);
+			in.state = PSBT_ST_OUTPUTS;
+		}
+		if (res != PSBT_OK)
+			return res;
+
+		res = canon_map(&in, src_size, out, &recs, &unsigned_tx);
+		if (res != PSBT_OK)
+			return res;
+	}
+
+	// otherwise psbts that differ after the last map come out the same
+	if (in.write_pos != in.data + src_size) {
+		psbt_errmsg = "psbt_canonicalize: data after end of psbt";
+		return psbt_fail(PSBT_READ_ERROR);
+	}
+
+	return psbt_finalize(out);
+}
+
+const struct psbt_error *
+psbt_last_error(void) {
+	last_error.msg = psbt_errmsg;
+	return &last_error;
+}
+
 const char *
 psbt_geterr() {
-	return psbt_errmsg;
+	return psbt_last_error()->msg;
 }
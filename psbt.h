@@ -3,6 +3,7 @@
 
 #include <stddef.h>
 #include <stdio.h>
+#include <sys/uio.h>
 #include "result.h"
 #include "tx.h"
 
@@ -13,8 +14,9 @@ enum psbt_global_type {
 enum psbt_encoding {
 	PSBT_ENCODING_HEX,
 	PSBT_ENCODING_BASE64,
-	PSBT_ENCODING_BASE62,
-	PSBT_ENCODING_PROTOBUF,
+	PSBT_ENCODING_BASE62,   /* not implemented */
+	PSBT_ENCODING_PROTOBUF, /* not implemented */
+	PSBT_ENCODING_RAW,
 };
 
 enum psbt_input_type {
@@ -50,13 +52,61 @@ enum psbt_state {
 	PSBT_ST_OUTPUTS,
 	PSBT_ST_OUTPUTS_NEW,
 	PSBT_ST_FINALIZED,
+	PSBT_ST_GLOBAL_END,  /* map closed by psbt_write_map, none open */
+	PSBT_ST_INPUTS_END,
+	PSBT_ST_OUTPUTS_END,
 };
 
+#if defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L
+#define PSBT_THREAD_LOCAL _Thread_local
+#else
+#define PSBT_THREAD_LOCAL __thread
+#endif
+
+/*
+ * realloc-style allocator for growable psbts, see psbt_init_alloc.
+ * new_size = 0 frees ptr. Returns NULL when out of memory.
+ */
+typedef void *(psbt_realloc)(void *alloc_data, void *ptr, size_t old_size,
+			     size_t new_size);
+
 struct psbt {
 	enum psbt_state state;
 	unsigned char *data;
 	unsigned char *write_pos;
 	size_t data_capacity;
+	int measure;     /* see psbt_measure_init */
+	size_t measured;
+	psbt_realloc *alloc; /* NULL for a fixed buffer */
+	void *alloc_data;
+	struct psbt_iovs *iovs; /* see psbt_init_iov */
+	size_t value_pos;       /* see psbt_begin_value */
+	unsigned int value_len_size;
+	int strict;             /* see psbt_read */
+};
+
+/*
+ * Output of a scatter/gather psbt. size is the total of all iov_len, which
+ * is what psbt_size reports.
+ */
+struct psbt_iovs {
+	struct iovec *iov;
+	size_t capacity;
+	size_t count;
+	size_t size;
+	size_t threshold; /* keys and values this long are not copied */
+};
+
+/*
+ * Bump allocator over a caller-owned buffer, for use with
+ * psbt_arena_realloc. Only the newest block can grow in place or be
+ * freed, everything else is released at once by psbt_arena_reset.
+ */
+struct psbt_arena {
+	unsigned char *buf;
+	size_t capacity;
+	size_t used;
+	unsigned char *last;
 };
 
 struct psbt_record {
@@ -85,13 +135,299 @@ struct psbt_elem {
 
 typedef void (psbt_elem_handler)(struct psbt_elem *rec);
 
+/* receives encoded output in blocks, see psbt_encode_to_sink */
+typedef enum psbt_result (psbt_sink)(void *sink_data,
+				      const unsigned char *data, size_t size);
+
+/*
+ * Details of the last failure in the calling thread, see psbt_last_error.
+ * Every failing call sets all of it. offset and state say how far into
+ * the psbt a parser (psbt_read, psbt_read_view, psbt_stream_feed,
+ * psbt_stream_end and psbt_tape_scan) got, other failures leave them at
+ * 0 and PSBT_ST_INIT.
+ */
+struct psbt_error {
+	enum psbt_result result;
+	const char *msg;
+	size_t offset;
+	enum psbt_state state;
+};
+
+/*
+ * Push parser state, see psbt_stream_init. Records that arrive split over
+ * several chunks are reassembled in buf, so buf_capacity bounds the size of
+ * the largest record (framing, key and value).
+ */
+struct psbt_stream {
+	enum psbt_state state;
+	psbt_elem_handler *handler;
+	void *user_data;
+	unsigned char *buf;
+	size_t buf_capacity;
+	size_t buf_len;
+	size_t offset; /* bytes consumed so far */
+	int kvs;
+	int inputs;
+	int outputs;
+};
+
+#define PSBT_BATCH_MAX_THREADS 64
+
+/* most psbts psbt_combine takes */
+#define PSBT_COMBINE_MAX_PSBTS 64
+
+/* keys per map psbt_combine and strict psbt_read keep in a hash table,
+ * the rest of a larger map is checked by scanning it */
+#define PSBT_MAP_MAX_RECORDS 1024
+
+/* scratch psbt_canonicalize needs for maps of up to n records. Records
+ * take at least 3 bytes, so n = src_size / 3 covers any src_size psbt */
+#define PSBT_CANONICALIZE_SCRATCH_SIZE(n) \
+	((size_t)(n) * (sizeof(struct psbt_record) + \
+			2 * sizeof(struct psbt_record *)) + 8)
+
+struct psbt_combine_input {
+	const unsigned char *src;
+	size_t src_size;
+};
+
+/*
+ * One psbt of a psbt_read_batch call. Encoded (hex or base64) items are
+ * decoded into buf, raw items are parsed in place as with psbt_read_view.
+ */
+struct psbt_batch_item {
+	const unsigned char *src;
+	size_t src_size;
+	int encoded;
+	unsigned char *buf;
+	size_t buf_size;
+	void *user_data; /* handed to the elem handler */
+
+	/* filled in by psbt_read_batch */
+	struct psbt psbt;
+	enum psbt_result result;
+	struct psbt_error error; /* when result is not PSBT_OK */
+};
+
+enum psbt_sighash_type {
+	PSBT_SIGHASH_DEFAULT      = 0x00, /* taproot only, same as ALL */
+	PSBT_SIGHASH_ALL          = 0x01,
+	PSBT_SIGHASH_NONE         = 0x02,
+	PSBT_SIGHASH_SINGLE       = 0x03,
+	PSBT_SIGHASH_ANYONECANPAY = 0x80,
+};
+
+/* per input data of a psbt_sighash, pointers are into the psbt */
+struct psbt_sighash_input {
+	const unsigned char *outpoint; /* txid and index, 36 bytes */
+	unsigned int sequence;
+	int has_utxo;
+	uint64_t amount;
+	const unsigned char *script_pubkey;
+	unsigned int script_pubkey_len;
+};
+
+/* a serialized output of the unsigned tx, for SIGHASH_SINGLE */
+struct psbt_sighash_output {
+	const unsigned char *data;
+	unsigned int size;
+};
+
+/*
+ * Everything the bip143 and bip341 sighashes of a psbt share, computed
+ * once by psbt_sighash_build. The inputs and outputs arrays are supplied
+ * by the caller, see psbt_sighash_init.
+ */
+struct psbt_sighash {
+	unsigned int version;
+	unsigned int lock_time;
+	struct psbt_sighash_input *inputs;
+	size_t inputs_capacity;
+	unsigned int num_inputs;
+	struct psbt_sighash_output *outputs;
+	size_t outputs_capacity;
+	unsigned int num_outputs;
+
+	/* single sha256, bip341 */
+	unsigned char sha_prevouts[32];
+	unsigned char sha_sequences[32];
+	unsigned char sha_outputs[32];
+	unsigned char sha_amounts[32];
+	unsigned char sha_scriptpubkeys[32];
+	int have_all_utxos; /* sha_amounts and sha_scriptpubkeys are set */
+
+	/* double sha256, bip143 */
+	unsigned char hash_prevouts[32];
+	unsigned char hash_sequence[32];
+	unsigned char hash_outputs[32];
+};
+
+/* see psbt_tx_begin */
+struct psbt_tx_writer {
+	struct psbt *psbt;
+	unsigned int lock_time;
+	unsigned int num_inputs;
+	unsigned int num_outputs;
+	unsigned int inputs;
+	unsigned int outputs;
+	int outputs_started;
+};
+
+/* byte offsets are relative to the start of the indexed psbt */
+struct psbt_index_rec {
+	unsigned int key_offset; /* key bytes, after the type */
+	unsigned int key_size;
+	unsigned int val_offset;
+	unsigned int val_size;
+	unsigned char type;
+};
+
+struct psbt_index_map {
+	unsigned int offset;    /* first record, or the map terminator */
+	unsigned int first_rec; /* into psbt_index.recs */
+	unsigned int num_recs;
+};
+
+/*
+ * Flat offset table of a serialized psbt. maps holds the global map, then
+ * each input map, then each output map. Both arrays are owned by the
+ * caller, see psbt_index_init.
+ */
+struct psbt_index {
+	const unsigned char *data;
+	size_t data_size;
+	struct psbt_index_map *maps;
+	size_t maps_capacity;
+	struct psbt_index_rec *recs;
+	size_t recs_capacity;
+	unsigned int num_recs;
+	unsigned int num_inputs;
+	unsigned int num_outputs;
+};
+
+/* one record found by psbt_tape_scan, offsets as in psbt_index_rec */
+struct psbt_tape_rec {
+	unsigned int key_offset;
+	unsigned int key_size;
+	unsigned int val_offset;
+	unsigned int val_size;
+	unsigned int index;      /* map number within scope */
+	unsigned char scope;     /* enum psbt_scope */
+	unsigned char type;
+};
+
+/*
+ * The records of a serialized psbt in order, see psbt_tape_scan. recs is
+ * owned by the caller.
+ */
+struct psbt_tape {
+	const unsigned char *data;
+	size_t data_size;
+	size_t size;             /* bytes up to the last map terminator */
+	struct psbt_tape_rec *recs;
+	size_t capacity;
+	size_t num_recs;
+	unsigned int num_inputs;
+	unsigned int num_outputs;
+};
+
+struct psbt_doc_map {
+	unsigned int first_rec; /* into psbt_doc.tape.recs */
+	unsigned int num_recs;
+};
+
+/*
+ * A parsed psbt as flat arrays, one entry per input or per output of the
+ * unsigned tx, all carved out of one block owned by the caller. Offsets
+ * are into the psbt, which is not copied and must outlive the doc.
+ */
+struct psbt_doc {
+	struct psbt_tape tape;   /* every record, and the counts */
+	struct psbt_doc_map *maps; /* global, inputs, then outputs */
+	/* inputs */
+	unsigned int *prevout_offsets; /* 32 byte txid, then the index */
+	unsigned int *prevout_indexes;
+	unsigned int *sequences;
+	/* outputs */
+	uint64_t *amounts;
+	unsigned int *script_offsets;
+	unsigned int *script_sizes;
+	void *block;
+	size_t block_size;
+};
+
+/* a block size psbt_doc_build never runs out of for a src_size psbt */
+#define PSBT_DOC_BLOCK_SIZE(src_size) (8 * (size_t)(src_size) + 64)
+
 size_t
 psbt_size(struct psbt *tx);
 
+/*
+ * Parses src into the psbt buffer. src must hold exactly one psbt, bytes
+ * after its last map are a PSBT_READ_ERROR as in psbt_stream_feed. With
+ * psbt->strict set after psbt_init, a key that appears twice in one map is
+ * a PSBT_READ_ERROR. Maps of any size are checked, past
+ * PSBT_MAP_MAX_RECORDS records by a slower scan of the map.
+ */
 enum psbt_result
 psbt_read(const unsigned char *src, size_t src_size, struct psbt *psbt,
 	  psbt_elem_handler *elem_handler, void* user_data);
 
+/*
+ * Like psbt_read, but parses src in place instead of copying it into the
+ * psbt buffer. src may be read-only (an mmap'd file, a receive buffer) and
+ * must outlive any use of tx and of the records handed to elem_handler,
+ * which point into it. tx does not need psbt_init and is left referring to
+ * src, so it can be passed to psbt_encode but not to the write functions.
+ */
+enum psbt_result
+psbt_read_view(const unsigned char *src, size_t src_size, struct psbt *psbt,
+	       psbt_elem_handler *elem_handler, void *user_data);
+
+enum psbt_result
+psbt_stream_init(struct psbt_stream *stream, unsigned char *buf,
+		 size_t buf_capacity, psbt_elem_handler *elem_handler,
+		 void *user_data);
+
+/*
+ * Parses the next chunk of a raw psbt. elem_handler fires as soon as each
+ * record is complete; record pointers are only valid for the duration of
+ * the callback. After an error the stream must be initialized again.
+ */
+enum psbt_result
+psbt_stream_feed(struct psbt_stream *stream, const unsigned char *chunk,
+		 size_t chunk_size);
+
+/* checks that the psbt fed so far was complete */
+enum psbt_result
+psbt_stream_end(struct psbt_stream *stream);
+
+/*
+ * Decodes and parses many psbts on a pool of threads, threads = 0 uses
+ * psbt_batch_threads(). elem_handler is called from several threads at
+ * once. Returns the result of the first failed item, if any; every item
+ * gets its own result and error.
+ */
+enum psbt_result
+psbt_read_batch(struct psbt_batch_item *items, size_t num_items,
+		psbt_elem_handler *elem_handler, unsigned int threads);
+
+/* online cpus, at most PSBT_BATCH_MAX_THREADS */
+unsigned int
+psbt_batch_threads(void);
+
+/*
+ * Decodes a hex or base64 psbt and parses it in the same pass. Decoding
+ * happens one small block at a time and each block is handed straight to
+ * the parser, the raw psbt is never stored as a whole. buf only holds
+ * records that straddle two blocks, as for psbt_stream_init. Record
+ * pointers are only valid during the elem_handler call.
+ */
+enum psbt_result
+psbt_read_encoded(const char *src, size_t src_size, unsigned char *buf,
+		  size_t buf_capacity, psbt_elem_handler *elem_handler,
+		  void *user_data);
+
 enum psbt_result
 psbt_decode(const char *src, size_t src_size, unsigned char *dest,
 	    size_t dest_size, size_t *psbt_len);
@@ -105,6 +441,35 @@ psbt_encode_raw(unsigned char *psbt_data, size_t psbt_len,
 		enum psbt_encoding encoding, unsigned char *dest,
 		size_t dest_size, size_t* out_len);
 
+/*
+ * Streaming encoders. Output is produced in blocks of a few KiB on the
+ * stack and handed to the sink, so the encoded psbt never has to fit in
+ * memory and every write covers a whole block. Raw output goes to the
+ * sink in a single call.
+ */
+enum psbt_result
+psbt_encode_to_sink(const unsigned char *psbt_data, size_t psbt_len,
+		    enum psbt_encoding encoding, psbt_sink *sink,
+		    void *sink_data);
+
+enum psbt_result
+psbt_encode_to_file(const unsigned char *psbt_data, size_t psbt_len,
+		    enum psbt_encoding encoding, FILE *file);
+
+/* retries short writes and EINTR */
+enum psbt_result
+psbt_encode_to_fd(const unsigned char *psbt_data, size_t psbt_len,
+		  enum psbt_encoding encoding, int fd);
+
+/*
+ * Errors are kept per thread, so psbts may be parsed and encoded on several
+ * threads at once. The result stays valid until the thread's next failing
+ * call. See struct psbt_error for which fields a failure sets.
+ */
+const struct psbt_error *
+psbt_last_error(void);
+
+/* same as psbt_last_error()->msg */
 const char *
 psbt_geterr();
 
@@ -135,6 +500,118 @@ psbt_write_input_record(struct psbt *tx, struct psbt_record *rec);
 enum psbt_result
 psbt_write_output_record(struct psbt *tx, struct psbt_record *rec);
 
+/*
+ * Writes a whole map: any map still open is closed, then all of recs and
+ * the map terminator are written after a single capacity check. Maps have
+ * to come in global, input, output order but can be mixed with the single
+ * record functions.
+ */
+enum psbt_result
+psbt_write_map(struct psbt *tx, enum psbt_scope scope,
+	       const struct psbt_record *recs, size_t num_recs);
+
+/*
+ * Writes a record whose value is produced in place. psbt_begin_value writes
+ * the key of rec (val is ignored) and leaves room for the length of a
+ * size_hint byte value. The caller then writes the value at tx->write_pos,
+ * advancing it, after making room with psbt_value_reserve. psbt_end_value
+ * fills in the length, moving the value once if it needs a different
+ * number of length bytes than size_hint did. Not available for measuring
+ * or iov psbts.
+ */
+enum psbt_result
+psbt_begin_value(struct psbt *tx, struct psbt_record *rec, size_t size_hint);
+
+/* room for size more bytes at write_pos; may move a growable buffer */
+enum psbt_result
+psbt_value_reserve(struct psbt *tx, size_t size);
+
+enum psbt_result
+psbt_end_value(struct psbt *tx);
+
+/* serialized sizes, for the size passed to psbt_tx_begin */
+size_t
+psbt_txin_size(const struct psbt_txin *txin);
+
+size_t
+psbt_txout_size(const struct psbt_txout *txout);
+
+/* inputs_size and outputs_size are sums of psbt_txin_size and
+ * psbt_txout_size */
+size_t
+psbt_tx_size(unsigned int num_inputs, size_t inputs_size,
+	     unsigned int num_outputs, size_t outputs_size);
+
+/*
+ * Serializes the unsigned tx straight into the global record of psbt, see
+ * psbt_begin_value. Add exactly num_inputs inputs, then num_outputs
+ * outputs, then call psbt_tx_end. With the exact size (psbt_tx_size) the
+ * space is reserved once and nothing is moved, 0 means unknown.
+ */
+enum psbt_result
+psbt_tx_begin(struct psbt_tx_writer *w, struct psbt *psbt,
+	      const struct psbt_tx *tx, unsigned int num_inputs,
+	      unsigned int num_outputs, size_t size);
+
+enum psbt_result
+psbt_tx_add_input(struct psbt_tx_writer *w, const struct psbt_txin *txin);
+
+enum psbt_result
+psbt_tx_add_output(struct psbt_tx_writer *w, const struct psbt_txout *txout);
+
+enum psbt_result
+psbt_tx_end(struct psbt_tx_writer *w);
+
+/*
+ * The txid of a serialized tx, in the byte order it is hashed in (reversed
+ * from how it is usually displayed). Segwit txs are hashed without their
+ * marker, flag and witnesses.
+ */
+enum psbt_result
+psbt_txid(const unsigned char *tx, size_t tx_size, unsigned char txid[32]);
+
+/*
+ * Txids of the unsigned tx and of every PSBT_IN_NON_WITNESS_UTXO, hashed
+ * in batches. txids[0] is the unsigned tx and txids[1 + i] the utxo of
+ * input i, all zero if it has none. num_txids is 1 + the number of inputs.
+ */
+enum psbt_result
+psbt_txids(const unsigned char *psbt, size_t psbt_size,
+	   unsigned char (*txids)[32], size_t capacity, size_t *num_txids);
+
+enum psbt_result
+psbt_sighash_init(struct psbt_sighash *sh,
+		  struct psbt_sighash_input *inputs, size_t inputs_capacity,
+		  struct psbt_sighash_output *outputs, size_t outputs_capacity);
+
+/*
+ * Walks the unsigned tx of a raw psbt once and hashes the prevouts,
+ * sequences and outputs. Amounts and scriptPubKeys come from the witness
+ * utxo of each input, or from its non-witness utxo. The psbt must stay
+ * around while sh is used.
+ */
+enum psbt_result
+psbt_sighash_build(struct psbt_sighash *sh, const unsigned char *psbt,
+		   size_t psbt_size);
+
+/* bip143 sighash of input n, script_code is serialized with its length */
+enum psbt_result
+psbt_sighash_segwit_v0(const struct psbt_sighash *sh, unsigned int n,
+		       const unsigned char *script_code,
+		       size_t script_code_size, unsigned int sighash_type,
+		       unsigned char out[32]);
+
+/*
+ * bip341 sighash of input n without an annex. leaf_hash is NULL for a key
+ * path spend, for a script path spend it is the tapleaf hash and
+ * codesep_pos is usually 0xffffffff. Every input needs a utxo, except
+ * with SIGHASH_ANYONECANPAY where only input n does.
+ */
+enum psbt_result
+psbt_sighash_taproot(const struct psbt_sighash *sh, unsigned int n,
+		     unsigned int sighash_type, const unsigned char *leaf_hash,
+		     unsigned int codesep_pos, unsigned char out[32]);
+
 enum psbt_result
 psbt_new_input_record_set(struct psbt *tx);
 
@@ -144,14 +621,197 @@ psbt_new_output_record_set(struct psbt *tx);
 enum psbt_result
 psbt_init(struct psbt *tx, unsigned char *dest, size_t dest_size);
 
+/*
+ * A psbt without a buffer that runs the same writer calls as a normal one
+ * but only counts bytes. psbt_size then gives the exact dest_size to pass
+ * to psbt_init.
+ */
+enum psbt_result
+psbt_measure_init(struct psbt *tx);
+
+/*
+ * A psbt that allocates its buffer through realloc_fn and doubles it
+ * whenever a write doesn't fit. Release it with psbt_free.
+ */
+enum psbt_result
+psbt_init_alloc(struct psbt *tx, psbt_realloc *realloc_fn, void *alloc_data);
+
+void
+psbt_free(struct psbt *tx);
+
+void
+psbt_iovs_init(struct psbt_iovs *iovs, struct iovec *iov, size_t capacity,
+	       size_t threshold);
+
+/*
+ * A psbt whose writer functions describe the serialization as an iovec
+ * list for writev or sendmsg. Framing bytes and short keys and values are
+ * copied into scratch, longer ones are referenced in place and must stay
+ * valid until the iovecs have been written.
+ */
+enum psbt_result
+psbt_init_iov(struct psbt *tx, unsigned char *scratch, size_t scratch_size,
+	      struct psbt_iovs *iovs);
+
+void
+psbt_arena_init(struct psbt_arena *arena, unsigned char *buf,
+		size_t capacity);
+
+/* psbt_realloc for a struct psbt_arena passed as alloc_data */
+void *
+psbt_arena_realloc(void *alloc_data, void *ptr, size_t old_size,
+		   size_t new_size);
+
+void
+psbt_arena_reset(struct psbt_arena *arena);
+
+/* the dest_size psbt_encode needs for a psbt_len byte psbt, including the
+ * nul terminator of the text encodings. 0 for unimplemented encodings */
+size_t
+psbt_encoded_size(size_t psbt_len, enum psbt_encoding encoding);
+
 enum psbt_result
 psbt_print(struct psbt *tx, FILE *stream);
 
 enum psbt_result
 psbt_finalize(struct psbt *tx);
 
+/*
+ * bip174 combiner. Writes the union of the records of n raw psbts with the
+ * same unsigned tx to out, which must be freshly initialized. For keys
+ * that appear more than once the first psbt wins. Records are copied as
+ * they are read, nothing is built up in between. A key that appears twice
+ * in one map of the same src is a PSBT_READ_ERROR. As with psbt_read,
+ * each src must hold exactly one psbt.
+ */
+enum psbt_result
+psbt_combine(const struct psbt_combine_input *inputs, size_t n,
+	     struct psbt *out);
+
+/*
+ * Re-serializes the raw psbt src to out, which must be freshly
+ * initialized, with the records of every map sorted by key (type byte,
+ * then key bytes, shorter keys first). Two psbts with the same records
+ * come out byte-identical. Duplicate keys are a PSBT_READ_ERROR, and as
+ * with psbt_read so is data after the last map. The records of a map are
+ * sorted in scratch, see PSBT_CANONICALIZE_SCRATCH_SIZE. A map that
+ * doesn't fit is a PSBT_OOB_WRITE.
+ */
+enum psbt_result
+psbt_canonicalize(const unsigned char *src, size_t src_size,
+		  struct psbt *out, void *scratch, size_t scratch_size);
+
+/*
+ * Checks a raw psbt against the bip174 rules: one unsigned tx with empty
+ * scriptSigs and no witnesses, a map per input and output, no duplicate
+ * keys, pubkey and keypath sizes, no input with both final and partial
+ * fields, and non-witness utxos whose txid is the one the input spends.
+ * Everything but the txids is checked in one scan first, so the utxos
+ * are only hashed for a psbt that is otherwise well formed.
+ */
+enum psbt_result
+psbt_validate(const unsigned char *psbt, size_t psbt_size);
+
+enum psbt_result
+psbt_index_init(struct psbt_index *idx, struct psbt_index_map *maps,
+		size_t maps_capacity, struct psbt_index_rec *recs,
+		size_t recs_capacity);
+
+/*
+ * Index src in one pass. src is not copied and must outlive the index.
+ * Fails with PSBT_OOB_WRITE when the maps or recs arrays are too small.
+ */
+enum psbt_result
+psbt_index_build(struct psbt_index *idx, const unsigned char *src,
+		 size_t src_size);
+
+const struct psbt_index_map *
+psbt_index_global(const struct psbt_index *idx);
+
+const struct psbt_index_map *
+psbt_index_input(const struct psbt_index *idx, unsigned int n);
+
+const struct psbt_index_map *
+psbt_index_output(const struct psbt_index *idx, unsigned int n);
+
+const struct psbt_index_map *
+psbt_index_map(const struct psbt_index *idx, enum psbt_scope scope,
+	       unsigned int n);
+
+const struct psbt_index_rec *
+psbt_index_find(const struct psbt_index *idx, enum psbt_scope scope,
+		unsigned int n, unsigned char type, const unsigned char *key,
+		unsigned int key_size);
+
+/* fills rec with pointers into the indexed psbt */
+void
+psbt_index_record(const struct psbt_index *idx,
+		  const struct psbt_index_rec *irec, enum psbt_scope scope,
+		  struct psbt_record *rec);
+
+void
+psbt_tape_init(struct psbt_tape *tape, struct psbt_tape_rec *recs,
+	       size_t capacity);
+
+/*
+ * Stage one of a two stage read. Checks the framing of all of src, the
+ * magic, record lengths and one map per input and output of the unsigned
+ * tx, and writes a tape entry per record. Nothing is handed out and no
+ * record contents are looked at beyond counting the tx's inputs and
+ * outputs. As with psbt_read, data after the last map is a
+ * PSBT_READ_ERROR. src is not copied and must outlive the tape.
+ */
+enum psbt_result
+psbt_tape_scan(struct psbt_tape *tape, const unsigned char *src,
+	       size_t src_size);
+
+/*
+ * Stage two, hands the records of a scanned tape to handler in the same
+ * order and with the same elems as psbt_read. The unsigned tx is parsed
+ * here, so a malformed tx is still reported by this call.
+ */
+enum psbt_result
+psbt_tape_replay(const struct psbt_tape *tape, psbt_elem_handler *handler,
+		 void *user_data);
+
+/* fills rec with pointers into the scanned psbt */
+void
+psbt_tape_record(const struct psbt_tape *tape,
+		 const struct psbt_tape_rec *trec, struct psbt_record *rec);
+
+void
+psbt_doc_init(struct psbt_doc *doc, void *block, size_t block_size);
+
+/*
+ * Builds doc from one scan of src with psbt_tape_scan and one parse of the
+ * unsigned tx. A block of PSBT_DOC_BLOCK_SIZE(src_size) is always large
+ * enough, a smaller one is a PSBT_OOB_WRITE if it runs out.
+ */
+enum psbt_result
+psbt_doc_build(struct psbt_doc *doc, const unsigned char *src,
+	       size_t src_size);
+
+const struct psbt_doc_map *
+psbt_doc_input_map(const struct psbt_doc *doc, unsigned int n);
+
+const struct psbt_doc_map *
+psbt_doc_output_map(const struct psbt_doc *doc, unsigned int n);
+
+/* sum of the output amounts of the unsigned tx */
+uint64_t
+psbt_doc_output_total(const struct psbt_doc *doc);
+
+/*
+ * Writes the number of every input whose map has no record of type to
+ * inputs, which must have room for all inputs. Returns how many there
+ * were, e.g. the inputs still missing a PSBT_IN_PARTIAL_SIG.
+ */
+unsigned int
+psbt_doc_inputs_without(const struct psbt_doc *doc, unsigned char type,
+			unsigned int *inputs);
+
 extern const unsigned char PSBT_MAGIC[4];
 
-extern char *psbt_errmsg;
+extern PSBT_THREAD_LOCAL char *psbt_errmsg;
 
 #endif /* PSBT_H */
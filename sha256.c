@@ -0,0 +1,523 @@
+
+#include <string.h>
+
+#include "sha256.h"
+#include "cpu.h"
+#include "common.h"
+
+/* fewer messages than this aren't worth the 8 lane kernel */
+#define MULTI_BUFFER_MIN 4
+
+static const u32 sha256_iv[8] = {
+	0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+	0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+};
+
+static const u32 sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+	0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+	0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+	0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+	0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+	0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+typedef void (sha256_compress_fn)(u32 *state, const u8 *blocks, size_t n);
+
+static u32 load_be32(const u8 *p) {
+	return (u32)p[0] << 24 | (u32)p[1] << 16 | (u32)p[2] << 8 | p[3];
+}
+
+static void store_be32(u8 *p, u32 v) {
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+/*
+ * Hands out the padded message one or more 64 byte blocks at a time. Whole
+ * blocks inside a segment are passed straight from the message, blocks
+ * straddling segments and the padding are assembled in buf.
+ */
+enum feed_stage {
+	FEED_DATA,
+	FEED_LENGTH,
+	FEED_DONE,
+};
+
+struct sha256_feed {
+	const struct sha256_msg *msg;
+	unsigned int seg;
+	size_t off;
+	u64 total;
+	enum feed_stage stage;
+};
+
+static void feed_init(struct sha256_feed *f, const struct sha256_msg *msg) {
+	f->msg = msg;
+	f->seg = 0;
+	f->off = 0;
+	f->total = 0;
+	f->stage = FEED_DATA;
+}
+
+static void feed_length(struct sha256_feed *f, u8 *buf) {
+	u64 bits = f->total * 8;
+	int i;
+
+	for (i = 0; i < 8; i++)
+		buf[56 + i] = (u8)(bits >> (56 - 8 * i));
+	f->stage = FEED_DONE;
+}
+
+/* the next blocks, up to max of them. NULL once the message is done */
+static const u8 *
+feed_next(struct sha256_feed *f, u8 *buf, size_t max, size_t *nblocks) {
+	const struct sha256_msg *msg = f->msg;
+	size_t left, take, n = 0;
+	const u8 *p;
+
+	*nblocks = 1;
+
+	if (f->stage == FEED_DONE)
+		return NULL;
+
+	if (f->stage == FEED_LENGTH) {
+		memset(buf, 0, 56);
+		feed_length(f, buf);
+		return buf;
+	}
+
+	while (f->seg < msg->num_segs && f->off == msg->len[f->seg]) {
+		f->seg++;
+		f->off = 0;
+	}
+
+	if (f->seg < msg->num_segs) {
+		left = msg->len[f->seg] - f->off;
+		if (left >= 64) {
+			p = msg->seg[f->seg] + f->off;
+			*nblocks = left / 64 < max ? left / 64 : max;
+			f->off += *nblocks * 64;
+			f->total += *nblocks * 64;
+			return p;
+		}
+	}
+
+	while (n < 64 && f->seg < msg->num_segs) {
+		left = msg->len[f->seg] - f->off;
+		take = left < 64 - n ? left : 64 - n;
+		memcpy(buf + n, msg->seg[f->seg] + f->off, take);
+		n += take;
+		f->off += take;
+		if (f->off == msg->len[f->seg]) {
+			f->seg++;
+			f->off = 0;
+		}
+	}
+
+	f->total += n;
+	if (n == 64)
+		return buf;
+
+	buf[n++] = 0x80;
+	memset(buf + n, 0, 64 - n);
+
+	// the length goes in the next block if it doesn't fit
+	if (n <= 56)
+		feed_length(f, buf);
+	else
+		f->stage = FEED_LENGTH;
+
+	return buf;
+}
+
+static void state_digest(const u32 *state, u8 *out) {
+	int i;
+
+	for (i = 0; i < 8; i++)
+		store_be32(out + i * 4, state[i]);
+}
+
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_compress_scalar(u32 *state, const u8 *blocks, size_t n) {
+	u32 a, b, c, d, e, f, g, h, t1, t2, w[64];
+	int i;
+
+	for (; n > 0; n--, blocks += 64) {
+		for (i = 0; i < 16; i++)
+			w[i] = load_be32(blocks + i * 4);
+
+		for (; i < 64; i++) {
+			w[i] = w[i - 16] + w[i - 7] +
+				(ROTR(w[i - 15], 7) ^ ROTR(w[i - 15], 18) ^
+				 (w[i - 15] >> 3)) +
+				(ROTR(w[i - 2], 17) ^ ROTR(w[i - 2], 19) ^
+				 (w[i - 2] >> 10));
+		}
+
+		a = state[0]; b = state[1]; c = state[2]; d = state[3];
+		e = state[4]; f = state[5]; g = state[6]; h = state[7];
+
+		for (i = 0; i < 64; i++) {
+			t1 = h + (ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25)) +
+				((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+			t2 = (ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22)) +
+				((a & b) ^ (a & c) ^ (b & c));
+			h = g; g = f; f = e; e = d + t1;
+			d = c; c = b; b = a; a = t1 + t2;
+		}
+
+		state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+		state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+	}
+}
+
+#ifdef PSBT_X86
+#include <immintrin.h>
+
+#define SHANI __attribute__((target("sha,sse4.1")))
+#define AVX2 __attribute__((target("avx2")))
+
+static SHANI void
+sha256_compress_shani(u32 *state, const u8 *blocks, size_t n) {
+	const __m128i bswap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL,
+					     0x0405060700010203ULL);
+	__m128i state0, state1, abef, cdgh, msg, tmp, w[4];
+	int i;
+
+	// the instructions want the state as ABEF and CDGH
+	tmp = _mm_loadu_si128((const __m128i *)&state[0]);
+	state1 = _mm_loadu_si128((const __m128i *)&state[4]);
+	tmp = _mm_shuffle_epi32(tmp, 0xb1);
+	state1 = _mm_shuffle_epi32(state1, 0x1b);
+	state0 = _mm_alignr_epi8(tmp, state1, 8);
+	state1 = _mm_blend_epi16(state1, tmp, 0xf0);
+
+	for (; n > 0; n--, blocks += 64) {
+		abef = state0;
+		cdgh = state1;
+
+		// four rounds per step, w holds the last four schedule words
+		for (i = 0; i < 16; i++) {
+			if (i < 4) {
+				w[i] = _mm_shuffle_epi8(
+					_mm_loadu_si128((const __m128i *)(blocks + i * 16)),
+					bswap);
+			} else {
+				tmp = _mm_sha256msg1_epu32(w[i & 3], w[(i + 1) & 3]);
+				tmp = _mm_add_epi32(tmp,
+						    _mm_alignr_epi8(w[(i + 3) & 3],
+								    w[(i + 2) & 3], 4));
+				w[i & 3] = _mm_sha256msg2_epu32(tmp, w[(i + 3) & 3]);
+			}
+
+			msg = _mm_add_epi32(w[i & 3],
+					    _mm_loadu_si128((const __m128i *)&sha256_k[i * 4]));
+			state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+			msg = _mm_shuffle_epi32(msg, 0x0e);
+			state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+		}
+
+		state0 = _mm_add_epi32(state0, abef);
+		state1 = _mm_add_epi32(state1, cdgh);
+	}
+
+	tmp = _mm_shuffle_epi32(state0, 0x1b);
+	state1 = _mm_shuffle_epi32(state1, 0xb1);
+	state0 = _mm_blend_epi16(tmp, state1, 0xf0);
+	state1 = _mm_alignr_epi8(state1, tmp, 8);
+
+	_mm_storeu_si128((__m128i *)&state[0], state0);
+	_mm_storeu_si128((__m128i *)&state[4], state1);
+}
+
+#define ROTR8(x, n) _mm256_or_si256(_mm256_srli_epi32(x, n), \
+				    _mm256_slli_epi32(x, 32 - (n)))
+
+/* one block for each of 8 messages. state[i] holds word i of every lane */
+static AVX2 void
+sha256_compress_avx2(u32 state[8][8], const u8 *blocks[8]) {
+	__m256i s[8], v[8], w[16], t1, t2, x, y;
+	int i, j;
+
+	for (i = 0; i < 8; i++)
+		s[i] = v[i] = _mm256_loadu_si256((const __m256i *)state[i]);
+
+	for (i = 0; i < 64; i++) {
+		if (i < 16) {
+			w[i] = _mm256_setr_epi32(
+				load_be32(blocks[0] + i * 4), load_be32(blocks[1] + i * 4),
+				load_be32(blocks[2] + i * 4), load_be32(blocks[3] + i * 4),
+				load_be32(blocks[4] + i * 4), load_be32(blocks[5] + i * 4),
+				load_be32(blocks[6] + i * 4), load_be32(blocks[7] + i * 4));
+		} else {
+			x = w[(i - 15) & 15];
+			y = w[(i - 2) & 15];
+			x = _mm256_xor_si256(_mm256_xor_si256(ROTR8(x, 7), ROTR8(x, 18)),
+					     _mm256_srli_epi32(x, 3));
+			y = _mm256_xor_si256(_mm256_xor_si256(ROTR8(y, 17), ROTR8(y, 19)),
+					     _mm256_srli_epi32(y, 10));
+			w[i & 15] = _mm256_add_epi32(
+				_mm256_add_epi32(w[i & 15], w[(i - 7) & 15]),
+				_mm256_add_epi32(x, y));
+		}
+
+		// v[0..7] are a..h
+		t1 = _mm256_add_epi32(v[7],
+			_mm256_xor_si256(_mm256_xor_si256(ROTR8(v[4], 6), ROTR8(v[4], 11)),
+					 ROTR8(v[4], 25)));
+		t1 = _mm256_add_epi32(t1,
+			_mm256_xor_si256(_mm256_and_si256(v[4], v[5]),
+					 _mm256_andnot_si256(v[4], v[6])));
+		t1 = _mm256_add_epi32(t1, _mm256_add_epi32(
+			_mm256_set1_epi32((int)sha256_k[i]), w[i & 15]));
+
+		t2 = _mm256_xor_si256(_mm256_xor_si256(ROTR8(v[0], 2), ROTR8(v[0], 13)),
+				      ROTR8(v[0], 22));
+		t2 = _mm256_add_epi32(t2,
+			_mm256_or_si256(_mm256_and_si256(v[0], v[1]),
+					_mm256_and_si256(v[2], _mm256_or_si256(v[0], v[1]))));
+
+		for (j = 7; j > 0; j--)
+			v[j] = v[j - 1];
+		v[4] = _mm256_add_epi32(v[4], t1);
+		v[0] = _mm256_add_epi32(t1, t2);
+	}
+
+	for (i = 0; i < 8; i++)
+		_mm256_storeu_si256((__m256i *)state[i],
+				    _mm256_add_epi32(s[i], v[i]));
+}
+
+struct sha256_lane {
+	struct sha256_feed feed;
+	struct sha256_msg inner;
+	u8 digest[32];
+	u8 buf[64];
+	size_t msg;
+	int second;
+};
+
+static void lane_start(u32 state[8][8], int l, struct sha256_lane *lane,
+		       const struct sha256_msg *msg)
+{
+	int i;
+
+	for (i = 0; i < 8; i++)
+		state[i][l] = sha256_iv[i];
+	feed_init(&lane->feed, msg);
+}
+
+static void
+sha256d_many_avx2(const struct sha256_msg *msgs, size_t n, u8 (*out)[32]) {
+	static const u8 idle[64];
+	struct sha256_lane lanes[8];
+	u32 state[8][8], words[8];
+	const u8 *blocks[8];
+	size_t next = 0, nblocks;
+	int l, i, active = 0;
+
+	// idle lanes hash garbage, but defined garbage
+	memset(state, 0, sizeof(state));
+
+	for (l = 0; l < 8; l++) {
+		lanes[l].msg = next < n ? next++ : n;
+		lanes[l].second = 0;
+		if (lanes[l].msg < n) {
+			lane_start(state, l, &lanes[l], &msgs[lanes[l].msg]);
+			active++;
+		}
+	}
+
+	while (active > 0) {
+		for (l = 0; l < 8; l++) {
+			blocks[l] = idle;
+			if (lanes[l].msg < n)
+				blocks[l] = feed_next(&lanes[l].feed, lanes[l].buf,
+						      1, &nblocks);
+		}
+
+		sha256_compress_avx2(state, blocks);
+
+		for (l = 0; l < 8; l++) {
+			struct sha256_lane *lane = &lanes[l];
+
+			if (lane->msg >= n || lane->feed.stage != FEED_DONE)
+				continue;
+
+			for (i = 0; i < 8; i++)
+				words[i] = state[i][l];
+
+			// the first hash becomes the message of the second
+			if (!lane->second) {
+				state_digest(words, lane->digest);
+				lane->inner.seg[0] = lane->digest;
+				lane->inner.len[0] = 32;
+				lane->inner.num_segs = 1;
+				lane->second = 1;
+				lane_start(state, l, lane, &lane->inner);
+				continue;
+			}
+
+			state_digest(words, out[lane->msg]);
+
+			lane->second = 0;
+			lane->msg = next < n ? next++ : n;
+			if (lane->msg < n)
+				lane_start(state, l, lane, &msgs[lane->msg]);
+			else
+				active--;
+		}
+	}
+}
+
+#endif /* PSBT_X86 */
+
+/* hashes msg on top of state, which already took done bytes */
+static void sha256_msg_finish(sha256_compress_fn *compress, u32 *state,
+			      u64 done, const struct sha256_msg *msg, u8 *out)
+{
+	struct sha256_feed feed;
+	u8 buf[64];
+	const u8 *p;
+	size_t nblocks;
+
+	feed_init(&feed, msg);
+	feed.total = done;
+
+	while ((p = feed_next(&feed, buf, (size_t)-1, &nblocks)) != NULL)
+		compress(state, p, nblocks);
+
+	state_digest(state, out);
+}
+
+static void sha256_msg_hash(sha256_compress_fn *compress,
+			    const struct sha256_msg *msg, u8 *out)
+{
+	u32 state[8];
+
+	memcpy(state, sha256_iv, sizeof(state));
+	sha256_msg_finish(compress, state, 0, msg, out);
+}
+
+static sha256_compress_fn *sha256_compress_for(unsigned int cpu) {
+#ifdef PSBT_X86
+	if (cpu & CPU_SHA)
+		return sha256_compress_shani;
+#endif
+	return sha256_compress_scalar;
+}
+
+void sha256d_many_cpu(const struct sha256_msg *msgs, size_t n,
+		      unsigned char (*out)[32], unsigned int cpu)
+{
+	sha256_compress_fn *compress = sha256_compress_for(cpu);
+	struct sha256_msg inner;
+	u8 digest[32];
+	size_t i;
+
+#ifdef PSBT_X86
+	// sha-ni on one message beats 8 avx2 lanes, so lanes are only used
+	// without it
+	if (!(cpu & CPU_SHA) && (cpu & CPU_AVX2) && n >= MULTI_BUFFER_MIN) {
+		sha256d_many_avx2(msgs, n, out);
+		return;
+	}
+#endif
+
+	inner.seg[0] = digest;
+	inner.len[0] = sizeof(digest);
+	inner.num_segs = 1;
+
+	for (i = 0; i < n; i++) {
+		sha256_msg_hash(compress, &msgs[i], digest);
+		sha256_msg_hash(compress, &inner, out[i]);
+	}
+}
+
+void sha256d_many(const struct sha256_msg *msgs, size_t n,
+		  unsigned char (*out)[32])
+{
+	sha256d_many_cpu(msgs, n, out, cpu_features());
+}
+
+void sha256_init(struct sha256_ctx *ctx) {
+	memcpy(ctx->state, sha256_iv, sizeof(ctx->state));
+	ctx->buf_len = 0;
+	ctx->total = 0;
+}
+
+void sha256_update(struct sha256_ctx *ctx, const unsigned char *data,
+		   size_t len)
+{
+	sha256_compress_fn *compress = sha256_compress_for(cpu_features());
+	size_t take;
+
+	ctx->total += len;
+
+	if (ctx->buf_len) {
+		take = 64 - ctx->buf_len < len ? 64 - ctx->buf_len : len;
+		memcpy(ctx->buf + ctx->buf_len, data, take);
+		ctx->buf_len += take;
+		data += take;
+		len -= take;
+		if (ctx->buf_len < 64)
+			return;
+		compress(ctx->state, ctx->buf, 1);
+		ctx->buf_len = 0;
+	}
+
+	if (len >= 64) {
+		compress(ctx->state, data, len / 64);
+		data += len / 64 * 64;
+		len %= 64;
+	}
+
+	memcpy(ctx->buf, data, len);
+	ctx->buf_len = len;
+}
+
+void sha256_final(struct sha256_ctx *ctx, unsigned char out[32]) {
+	struct sha256_msg msg;
+
+	// only the tail is left, the feed pads it for the right total
+	msg.seg[0] = ctx->buf;
+	msg.len[0] = ctx->buf_len;
+	msg.num_segs = 1;
+
+	sha256_msg_finish(sha256_compress_for(cpu_features()), ctx->state,
+			  ctx->total - ctx->buf_len, &msg, out);
+}
+
+void sha256(const unsigned char *data, size_t len, unsigned char out[32]) {
+	struct sha256_msg msg;
+
+	msg.seg[0] = data;
+	msg.len[0] = len;
+	msg.num_segs = 1;
+
+	sha256_msg_hash(sha256_compress_for(cpu_features()), &msg, out);
+}
+
+void sha256d(const unsigned char *data, size_t len, unsigned char out[32]) {
+	struct sha256_msg msg;
+
+	msg.seg[0] = data;
+	msg.len[0] = len;
+	msg.num_segs = 1;
+
+	sha256d_many(&msg, 1, (u8 (*)[32])out);
+}
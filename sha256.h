@@ -0,0 +1,45 @@
+
+#ifndef PSBT_SHA256_H
+#define PSBT_SHA256_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA256_MAX_SEGS 3
+
+/* a message given as up to SHA256_MAX_SEGS pieces, hashed as if they were
+ * one buffer. Lets witness txs be hashed for their txid without copying */
+struct sha256_msg {
+	const unsigned char *seg[SHA256_MAX_SEGS];
+	size_t len[SHA256_MAX_SEGS];
+	unsigned int num_segs;
+};
+
+/* incremental hashing, for data that isn't laid out in a few segments */
+struct sha256_ctx {
+	uint32_t state[8];
+	unsigned char buf[64];
+	size_t buf_len;
+	uint64_t total;
+};
+
+void sha256_init(struct sha256_ctx *ctx);
+void sha256_update(struct sha256_ctx *ctx, const unsigned char *data,
+		   size_t len);
+void sha256_final(struct sha256_ctx *ctx, unsigned char out[32]);
+
+void sha256(const unsigned char *data, size_t len, unsigned char out[32]);
+
+/* sha256(sha256(data)) */
+void sha256d(const unsigned char *data, size_t len, unsigned char out[32]);
+
+/* sha256d of n messages. Without SHA-NI but with AVX2 they are hashed 8
+ * at a time, a lane that finishes takes the next message right away */
+void sha256d_many(const struct sha256_msg *msgs, size_t n,
+		  unsigned char (*out)[32]);
+
+/* sha256d_many restricted to the backends in cpu, see cpu_features */
+void sha256d_many_cpu(const struct sha256_msg *msgs, size_t n,
+		      unsigned char (*out)[32], unsigned int cpu);
+
+#endif /* PSBT_SHA256_H */
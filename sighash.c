@@ -0,0 +1,408 @@
+
+#include <string.h>
+
+#include "psbt.h"
+#include "parser.h"
+#include "compactsize.h"
+#include "sha256.h"
+#include "common.h"
+
+#define SIGHASH_OUTPUT_MASK 0x03
+
+struct sighash_builder {
+	struct psbt_sighash *sh;
+	struct sha256_ctx prevouts;
+	struct sha256_ctx sequences;
+	struct sha256_ctx outputs;
+	enum psbt_result res;
+};
+
+static void put_le32(u8 *p, u32 v) {
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+static void put_le64(u8 *p, u64 v) {
+	put_le32(p, (u32)v);
+	put_le32(p + 4, (u32)(v >> 32));
+}
+
+static u32 read_le32(const u8 *p) {
+	return (u32)p[0] | (u32)p[1] << 8 | (u32)p[2] << 16 | (u32)p[3] << 24;
+}
+
+static u64 read_le64(const u8 *p) {
+	return (u64)read_le32(p) | (u64)read_le32(p + 4) << 32;
+}
+
+static void update_le32(struct sha256_ctx *ctx, u32 v) {
+	u8 buf[4];
+
+	put_le32(buf, v);
+	sha256_update(ctx, buf, sizeof(buf));
+}
+
+static void update_le64(struct sha256_ctx *ctx, u64 v) {
+	u8 buf[8];
+
+	put_le64(buf, v);
+	sha256_update(ctx, buf, sizeof(buf));
+}
+
+static void update_script(struct sha256_ctx *ctx, const u8 *script, u32 len) {
+	u8 buf[9];
+
+	compactsize_write(buf, len);
+	sha256_update(ctx, buf, compactsize_length(len));
+	if (len)
+		sha256_update(ctx, script, len);
+}
+
+/* the bip143 double hash is the single bip341 one hashed again */
+static void rehash(const u8 single[32], u8 out[32]) {
+	sha256(single, 32, out);
+}
+
+static void sighash_txin(struct sighash_builder *b, struct psbt_txin *txin) {
+	struct psbt_sighash *sh = b->sh;
+	struct psbt_sighash_input *in;
+
+	if (sh->num_inputs >= sh->inputs_capacity) {
+		psbt_errmsg = "psbt_sighash_build: inputs array is too small";
+		b->res = PSBT_OOB_WRITE;
+		return;
+	}
+
+	// the index follows the txid in the serialized tx
+	in = &sh->inputs[sh->num_inputs++];
+	in->outpoint = txin->txid;
+	in->sequence = txin->sequence_number;
+	in->has_utxo = 0;
+
+	sha256_update(&b->prevouts, in->outpoint, 36);
+	update_le32(&b->sequences, in->sequence);
+}
+
+static void sighash_txout(struct sighash_builder *b, struct psbt_txout *txout) {
+	struct psbt_sighash *sh = b->sh;
+	struct psbt_sighash_output *out;
+	u32 len_size = compactsize_length(txout->script_len);
+
+	if (sh->num_outputs >= sh->outputs_capacity) {
+		psbt_errmsg = "psbt_sighash_build: outputs array is too small";
+		b->res = PSBT_OOB_WRITE;
+		return;
+	}
+
+	out = &sh->outputs[sh->num_outputs++];
+	out->data = txout->script - len_size - 8;
+	out->size = 8 + len_size + txout->script_len;
+
+	sha256_update(&b->outputs, out->data, out->size);
+}
+
+static void sighash_utxo(struct sighash_builder *b, struct psbt_record *rec,
+			 int index)
+{
+	struct psbt_sighash *sh = b->sh;
+	struct psbt_sighash_input *in;
+	struct psbt_txout txout;
+	enum psbt_result res;
+
+	if (index < 0 || (unsigned int)index >= sh->num_inputs) {
+		psbt_errmsg = "psbt_sighash_build: utxo of an unknown input";
+		b->res = PSBT_READ_ERROR;
+		return;
+	}
+
+	in = &sh->inputs[index];
+
+	// a witness utxo is a serialized txout
+	if (rec->type == PSBT_IN_WITNESS_UTXO) {
+		res = PSBT_OK;
+		if (rec->val_size < 9 ||
+		    rec->val_size < 8 + compactsize_peek_length(rec->val[8])) {
+			psbt_errmsg = "psbt_sighash_build: invalid witness utxo";
+			b->res = PSBT_READ_ERROR;
+			return;
+		}
+
+		txout.amount = read_le64(rec->val);
+		txout.script_len = compactsize_read(rec->val + 8, &res);
+		txout.script = rec->val + 8 +
+			compactsize_peek_length(rec->val[8]);
+		if (res != PSBT_OK || txout.script + txout.script_len !=
+		    rec->val + rec->val_size) {
+			psbt_errmsg = "psbt_sighash_build: invalid witness utxo";
+			b->res = PSBT_READ_ERROR;
+			return;
+		}
+	} else {
+		// a witness utxo wins, it is all segwit signers look at
+		if (in->has_utxo)
+			return;
+
+		res = psbt_tx_get_output(rec->val, rec->val_size,
+					 read_le32(in->outpoint + 32),
+					 &txout);
+		if (res != PSBT_OK) {
+			b->res = res;
+			return;
+		}
+	}
+
+	in->has_utxo = 1;
+	in->amount = txout.amount;
+	in->script_pubkey = txout.script;
+	in->script_pubkey_len = txout.script_len;
+}
+
+static void sighash_elem(struct psbt_elem *elem) {
+	struct sighash_builder *b = (struct sighash_builder *)elem->user_data;
+	struct psbt_txelem *txelem;
+	struct psbt_record *rec;
+
+	if (b->res != PSBT_OK)
+		return;
+
+	if (elem->type == PSBT_ELEM_TXELEM) {
+		txelem = elem->elem.txelem;
+		switch (txelem->elem_type) {
+		case PSBT_TXELEM_TXIN:
+			sighash_txin(b, txelem->elem.txin);
+			break;
+		case PSBT_TXELEM_TXOUT:
+			sighash_txout(b, txelem->elem.txout);
+			break;
+		case PSBT_TXELEM_TX:
+			b->sh->version = txelem->elem.tx->version;
+			b->sh->lock_time = txelem->elem.tx->lock_time;
+			break;
+		default:
+			break;
+		}
+		return;
+	}
+
+	rec = elem->elem.rec;
+	if (rec->scope == PSBT_SCOPE_INPUTS &&
+	    (rec->type == PSBT_IN_WITNESS_UTXO ||
+	     rec->type == PSBT_IN_NON_WITNESS_UTXO))
+		sighash_utxo(b, rec, elem->index);
+}
+
+enum psbt_result
+psbt_sighash_init(struct psbt_sighash *sh,
+		  struct psbt_sighash_input *inputs, size_t inputs_capacity,
+		  struct psbt_sighash_output *outputs, size_t outputs_capacity)
+{
+	memset(sh, 0, sizeof(*sh));
+	sh->inputs = inputs;
+	sh->inputs_capacity = inputs_capacity;
+	sh->outputs = outputs;
+	sh->outputs_capacity = outputs_capacity;
+	return PSBT_OK;
+}
+
+enum psbt_result
+psbt_sighash_build(struct psbt_sighash *sh, const unsigned char *psbt_data,
+		   size_t psbt_size)
+{
+	struct sighash_builder b;
+	struct sha256_ctx amounts, scripts;
+	struct psbt psbt;
+	enum psbt_result res;
+	unsigned int i;
+
+	b.sh = sh;
+	b.res = PSBT_OK;
+	sha256_init(&b.prevouts);
+	sha256_init(&b.sequences);
+	sha256_init(&b.outputs);
+
+	sh->num_inputs = 0;
+	sh->num_outputs = 0;
+
+	res = psbt_read_view(psbt_data, psbt_size, &psbt, sighash_elem, &b);
+	if (res != PSBT_OK)
+		return res;
+	if (b.res != PSBT_OK)
+		return psbt_fail(b.res);
+
+	sha256_final(&b.prevouts, sh->sha_prevouts);
+	sha256_final(&b.sequences, sh->sha_sequences);
+	sha256_final(&b.outputs, sh->sha_outputs);
+
+	rehash(sh->sha_prevouts, sh->hash_prevouts);
+	rehash(sh->sha_sequences, sh->hash_sequence);
+	rehash(sh->sha_outputs, sh->hash_outputs);
+
+	// taproot commits to every spent output, so these need all utxos
+	sh->have_all_utxos = 1;
+	sha256_init(&amounts);
+	sha256_init(&scripts);
+	for (i = 0; i < sh->num_inputs; i++) {
+		if (!sh->inputs[i].has_utxo) {
+			sh->have_all_utxos = 0;
+			break;
+		}
+		update_le64(&amounts, sh->inputs[i].amount);
+		update_script(&scripts, sh->inputs[i].script_pubkey,
+			      sh->inputs[i].script_pubkey_len);
+	}
+
+	if (sh->have_all_utxos) {
+		sha256_final(&amounts, sh->sha_amounts);
+		sha256_final(&scripts, sh->sha_scriptpubkeys);
+	}
+
+	return PSBT_OK;
+}
+
+enum psbt_result
+psbt_sighash_segwit_v0(const struct psbt_sighash *sh, unsigned int n,
+		       const unsigned char *script_code,
+		       size_t script_code_size, unsigned int sighash_type,
+		       unsigned char out[32])
+{
+	const struct psbt_sighash_input *in;
+	unsigned int base = sighash_type & 0x1f;
+	int anyonecanpay = sighash_type & PSBT_SIGHASH_ANYONECANPAY;
+	static const u8 zero[32];
+	struct sha256_ctx ctx;
+	u8 single[32], buf[32];
+
+	if (n >= sh->num_inputs) {
+		psbt_errmsg = "psbt_sighash_segwit_v0: no such input";
+		return psbt_fail(PSBT_INVALID_STATE);
+	}
+
+	in = &sh->inputs[n];
+	if (!in->has_utxo) {
+		psbt_errmsg = "psbt_sighash_segwit_v0: input has no utxo";
+		return psbt_fail(PSBT_INVALID_STATE);
+	}
+
+	sha256_init(&ctx);
+	update_le32(&ctx, sh->version);
+	sha256_update(&ctx, anyonecanpay ? zero : sh->hash_prevouts, 32);
+	sha256_update(&ctx, anyonecanpay || base == PSBT_SIGHASH_NONE ||
+		      base == PSBT_SIGHASH_SINGLE ? zero : sh->hash_sequence, 32);
+	sha256_update(&ctx, in->outpoint, 36);
+	sha256_update(&ctx, script_code, script_code_size);
+	update_le64(&ctx, in->amount);
+	update_le32(&ctx, in->sequence);
+
+	if (base != PSBT_SIGHASH_NONE && base != PSBT_SIGHASH_SINGLE) {
+		sha256_update(&ctx, sh->hash_outputs, 32);
+	} else if (base == PSBT_SIGHASH_SINGLE && n < sh->num_outputs) {
+		sha256d(sh->outputs[n].data, sh->outputs[n].size, buf);
+		sha256_update(&ctx, buf, 32);
+	} else {
+		sha256_update(&ctx, zero, 32);
+	}
+
+	update_le32(&ctx, sh->lock_time);
+	update_le32(&ctx, sighash_type);
+
+	sha256_final(&ctx, single);
+	sha256(single, 32, out);
+
+	return PSBT_OK;
+}
+
+enum psbt_result
+psbt_sighash_taproot(const struct psbt_sighash *sh, unsigned int n,
+		     unsigned int sighash_type, const unsigned char *leaf_hash,
+		     unsigned int codesep_pos, unsigned char out[32])
+{
+	const struct psbt_sighash_input *in;
+	unsigned int outputs = sighash_type & SIGHASH_OUTPUT_MASK;
+	int anyonecanpay = sighash_type & PSBT_SIGHASH_ANYONECANPAY;
+	struct sha256_ctx ctx;
+	u8 tag[32], buf[32];
+
+	if (sighash_type > PSBT_SIGHASH_SINGLE &&
+	    (sighash_type < (PSBT_SIGHASH_ANYONECANPAY | PSBT_SIGHASH_ALL) ||
+	     sighash_type > (PSBT_SIGHASH_ANYONECANPAY | PSBT_SIGHASH_SINGLE))) {
+		psbt_errmsg = "psbt_sighash_taproot: invalid sighash type";
+		return psbt_fail(PSBT_INVALID_STATE);
+	}
+
+	if (n >= sh->num_inputs) {
+		psbt_errmsg = "psbt_sighash_taproot: no such input";
+		return psbt_fail(PSBT_INVALID_STATE);
+	}
+
+	in = &sh->inputs[n];
+
+	// anyonecanpay commits to this input's utxo only
+	if (anyonecanpay && !in->has_utxo) {
+		psbt_errmsg = "psbt_sighash_taproot: input needs a utxo";
+		return psbt_fail(PSBT_INVALID_STATE);
+	}
+
+	if (!anyonecanpay && !sh->have_all_utxos) {
+		psbt_errmsg = "psbt_sighash_taproot: every input needs a utxo";
+		return psbt_fail(PSBT_INVALID_STATE);
+	}
+
+	if (outputs == PSBT_SIGHASH_SINGLE && n >= sh->num_outputs) {
+		psbt_errmsg = "psbt_sighash_taproot: no output for "
+			"SIGHASH_SINGLE";
+		return psbt_fail(PSBT_INVALID_STATE);
+	}
+
+	// tagged hash: sha256(tag || tag || 0x00 || msg)
+	sha256((const u8 *)"TapSighash", 10, tag);
+	sha256_init(&ctx);
+	sha256_update(&ctx, tag, 32);
+	sha256_update(&ctx, tag, 32);
+
+	buf[0] = 0x00;
+	buf[1] = (u8)sighash_type;
+	sha256_update(&ctx, buf, 2);
+	update_le32(&ctx, sh->version);
+	update_le32(&ctx, sh->lock_time);
+
+	if (!anyonecanpay) {
+		sha256_update(&ctx, sh->sha_prevouts, 32);
+		sha256_update(&ctx, sh->sha_amounts, 32);
+		sha256_update(&ctx, sh->sha_scriptpubkeys, 32);
+		sha256_update(&ctx, sh->sha_sequences, 32);
+	}
+
+	if (outputs != PSBT_SIGHASH_NONE && outputs != PSBT_SIGHASH_SINGLE)
+		sha256_update(&ctx, sh->sha_outputs, 32);
+
+	// spend type, no annex
+	buf[0] = leaf_hash ? 2 : 0;
+	sha256_update(&ctx, buf, 1);
+
+	if (anyonecanpay) {
+		sha256_update(&ctx, in->outpoint, 36);
+		update_le64(&ctx, in->amount);
+		update_script(&ctx, in->script_pubkey, in->script_pubkey_len);
+		update_le32(&ctx, in->sequence);
+	} else {
+		update_le32(&ctx, n);
+	}
+
+	if (outputs == PSBT_SIGHASH_SINGLE) {
+		sha256(sh->outputs[n].data, sh->outputs[n].size, buf);
+		sha256_update(&ctx, buf, 32);
+	}
+
+	if (leaf_hash) {
+		sha256_update(&ctx, leaf_hash, 32);
+		buf[0] = 0x00; // key version
+		sha256_update(&ctx, buf, 1);
+		update_le32(&ctx, codesep_pos);
+	}
+
+	sha256_final(&ctx, out);
+
+	return PSBT_OK;
+}
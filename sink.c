@@ -0,0 +1,147 @@
+
+#define _DEFAULT_SOURCE
+
+#include <errno.h>
+#include <unistd.h>
+
+#include "psbt.h"
+#include "parser.h"
+#include "base64.h"
+#include "hex.h"
+#include "common.h"
+
+/* encoded characters handed to the sink per call */
+#define SINK_BLOCK 4096
+
+/* hands a block to the sink, a failing sink gets a message if it set none */
+static enum psbt_result
+sink_write(psbt_sink *sink, void *sink_data, const u8 *data, size_t size)
+{
+	char *msg = psbt_errmsg;
+	enum psbt_result res;
+
+	res = sink(sink_data, data, size);
+	if (res == PSBT_OK)
+		return PSBT_OK;
+
+	if (psbt_errmsg == msg)
+		psbt_errmsg = "psbt_encode_to_sink: sink failed";
+	return psbt_fail(res);
+}
+
+static enum psbt_result
+sink_hex(const u8 *src, size_t len, psbt_sink *sink, void *sink_data) {
+	u8 block[SINK_BLOCK];
+	enum psbt_result res;
+	size_t i, n;
+
+	for (i = 0; i < len; i += n) {
+		n = len - i;
+		if (n > SINK_BLOCK / 2)
+			n = SINK_BLOCK / 2;
+
+		hex_encode(src + i, n, block);
+
+		res = sink_write(sink, sink_data, block, n * 2);
+		if (res != PSBT_OK)
+			return res;
+	}
+
+	return PSBT_OK;
+}
+
+static enum psbt_result
+sink_base64(const u8 *src, size_t len, psbt_sink *sink, void *sink_data)
+{
+	// whole 3 byte groups, so only the last block is padded
+	u8 block[SINK_BLOCK + 1];
+	enum psbt_result res;
+	size_t i, n, olen;
+	u8 *c;
+
+	for (i = 0; i < len; i += n) {
+		n = len - i;
+		if (n > SINK_BLOCK / 4 * 3)
+			n = SINK_BLOCK / 4 * 3;
+
+		c = base64_encode(src + i, n, block, sizeof(block), &olen);
+		if (c == NULL) {
+			psbt_errmsg = "psbt_encode_to_sink: base64 encode failure";
+			return psbt_fail(PSBT_WRITE_ERROR);
+		}
+
+		res = sink_write(sink, sink_data, block, olen);
+		if (res != PSBT_OK)
+			return res;
+	}
+
+	return PSBT_OK;
+}
+
+enum psbt_result
+psbt_encode_to_sink(const unsigned char *psbt_data, size_t psbt_len,
+		    enum psbt_encoding encoding, psbt_sink *sink,
+		    void *sink_data)
+{
+	switch (encoding) {
+	case PSBT_ENCODING_RAW:
+		return sink_write(sink, sink_data, psbt_data, psbt_len);
+	case PSBT_ENCODING_HEX:
+		return sink_hex(psbt_data, psbt_len, sink, sink_data);
+	case PSBT_ENCODING_BASE64:
+		return sink_base64(psbt_data, psbt_len, sink, sink_data);
+	case PSBT_ENCODING_BASE62:
+	case PSBT_ENCODING_PROTOBUF:
+		break;
+	}
+
+	psbt_errmsg = "psbt_encode_to_sink: unsupported psbt_encoding";
+	return psbt_fail(PSBT_NOT_IMPLEMENTED);
+}
+
+static enum psbt_result
+file_sink(void *sink_data, const unsigned char *data, size_t size) {
+	if (fwrite(data, 1, size, (FILE *)sink_data) != size) {
+		psbt_errmsg = "psbt_encode_to_file: fwrite failed";
+		return psbt_fail(PSBT_WRITE_ERROR);
+	}
+
+	return PSBT_OK;
+}
+
+static enum psbt_result
+fd_sink(void *sink_data, const unsigned char *data, size_t size) {
+	int fd = *(int *)sink_data;
+	ssize_t n;
+
+	while (size > 0) {
+		n = write(fd, data, size);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			psbt_errmsg = "psbt_encode_to_fd: write failed";
+			return psbt_fail(PSBT_WRITE_ERROR);
+		}
+
+		data += n;
+		size -= n;
+	}
+
+	return PSBT_OK;
+}
+
+enum psbt_result
+psbt_encode_to_file(const unsigned char *psbt_data, size_t psbt_len,
+		    enum psbt_encoding encoding, FILE *file)
+{
+	return psbt_encode_to_sink(psbt_data, psbt_len, encoding, file_sink,
+				   file);
+}
+
+enum psbt_result
+psbt_encode_to_fd(const unsigned char *psbt_data, size_t psbt_len,
+		  enum psbt_encoding encoding, int fd)
+{
+	return psbt_encode_to_sink(psbt_data, psbt_len, encoding, fd_sink,
+				   &fd);
+}
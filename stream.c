@@ -0,0 +1,403 @@
+
+#include <string.h>
+
+#include "psbt.h"
+#include "parser.h"
+#include "compactsize.h"
+#include "base64.h"
+#include "hex.h"
+#include "common.h"
+
+#define HEADER_SIZE (sizeof(PSBT_MAGIC) + 1)
+
+/* decoded bytes per block of psbt_read_encoded, small enough to stay in L1 */
+#define DECODE_BLOCK 4096
+
+/* base64 characters that decode to at most DECODE_BLOCK bytes, counting a
+ * partial quantum left over from the previous block */
+#define BASE64_BLOCK ((DECODE_BLOCK / 3 - 1) * 4)
+
+/*
+ * How many bytes the record starting at p needs, as far as can be told
+ * from the avail bytes we have. Callers keep feeding bytes until avail
+ * reaches need.
+ */
+static enum psbt_result
+record_extent(const u8 *p, size_t avail, size_t *need) {
+	enum psbt_result res = PSBT_OK;
+	u64 key_size, val_size;
+	u32 size_len;
+	size_t n;
+
+	*need = 1;
+	if (avail < *need)
+		return PSBT_OK;
+
+	size_len = compactsize_peek_length(p[0]);
+	*need = size_len;
+	if (avail < *need)
+		return PSBT_OK;
+
+	key_size = compactsize_read((u8*)p, &res);
+	if (res != PSBT_OK)
+		return res;
+
+	n = size_len + key_size;
+	*need = n + 1;
+	if (avail < *need)
+		return PSBT_OK;
+
+	size_len = compactsize_peek_length(p[n]);
+	*need = n + size_len;
+	if (avail < *need)
+		return PSBT_OK;
+
+	val_size = compactsize_read((u8*)p + n, &res);
+	if (res != PSBT_OK)
+		return res;
+
+	*need = n + size_len + val_size;
+	return PSBT_OK;
+}
+
+static size_t
+stream_item_extent(struct psbt_stream *st, const u8 *p, size_t avail,
+		   enum psbt_result *res)
+{
+	size_t need;
+
+	*res = PSBT_OK;
+
+	if (st->state == PSBT_ST_INIT)
+		return HEADER_SIZE;
+
+	*res = record_extent(p, avail, &need);
+	return need;
+}
+
+static enum psbt_result
+stream_header(struct psbt_stream *st, const u8 *p) {
+	if (memcmp(p, PSBT_MAGIC, sizeof(PSBT_MAGIC)) != 0) {
+		psbt_errmsg = "psbt_stream_feed: invalid magic header";
+		return psbt_fail(PSBT_READ_ERROR);
+	}
+
+	if (p[sizeof(PSBT_MAGIC)] != 0xff) {
+		psbt_errmsg = "psbt_stream_feed: no 0xff found after magic";
+		return psbt_fail(PSBT_READ_ERROR);
+	}
+
+	st->state = PSBT_ST_GLOBAL;
+	return PSBT_OK;
+}
+
+/* p holds a complete record, see record_extent */
+static enum psbt_result
+stream_record(struct psbt_stream *st, const u8 *p) {
+	enum psbt_result res = PSBT_OK;
+	struct psbt_record rec;
+	struct psbt_tx_counter counter;
+	u64 size;
+	u32 size_len;
+
+	size_len = compactsize_peek_length(*p);
+	size = compactsize_read((u8*)p, &res);
+	p += size_len;
+
+	rec.key_size = size - 1; // don't include type in key size
+	rec.type = *p;
+	rec.key = (u8*)p + 1;
+	p += size;
+
+	size_len = compactsize_peek_length(*p);
+	size = compactsize_read((u8*)p, &res);
+	p += size_len;
+
+	rec.val_size = size;
+	rec.val = (u8*)p;
+
+	switch (st->state) {
+	case PSBT_ST_GLOBAL:
+		rec.scope = PSBT_SCOPE_GLOBAL;
+		break;
+	case PSBT_ST_INPUTS:
+		rec.scope = PSBT_SCOPE_INPUTS;
+		break;
+	case PSBT_ST_OUTPUTS:
+		rec.scope = PSBT_SCOPE_OUTPUTS;
+		break;
+	default:
+		psbt_errmsg = "psbt_stream_feed: invalid record state";
+		return psbt_fail(PSBT_INVALID_STATE);
+	}
+
+	counter.inputs = st->inputs;
+	counter.outputs = st->outputs;
+	counter.handler = st->handler;
+	counter.user_data = st->user_data;
+
+	res = psbt_emit_record(&counter, &rec, st->kvs);
+
+	st->inputs = counter.inputs;
+	st->outputs = counter.outputs;
+
+	return res;
+}
+
+static enum psbt_result
+stream_item(struct psbt_stream *st, const u8 *p) {
+	if (st->state == PSBT_ST_INIT)
+		return stream_header(st, p);
+	return stream_record(st, p);
+}
+
+/* a null byte closes the current map */
+static void stream_close_map(struct psbt_stream *st) {
+	switch (st->state) {
+	case PSBT_ST_GLOBAL:
+		// no maps at all for empty input/output lists
+		if (st->inputs > 0)
+			st->state = PSBT_ST_INPUTS;
+		else if (st->outputs > 0)
+			st->state = PSBT_ST_OUTPUTS;
+		else
+			st->state = PSBT_ST_FINALIZED;
+		break;
+
+	case PSBT_ST_INPUTS:
+		if (++st->kvs >= st->inputs) {
+			st->state = st->outputs > 0
+				? PSBT_ST_OUTPUTS
+				: PSBT_ST_FINALIZED;
+			st->kvs = 0;
+		}
+		break;
+
+	case PSBT_ST_OUTPUTS:
+		if (++st->kvs >= st->outputs)
+			st->state = PSBT_ST_FINALIZED;
+		break;
+
+	default:
+		break;
+	}
+}
+
+enum psbt_result
+psbt_stream_init(struct psbt_stream *st, unsigned char *buf,
+		 size_t buf_capacity, psbt_elem_handler *elem_handler,
+		 void *user_data)
+{
+	st->state = PSBT_ST_INIT;
+	st->handler = elem_handler;
+	st->user_data = user_data;
+	st->buf = buf;
+	st->buf_capacity = buf_capacity;
+	st->buf_len = 0;
+	st->offset = 0;
+	st->kvs = 0;
+	st->inputs = 0;
+	st->outputs = 0;
+	return PSBT_OK;
+}
+
+static enum psbt_result
+stream_feed(struct psbt_stream *st, const unsigned char *chunk,
+	    size_t chunk_size)
+{
+	const u8 *p = chunk, *end = chunk + chunk_size;
+	enum psbt_result res;
+	size_t need, take;
+
+	while (p < end) {
+		// finish an item that was split over chunks
+		if (st->buf_len) {
+			need = stream_item_extent(st, st->buf, st->buf_len, &res);
+			if (res != PSBT_OK)
+				return res;
+
+			if (need > st->buf_capacity) {
+				psbt_errmsg = "psbt_stream_feed: record is larger "
+					"than the stream buffer";
+				return psbt_fail(PSBT_OOB_WRITE);
+			}
+
+			take = need - st->buf_len;
+			if (take > (size_t)(end - p))
+				take = end - p;
+
+			memcpy(st->buf + st->buf_len, p, take);
+			st->buf_len += take;
+			st->offset += take;
+			p += take;
+
+			if (st->buf_len < need)
+				continue;
+
+			// the extent may grow as more framing arrives
+			need = stream_item_extent(st, st->buf, st->buf_len, &res);
+			if (res != PSBT_OK)
+				return res;
+			if (need > st->buf_len)
+				continue;
+
+			res = stream_item(st, st->buf);
+			if (res != PSBT_OK)
+				return res;
+
+			st->buf_len = 0;
+			continue;
+		}
+
+		if (st->state == PSBT_ST_FINALIZED) {
+			psbt_errmsg = "psbt_stream_feed: data after end of psbt";
+			return psbt_fail(PSBT_READ_ERROR);
+		}
+
+		if (st->state != PSBT_ST_INIT && *p == 0) {
+			stream_close_map(st);
+			st->offset++;
+			p++;
+			continue;
+		}
+
+		need = stream_item_extent(st, p, end - p, &res);
+		if (res != PSBT_OK)
+			return res;
+
+		// complete in this chunk, no copy needed
+		if (need <= (size_t)(end - p)) {
+			res = stream_item(st, p);
+			if (res != PSBT_OK)
+				return res;
+			st->offset += need;
+			p += need;
+			continue;
+		}
+
+		take = end - p;
+		if (take > st->buf_capacity) {
+			psbt_errmsg = "psbt_stream_feed: record is larger "
+				"than the stream buffer";
+			return psbt_fail(PSBT_OOB_WRITE);
+		}
+
+		memcpy(st->buf, p, take);
+		st->buf_len = take;
+		st->offset += take;
+		p += take;
+	}
+
+	return PSBT_OK;
+}
+
+enum psbt_result
+psbt_stream_feed(struct psbt_stream *st, const unsigned char *chunk,
+		 size_t chunk_size)
+{
+	enum psbt_result res;
+
+	res = stream_feed(st, chunk, chunk_size);
+	if (res != PSBT_OK)
+		psbt_set_error(res, st->offset, st->state);
+
+	return res;
+}
+
+enum psbt_result
+psbt_stream_end(struct psbt_stream *st) {
+	if (st->state != PSBT_ST_FINALIZED || st->buf_len) {
+		psbt_errmsg = "psbt_stream_end: incomplete psbt";
+		return psbt_set_error(PSBT_READ_ERROR, st->offset, st->state);
+	}
+
+	return PSBT_OK;
+}
+
+static enum psbt_result
+read_hex_blocks(struct psbt_stream *st, const u8 *src, size_t src_size) {
+	u8 block[DECODE_BLOCK];
+	enum psbt_result res;
+	size_t i, n;
+
+	if (src_size % 2 != 0) {
+		psbt_errmsg = "psbt_read_encoded: invalid hex string";
+		return psbt_fail(PSBT_READ_ERROR);
+	}
+
+	for (i = 0; i < src_size; i += n) {
+		n = src_size - i;
+		if (n > DECODE_BLOCK * 2)
+			n = DECODE_BLOCK * 2;
+
+		if (!hex_decode(src + i, n, block)) {
+			psbt_errmsg = "psbt_read_encoded: invalid hex string";
+			return psbt_fail(PSBT_READ_ERROR);
+		}
+
+		res = psbt_stream_feed(st, block, n / 2);
+		if (res != PSBT_OK)
+			return res;
+	}
+
+	return PSBT_OK;
+}
+
+static enum psbt_result
+read_base64_blocks(struct psbt_stream *st, const u8 *src, size_t src_size) {
+	u8 block[DECODE_BLOCK];
+	struct base64_decoder dec;
+	enum psbt_result res;
+	size_t i, n, len;
+
+	base64_decoder_init(&dec);
+
+	for (i = 0; i < src_size; i += n) {
+		n = src_size - i;
+		if (n > BASE64_BLOCK)
+			n = BASE64_BLOCK;
+
+		if (!base64_decode_update(&dec, src + i, n, block,
+					  sizeof(block), &len)) {
+			psbt_errmsg = "psbt_read_encoded: invalid base64 string";
+			return psbt_fail(PSBT_READ_ERROR);
+		}
+
+		res = psbt_stream_feed(st, block, len);
+		if (res != PSBT_OK)
+			return res;
+	}
+
+	if (dec.count != 0) {
+		psbt_errmsg = "psbt_read_encoded: invalid base64 string";
+		return psbt_fail(PSBT_READ_ERROR);
+	}
+
+	return PSBT_OK;
+}
+
+enum psbt_result
+psbt_read_encoded(const char *src, size_t src_size, unsigned char *buf,
+		  size_t buf_capacity, psbt_elem_handler *elem_handler,
+		  void *user_data)
+{
+	struct psbt_stream st;
+	enum psbt_result res;
+
+	psbt_stream_init(&st, buf, buf_capacity, elem_handler, user_data);
+
+	// encoders count the nul terminator, see psbt_encode_raw
+	if (src_size > 0 && src[src_size - 1] == '\0')
+		src_size--;
+
+	// base64 detection, see psbt_decode
+	if (src_size >= 5 && memcmp(src, "cHNid", 5) == 0)
+		res = read_base64_blocks(&st, (const u8 *)src, src_size);
+	else
+		res = read_hex_blocks(&st, (const u8 *)src, src_size);
+
+	if (res != PSBT_OK)
+		return psbt_set_error(res, st.offset, st.state);
+
+	return psbt_stream_end(&st);
+}
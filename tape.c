@@ -0,0 +1,250 @@
+
+#include <limits.h>
+#include <string.h>
+
+#include "psbt.h"
+#include "parser.h"
+#include "compactsize.h"
+#include "common.h"
+
+struct tape_scanner {
+	const u8 *data;
+	u32 size;
+	u32 pos;
+};
+
+static enum psbt_result
+tape_fail(struct tape_scanner *s, enum psbt_result res, char *msg,
+	  enum psbt_state state)
+{
+	psbt_errmsg = msg;
+	return psbt_set_error(res, s->pos, state);
+}
+
+/* a compactsize at s->pos, 1-byte lengths without a call */
+static int tape_size(struct tape_scanner *s, u64 *size) {
+	enum psbt_result res = PSBT_OK;
+	u32 len;
+	u8 b;
+
+	if (s->pos >= s->size)
+		return 0;
+
+	b = s->data[s->pos];
+	if (b < 253) {
+		*size = b;
+		s->pos++;
+		return 1;
+	}
+
+	len = compactsize_peek_length(b);
+	if (len > s->size - s->pos)
+		return 0;
+
+	*size = compactsize_read((u8 *)s->data + s->pos, &res);
+	if (res != PSBT_OK)
+		return 0;
+
+	s->pos += len;
+	return 1;
+}
+
+/* skips n bytes at s->pos */
+static int tape_skip(struct tape_scanner *s, u64 n) {
+	if (n > s->size - s->pos)
+		return 0;
+	s->pos += n;
+	return 1;
+}
+
+/*
+ * Input and output counts of the unsigned tx, stepping over the inputs by
+ * their lengths. The tx is checked properly when it is replayed.
+ */
+static int tape_count_tx(const u8 *tx, u32 tx_size, u32 *num_inputs,
+			 u32 *num_outputs)
+{
+	struct tape_scanner s = { .data = tx, .size = tx_size, .pos = 4 };
+	u64 inputs, outputs, script_len, i;
+
+	if (tx_size < 4 || !tape_size(&s, &inputs) || inputs > tx_size)
+		return 0;
+
+	for (i = 0; i < inputs; i++) {
+		if (!tape_skip(&s, 36) || !tape_size(&s, &script_len) ||
+		    !tape_skip(&s, script_len) || !tape_skip(&s, 4))
+			return 0;
+	}
+
+	if (!tape_size(&s, &outputs) || outputs > tx_size)
+		return 0;
+
+	*num_inputs = inputs;
+	*num_outputs = outputs;
+	return 1;
+}
+
+void
+psbt_tape_init(struct psbt_tape *tape, struct psbt_tape_rec *recs,
+	       size_t capacity)
+{
+	tape->data = NULL;
+	tape->data_size = 0;
+	tape->size = 0;
+	tape->recs = recs;
+	tape->capacity = capacity;
+	tape->num_recs = 0;
+	tape->num_inputs = 0;
+	tape->num_outputs = 0;
+}
+
+enum psbt_result
+psbt_tape_scan(struct psbt_tape *tape, const unsigned char *src,
+	       size_t src_size)
+{
+	static const enum psbt_state states[] = {
+		PSBT_ST_GLOBAL, PSBT_ST_INPUTS, PSBT_ST_OUTPUTS
+	};
+	struct tape_scanner s = { .data = src, .pos = 0 };
+	struct psbt_tape_rec *trec;
+	enum psbt_scope scope = PSBT_SCOPE_GLOBAL;
+	u32 index = 0, maps_left = 0;
+	int have_tx = 0;
+	u64 key_size, val_size;
+
+	tape->data = src;
+	tape->data_size = src_size;
+	tape->num_recs = 0;
+	tape->num_inputs = 0;
+	tape->num_outputs = 0;
+
+	if (src_size > UINT_MAX)
+		return tape_fail(&s, PSBT_READ_ERROR, "psbt_tape_scan: psbt "
+				 "is too large", PSBT_ST_INIT);
+	s.size = src_size;
+
+	if (src_size < sizeof(PSBT_MAGIC) + 1 ||
+	    memcmp(src, PSBT_MAGIC, sizeof(PSBT_MAGIC)) != 0 ||
+	    src[sizeof(PSBT_MAGIC)] != 0xff)
+		return tape_fail(&s, PSBT_READ_ERROR, "psbt_tape_scan: invalid "
+				 "magic header", PSBT_ST_INIT);
+	s.pos = sizeof(PSBT_MAGIC) + 1;
+
+	for (;;) {
+		if (s.pos >= s.size)
+			return tape_fail(&s, PSBT_READ_ERROR, "psbt_tape_scan: "
+					 "psbt ends inside a map",
+					 states[scope]);
+
+		// map terminator, moves on to the next map
+		if (src[s.pos] == 0) {
+			s.pos++;
+
+			if (scope == PSBT_SCOPE_GLOBAL) {
+				maps_left = tape->num_inputs + tape->num_outputs;
+				scope = tape->num_inputs
+					? PSBT_SCOPE_INPUTS
+					: PSBT_SCOPE_OUTPUTS;
+			} else if (++index == tape->num_inputs &&
+				   scope == PSBT_SCOPE_INPUTS) {
+				scope = PSBT_SCOPE_OUTPUTS;
+				index = 0;
+			}
+
+			if (maps_left-- == 0)
+				break;
+			continue;
+		}
+
+		if (tape->num_recs == tape->capacity)
+			return tape_fail(&s, PSBT_OOB_WRITE, "psbt_tape_scan: "
+					 "tape is too small", states[scope]);
+
+		trec = &tape->recs[tape->num_recs];
+
+		// key size includes the type byte, which makes it at least 1
+		if (!tape_size(&s, &key_size) || key_size == 0 ||
+		    key_size > s.size - s.pos)
+			return tape_fail(&s, PSBT_READ_ERROR, "psbt_tape_scan: "
+					 "invalid record key", states[scope]);
+
+		trec->type = src[s.pos];
+		trec->key_offset = s.pos + 1;
+		trec->key_size = key_size - 1;
+		s.pos += key_size;
+
+		if (!tape_size(&s, &val_size) || val_size > s.size - s.pos)
+			return tape_fail(&s, PSBT_READ_ERROR, "psbt_tape_scan: "
+					 "invalid record value", states[scope]);
+
+		trec->val_offset = s.pos;
+		trec->val_size = val_size;
+		trec->scope = scope;
+		trec->index = index;
+		s.pos += val_size;
+
+		tape->num_recs++;
+
+		if (scope != PSBT_SCOPE_GLOBAL ||
+		    trec->type != PSBT_GLOBAL_UNSIGNED_TX)
+			continue;
+
+		if (have_tx++)
+			return tape_fail(&s, PSBT_READ_ERROR, "psbt_tape_scan: "
+					 "more than one unsigned tx",
+					 states[scope]);
+
+		if (!tape_count_tx(src + trec->val_offset, trec->val_size,
+				   &tape->num_inputs, &tape->num_outputs))
+			return tape_fail(&s, PSBT_READ_ERROR, "psbt_tape_scan: "
+					 "invalid unsigned tx", states[scope]);
+	}
+
+	if (s.pos != s.size)
+		return tape_fail(&s, PSBT_READ_ERROR, "psbt_tape_scan: "
+				 "data after end of psbt", PSBT_ST_FINALIZED);
+
+	tape->size = s.pos;
+
+	return PSBT_OK;
+}
+
+enum psbt_result
+psbt_tape_replay(const struct psbt_tape *tape, psbt_elem_handler *handler,
+		 void *user_data)
+{
+	const struct psbt_tape_rec *trec;
+	struct psbt_record rec;
+	enum psbt_result res;
+	size_t i;
+
+	struct psbt_tx_counter counter = {
+		.inputs = 0,
+		.outputs = 0,
+		.user_data = user_data,
+		.handler = handler,
+	};
+
+	for (i = 0; i < tape->num_recs; i++) {
+		trec = &tape->recs[i];
+		psbt_tape_record(tape, trec, &rec);
+
+		res = psbt_emit_record(&counter, &rec, trec->index);
+		if (res != PSBT_OK)
+			return res;
+	}
+
+	return PSBT_OK;
+}
+
+void
+psbt_tape_record(const struct psbt_tape *tape,
+		 const struct psbt_tape_rec *trec, struct psbt_record *rec)
+{
+	rec->type = trec->type;
+	rec->key = (unsigned char *)tape->data + trec->key_offset;
+	rec->key_size = trec->key_size;
+	rec->val = (unsigned char *)tape->data + trec->val_offset;
+	rec->val_size = trec->val_size;
+	rec->scope = trec->scope;
+}
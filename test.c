@@ -1,7 +1,13 @@
 
+#define _DEFAULT_SOURCE
+
 #include "psbt.h"
+#include "compactsize.h"
+#include "sha256.h"
+#include "cpu.h"
 #include <stdio.h>
 #include <assert.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -150,6 +156,9 @@ void encode_decode_test() {
 
 	assert(psbt_len == hexlen + 1);
 	assert(memcmp(psbt_hex, buf, hexlen) == 0);
+
+	res = psbt_encode(&psbt, PSBT_ENCODING_BASE62, buf, 2048, &psbt_len);
+	assert(res == PSBT_NOT_IMPLEMENTED);
 }
 
 void empty_input_test() {
@@ -167,12 +176,2213 @@ void empty_input_test() {
 	CHECKRES(res);
 }
 
+void hex_codec_test() {
+	static unsigned char raw[301];
+	static unsigned char decoded[301];
+	static unsigned char hex[sizeof(raw) * 2 + 1];
+	const size_t bad_pos[] = { 0, 1, 31, 63, 64, 127, 300, 601 };
+	size_t out_len, i;
+	enum psbt_result res;
+
+	for (i = 0; i < sizeof(raw); i++)
+		raw[i] = (unsigned char)(i * 7 + 3);
+
+	res = psbt_encode_raw(raw, sizeof(raw), PSBT_ENCODING_HEX, hex,
+			      sizeof(hex), &out_len);
+	CHECKRES(res);
+	assert(out_len == sizeof(hex));
+	assert(hex[sizeof(hex) - 1] == '\0');
+
+	for (i = 0; i < sizeof(raw); i++) {
+		char expected[3];
+		snprintf(expected, sizeof(expected), "%02x", raw[i]);
+		assert(memcmp(&hex[i * 2], expected, 2) == 0);
+	}
+
+	res = psbt_decode((char*)hex, sizeof(hex) - 1, decoded, sizeof(decoded),
+			  &out_len);
+	CHECKRES(res);
+	assert(out_len == sizeof(raw));
+	assert(memcmp(raw, decoded, sizeof(raw)) == 0);
+
+	// uppercase digits decode the same
+	for (i = 0; i < sizeof(hex) - 1; i++)
+		if (hex[i] >= 'a')
+			hex[i] -= 'a' - 'A';
+
+	memset(decoded, 0, sizeof(decoded));
+	res = psbt_decode((char*)hex, sizeof(hex) - 1, decoded, sizeof(decoded),
+			  &out_len);
+	CHECKRES(res);
+	assert(memcmp(raw, decoded, sizeof(raw)) == 0);
+
+	res = psbt_decode((char*)hex, sizeof(hex) - 2, decoded, sizeof(decoded),
+			  &out_len);
+	assert(res == PSBT_READ_ERROR);
+
+	for (i = 0; i < ARRAY_SIZE(bad_pos); i++) {
+		unsigned char c = hex[bad_pos[i]];
+		hex[bad_pos[i]] = 'g';
+		res = psbt_decode((char*)hex, sizeof(hex) - 1, decoded,
+				  sizeof(decoded), &out_len);
+		assert(res == PSBT_READ_ERROR);
+		hex[bad_pos[i]] = c;
+	}
+}
+
+void base64_decode_test() {
+	static unsigned char raw[2048], decoded[2048];
+	static unsigned char b64[4096], wrapped[4096];
+	size_t raw_len, b64_len, out_len, i, w = 0;
+	enum psbt_result res;
+
+	res = psbt_decode(psbt_hex, strlen(psbt_hex), raw, sizeof(raw), &raw_len);
+	CHECKRES(res);
+
+	res = psbt_encode_raw(raw, raw_len, PSBT_ENCODING_BASE64, b64,
+			      sizeof(b64), &b64_len);
+	CHECKRES(res);
+
+	// line-wrapped base64 decodes to the same bytes
+	for (i = 0; i < b64_len; i++) {
+		if (i && i % 64 == 0)
+			wrapped[w++] = '\n';
+		wrapped[w++] = b64[i];
+	}
+
+	res = psbt_decode((char*)wrapped, w, decoded, sizeof(decoded), &out_len);
+	CHECKRES(res);
+	assert(out_len == raw_len);
+	assert(memcmp(raw, decoded, raw_len) == 0);
+
+	// output buffer too small
+	res = psbt_decode((char*)wrapped, w, decoded, raw_len - 1, &out_len);
+	assert(res == PSBT_READ_ERROR);
+
+	// junk in the middle of the data
+	wrapped[100] = '*';
+	res = psbt_decode((char*)wrapped, w, decoded, sizeof(decoded), &out_len);
+	assert(res == PSBT_READ_ERROR);
+
+	// data after padding, missing padding
+	res = psbt_decode("cHNidA==cHNi", 12, decoded, sizeof(decoded), &out_len);
+	assert(res == PSBT_READ_ERROR);
+	res = psbt_decode("cHNidA", 6, decoded, sizeof(decoded), &out_len);
+	assert(res == PSBT_READ_ERROR);
+}
+
+void base64_encode_test() {
+	unsigned char raw[sizeof(empty_inputs)];
+	unsigned char b64[sizeof(empty_inputs)];
+	size_t raw_len, out_len;
+	enum psbt_result res;
+
+	res = psbt_decode(empty_inputs, sizeof(empty_inputs), raw, sizeof(raw),
+			  &raw_len);
+	CHECKRES(res);
+
+	// exactly the encoded length plus the nul terminator
+	res = psbt_encode_raw(raw, raw_len, PSBT_ENCODING_BASE64, b64,
+			      sizeof(b64), &out_len);
+	CHECKRES(res);
+	assert(out_len == sizeof(empty_inputs) - 1);
+	assert(memcmp(b64, empty_inputs, sizeof(empty_inputs)) == 0);
+
+	res = psbt_encode_raw(raw, raw_len, PSBT_ENCODING_BASE64, b64,
+			      sizeof(b64) - 1, &out_len);
+	assert(res == PSBT_WRITE_ERROR);
+}
+
+struct view_check {
+	const unsigned char *start, *end;
+	int records;
+};
+
+void read_view_checker(struct psbt_elem *elem) {
+	struct view_check *check = (struct view_check*)elem->user_data;
+	struct psbt_record *rec;
+
+	if (elem->type != PSBT_ELEM_RECORD)
+		return;
+
+	rec = elem->elem.rec;
+	assert(rec->key >= check->start && rec->key <= check->end);
+	assert(rec->val >= check->start && rec->val + rec->val_size <= check->end);
+	check->records++;
+}
+
+void read_view_test() {
+	static unsigned char buf[2048], copy[2048];
+	const unsigned char *view = buf;
+	size_t psbt_len;
+	struct psbt psbt;
+	struct view_check check;
+	enum psbt_result res;
+
+	res = psbt_decode(psbt_hex, strlen(psbt_hex), buf, sizeof(buf), &psbt_len);
+	CHECKRES(res);
+
+	check.start = view;
+	check.end = view + psbt_len;
+	check.records = 0;
+
+	res = psbt_read_view(view, psbt_len, &psbt, read_view_checker, &check);
+	CHECKRES(res);
+	assert(check.records > 0);
+	assert(psbt.state == PSBT_ST_FINALIZED);
+	assert(psbt_size(&psbt) == psbt_len);
+
+	// truncated input stops at the end of the view
+	res = psbt_read_view(view, psbt_len - 1, &psbt, NULL, NULL);
+	assert(res != PSBT_OK);
+
+	// so does anything after the psbt, like in psbt_stream_feed
+	buf[psbt_len] = 0;
+	res = psbt_read_view(view, psbt_len + 1, &psbt, NULL, NULL);
+	assert(res == PSBT_READ_ERROR);
+	assert(psbt_last_error()->offset == psbt_len);
+
+	psbt_init(&psbt, copy, sizeof(copy));
+	res = psbt_read(buf, psbt_len + 1, &psbt, NULL, NULL);
+	assert(res == PSBT_READ_ERROR);
+}
+
+void index_test() {
+	static unsigned char buf[2048];
+	static const unsigned char pubkey[] = {0x02, 0x95, 0x83, 0xbf, 0x39, 0xae, 0x0a, 0x60, 0x97, 0x47, 0xad, 0x19, 0x9a, 0xdd, 0xd6, 0x34, 0xfa, 0x61, 0x08, 0x55, 0x9d, 0x6c, 0x5c, 0xd3, 0x9b, 0x4c, 0x21, 0x83, 0xf1, 0xab, 0x96, 0xe0, 0x7f};
+	struct psbt_index_map maps[8];
+	struct psbt_index_rec recs[16];
+	const struct psbt_index_map *map;
+	const struct psbt_index_rec *irec;
+	struct psbt_record rec;
+	struct psbt_index idx;
+	size_t psbt_len;
+	enum psbt_result res;
+
+	res = psbt_decode(psbt_hex, strlen(psbt_hex), buf, sizeof(buf), &psbt_len);
+	CHECKRES(res);
+
+	psbt_index_init(&idx, maps, ARRAY_SIZE(maps), recs, ARRAY_SIZE(recs));
+	res = psbt_index_build(&idx, buf, psbt_len);
+	CHECKRES(res);
+
+	assert(idx.num_inputs == 2);
+	assert(idx.num_outputs == 2);
+
+	map = psbt_index_global(&idx);
+	assert(map->offset == 5 && map->num_recs == 1);
+	assert(psbt_index_input(&idx, 2) == NULL);
+
+	// the last output map ends right before the final terminator
+	map = psbt_index_output(&idx, 1);
+	assert(map->num_recs == 1);
+	irec = &idx.recs[map->first_rec];
+	assert(irec->val_offset + irec->val_size + 1 == psbt_len);
+
+	irec = psbt_index_find(&idx, PSBT_SCOPE_INPUTS, 0,
+			       PSBT_IN_NON_WITNESS_UTXO, NULL, 0);
+	assert(irec != NULL && irec->val_size == 0xbb);
+
+	irec = psbt_index_find(&idx, PSBT_SCOPE_INPUTS, 0,
+			       PSBT_IN_BIP32_DERIVATION, pubkey, sizeof(pubkey));
+	assert(irec != NULL);
+	psbt_index_record(&idx, irec, PSBT_SCOPE_INPUTS, &rec);
+	assert(rec.val_size == 16);
+	assert(memcmp(rec.key, pubkey, sizeof(pubkey)) == 0);
+
+	assert(psbt_index_find(&idx, PSBT_SCOPE_INPUTS, 1,
+			       PSBT_IN_NON_WITNESS_UTXO, NULL, 0) == NULL);
+
+	// record array too small
+	psbt_index_init(&idx, maps, ARRAY_SIZE(maps), recs, 3);
+	res = psbt_index_build(&idx, buf, psbt_len);
+	assert(res == PSBT_OOB_WRITE);
+
+	// capacities aren't cut to 32 bits, this one used to wrap around to 3.
+	// Only as many records as the psbt has are written.
+	if (sizeof(size_t) > sizeof(unsigned int)) {
+		psbt_index_init(&idx, maps, ARRAY_SIZE(maps), recs,
+				(size_t)UINT_MAX + 4);
+		res = psbt_index_build(&idx, buf, psbt_len);
+		CHECKRES(res);
+	}
+}
+
+struct stream_check {
+	int records;
+	int txelems;
+	unsigned char last_type;
+};
+
+void stream_checker(struct psbt_elem *elem) {
+	struct stream_check *check = (struct stream_check*)elem->user_data;
+
+	if (elem->type == PSBT_ELEM_TXELEM) {
+		check->txelems++;
+		return;
+	}
+
+	check->records++;
+	check->last_type = elem->elem.rec->type;
+}
+
+void stream_test() {
+	static unsigned char buf[2048];
+	unsigned char recbuf[256];
+	size_t psbt_len, chunk, i, n;
+	struct stream_check check, expected = { 0, 0, 0 };
+	struct psbt_stream stream;
+	struct psbt psbt;
+	enum psbt_result res;
+
+	res = psbt_decode(psbt_hex, strlen(psbt_hex), buf, sizeof(buf), &psbt_len);
+	CHECKRES(res);
+
+	res = psbt_read_view(buf, psbt_len, &psbt, stream_checker, &expected);
+	CHECKRES(res);
+
+	// every chunk size gives the same events as psbt_read
+	for (chunk = 1; chunk <= psbt_len; chunk++) {
+		memset(&check, 0, sizeof(check));
+		psbt_stream_init(&stream, recbuf, sizeof(recbuf), stream_checker,
+				 &check);
+
+		for (i = 0; i < psbt_len; i += n) {
+			n = psbt_len - i < chunk ? psbt_len - i : chunk;
+			res = psbt_stream_feed(&stream, buf + i, n);
+			CHECKRES(res);
+		}
+
+		res = psbt_stream_end(&stream);
+		CHECKRES(res);
+		assert(stream.offset == psbt_len);
+		assert(check.records == expected.records);
+		assert(check.txelems == expected.txelems);
+		assert(check.last_type == expected.last_type);
+	}
+
+	// incomplete psbt
+	psbt_stream_init(&stream, recbuf, sizeof(recbuf), NULL, NULL);
+	res = psbt_stream_feed(&stream, buf, psbt_len - 1);
+	CHECKRES(res);
+	assert(psbt_stream_end(&stream) != PSBT_OK);
+
+	// the non-witness utxo record doesn't fit a tiny buffer when split
+	psbt_stream_init(&stream, recbuf, 64, NULL, NULL);
+	for (i = 0, res = PSBT_OK; i < psbt_len && res == PSBT_OK; i += 16)
+		res = psbt_stream_feed(&stream, buf + i,
+				       psbt_len - i < 16 ? psbt_len - i : 16);
+	assert(res == PSBT_OOB_WRITE);
+}
+
+static enum psbt_result full_sink(void *sink_data, const unsigned char *data,
+				   size_t size)
+{
+	return PSBT_WRITE_ERROR;
+}
+
+void last_error_test() {
+	static unsigned char buf[2048];
+	const struct psbt_error *err;
+	size_t psbt_len, out_len;
+	struct psbt psbt;
+	enum psbt_result res;
+
+	res = psbt_decode(psbt_hex, strlen(psbt_hex), buf, sizeof(buf), &psbt_len);
+	CHECKRES(res);
+
+	// corrupt the magic
+	buf[0] = 'x';
+	res = psbt_read_view(buf, psbt_len, &psbt, NULL, NULL);
+	assert(res == PSBT_READ_ERROR);
+
+	err = psbt_last_error();
+	assert(err->result == PSBT_READ_ERROR);
+	assert(err->state == PSBT_ST_INIT);
+	assert(err->offset == 0);
+	assert(strcmp(err->msg, psbt_geterr()) == 0);
+	buf[0] = 'p';
+
+	// stops in the last output map
+	res = psbt_read_view(buf, psbt_len - 1, &psbt, NULL, NULL);
+	assert(res != PSBT_OK);
+
+	err = psbt_last_error();
+	assert(err->result == res);
+	assert(err->state == PSBT_ST_OUTPUTS);
+	assert(err->offset == psbt_len - 1);
+
+	// a failure outside the parsers replaces the whole record
+	res = psbt_encode_raw(buf, psbt_len, PSBT_ENCODING_HEX,
+			      buf + psbt_len, 4, &out_len);
+	assert(res == PSBT_OOB_WRITE);
+
+	err = psbt_last_error();
+	assert(err->result == PSBT_OOB_WRITE);
+	assert(err->state == PSBT_ST_INIT);
+	assert(err->offset == 0);
+	assert(strcmp(err->msg, "psbt_encode: dest buffer too small") == 0);
+
+	// as does a sink that fails without a message
+	res = psbt_encode_to_sink(buf, psbt_len, PSBT_ENCODING_RAW,
+				  full_sink, NULL);
+	assert(res == PSBT_WRITE_ERROR);
+
+	err = psbt_last_error();
+	assert(err->result == PSBT_WRITE_ERROR);
+	assert(strcmp(err->msg, "psbt_encode_to_sink: sink failed") == 0);
+}
+
+void batch_test() {
+	static unsigned char raw[2048];
+	static unsigned char bufs[32][1024];
+	static struct psbt_batch_item items[32];
+	size_t raw_len, i;
+	enum psbt_result res;
+	unsigned int threads;
+
+	res = psbt_decode(psbt_hex, strlen(psbt_hex), raw, sizeof(raw), &raw_len);
+	CHECKRES(res);
+
+	for (threads = 1; threads <= 4; threads++) {
+		memset(items, 0, sizeof(items));
+		for (i = 0; i < ARRAY_SIZE(items); i++) {
+			items[i].buf = bufs[i];
+			items[i].buf_size = sizeof(bufs[i]);
+			switch (i % 3) {
+			case 0:
+				items[i].src = (const unsigned char *)psbt_hex;
+				items[i].src_size = strlen(psbt_hex);
+				items[i].encoded = 1;
+				break;
+			case 1:
+				items[i].src = (const unsigned char *)empty_inputs;
+				items[i].src_size = strlen(empty_inputs);
+				items[i].encoded = 1;
+				break;
+			case 2:
+				items[i].src = raw;
+				items[i].src_size = raw_len;
+				break;
+			}
+		}
+
+		// truncated raw psbt
+		items[5].src_size = raw_len - 1;
+
+		res = psbt_read_batch(items, ARRAY_SIZE(items), NULL, threads);
+		assert(res == items[5].result);
+		assert(res != PSBT_OK);
+		assert(items[5].error.result == res);
+		assert(items[5].error.msg != NULL);
+
+		for (i = 0; i < ARRAY_SIZE(items); i++) {
+			if (i == 5)
+				continue;
+			assert(items[i].result == PSBT_OK);
+			assert(items[i].psbt.state == PSBT_ST_FINALIZED);
+		}
+	}
+
+	assert(psbt_batch_threads() >= 1);
+}
+
+/* a psbt with an input record larger than the codec block sizes */
+static enum psbt_result write_big_psbt(struct psbt *psbt) {
+	static unsigned char big[6000];
+	struct psbt_record rec;
+	enum psbt_result res;
+
+	rec.type     = PSBT_GLOBAL_UNSIGNED_TX;
+	rec.key      = NULL;
+	rec.key_size = 0;
+	rec.val      = (unsigned char*)transaction;
+	rec.val_size = ARRAY_SIZE(transaction);
+	res = psbt_write_global_record(psbt, &rec);
+	if (res != PSBT_OK)
+		return res;
+
+	res = psbt_new_input_record_set(psbt);
+	if (res != PSBT_OK)
+		return res;
+
+	memset(big, 0x5a, sizeof(big));
+	rec.type     = PSBT_IN_NON_WITNESS_UTXO;
+	rec.val      = big;
+	rec.val_size = sizeof(big);
+	res = psbt_write_input_record(psbt, &rec);
+	if (res != PSBT_OK)
+		return res;
+
+	res = psbt_new_input_record_set(psbt);
+	if (res != PSBT_OK)
+		return res;
+
+	rec.type     = PSBT_IN_REDEEM_SCRIPT;
+	rec.val      = (unsigned char*)redeem_script_a;
+	rec.val_size = ARRAY_SIZE(redeem_script_a);
+	res = psbt_write_input_record(psbt, &rec);
+	if (res != PSBT_OK)
+		return res;
+
+	res = psbt_new_output_record_set(psbt);
+	if (res != PSBT_OK)
+		return res;
+
+	return psbt_finalize(psbt);
+}
+
+static size_t big_psbt(unsigned char *raw, size_t raw_size) {
+	struct psbt psbt;
+	enum psbt_result res;
+
+	psbt_init(&psbt, raw, raw_size);
+	res = write_big_psbt(&psbt);
+	CHECKRES(res);
+
+	return psbt_size(&psbt);
+}
+
+void read_encoded_test() {
+	static unsigned char raw[8192], encoded[16384];
+	unsigned char recbuf[6016];
+	struct stream_check check, expected = { 0, 0, 0 };
+	enum psbt_encoding encodings[] = {
+		PSBT_ENCODING_HEX, PSBT_ENCODING_BASE64
+	};
+	struct psbt psbt;
+	enum psbt_result res;
+	size_t raw_len, out_len, i;
+
+	raw_len = big_psbt(raw, sizeof(raw));
+	assert(raw_len > 4096);
+
+	res = psbt_read_view(raw, raw_len, &psbt, stream_checker, &expected);
+	CHECKRES(res);
+
+	for (i = 0; i < ARRAY_SIZE(encodings); i++) {
+		res = psbt_encode_raw(raw, raw_len, encodings[i], encoded,
+				      sizeof(encoded), &out_len);
+		CHECKRES(res);
+
+		memset(&check, 0, sizeof(check));
+		res = psbt_read_encoded((const char *)encoded, out_len, recbuf,
+					sizeof(recbuf), stream_checker, &check);
+		CHECKRES(res);
+		assert(check.records == expected.records);
+		assert(check.txelems == expected.txelems);
+		assert(check.last_type == expected.last_type);
+
+		// the big record can't be reassembled in a small buffer
+		res = psbt_read_encoded((const char *)encoded, out_len, recbuf,
+					256, NULL, NULL);
+		assert(res == PSBT_OOB_WRITE);
+
+		res = psbt_read_encoded((const char *)encoded, out_len - 4,
+					recbuf, sizeof(recbuf), NULL, NULL);
+		assert(res != PSBT_OK);
+	}
+
+	res = psbt_read_encoded(empty_inputs, strlen(empty_inputs), recbuf,
+				sizeof(recbuf), NULL, NULL);
+	CHECKRES(res);
+
+	res = psbt_read_encoded("cHNidP8$", 8, recbuf, sizeof(recbuf), NULL,
+				NULL);
+	assert(res == PSBT_READ_ERROR);
+}
+
+void compactsize_test() {
+	static const struct {
+		u64 size;
+		unsigned char bytes[9];
+		u32 len;
+	} cases[] = {
+		{ 252, { 0xfc }, 1 },
+		{ 253, { 0xfd, 0xfd, 0x00 }, 3 },
+		{ 0xffff, { 0xfd, 0xff, 0xff }, 3 },
+		{ 0x10000, { 0xfe, 0x00, 0x00, 0x01, 0x00 }, 5 },
+		{ 0x100000000ULL, { 0xff, 0, 0, 0, 0, 1, 0, 0, 0 }, 9 },
+	};
+	enum psbt_result res;
+	unsigned char buf[9];
+	size_t i;
+
+	for (i = 0; i < ARRAY_SIZE(cases); i++) {
+		memset(buf, 0xaa, sizeof(buf));
+		compactsize_write(buf, cases[i].size);
+		assert(compactsize_length(cases[i].size) == cases[i].len);
+		assert(compactsize_peek_length(buf[0]) == cases[i].len);
+		assert(memcmp(buf, cases[i].bytes, cases[i].len) == 0);
+
+		// larger than MAX_SERIALIZE_SIZE, which the reader rejects
+		if (cases[i].size > MAX_SERIALIZE_SIZE)
+			continue;
+
+		res = PSBT_OK;
+		assert(compactsize_read(buf, &res) == cases[i].size);
+		assert(res == PSBT_OK);
+	}
+}
+
+struct sink_check {
+	unsigned char *buf;
+	size_t len;
+	size_t calls;
+};
+
+static enum psbt_result check_sink(void *sink_data, const unsigned char *data,
+				   size_t size)
+{
+	struct sink_check *check = (struct sink_check *)sink_data;
+
+	memcpy(check->buf + check->len, data, size);
+	check->len += size;
+	check->calls++;
+	return PSBT_OK;
+}
+
+void sink_test() {
+	static unsigned char raw[8192], expected[16384], got[16384];
+	enum psbt_encoding encodings[] = {
+		PSBT_ENCODING_HEX, PSBT_ENCODING_BASE64
+	};
+	struct sink_check check;
+	enum psbt_result res;
+	size_t raw_len, out_len, i;
+	FILE *file;
+
+	raw_len = big_psbt(raw, sizeof(raw));
+
+	for (i = 0; i < ARRAY_SIZE(encodings); i++) {
+		res = psbt_encode_raw(raw, raw_len, encodings[i], expected,
+				      sizeof(expected), &out_len);
+		CHECKRES(res);
+		// hex counts the nul terminator
+		if (encodings[i] == PSBT_ENCODING_HEX)
+			out_len--;
+
+		check.buf = got;
+		check.len = 0;
+		check.calls = 0;
+		res = psbt_encode_to_sink(raw, raw_len, encodings[i],
+					  check_sink, &check);
+		CHECKRES(res);
+		assert(check.len == out_len);
+		assert(check.calls == (out_len + 4095) / 4096);
+		assert(memcmp(got, expected, out_len) == 0);
+
+		file = tmpfile();
+		assert(file != NULL);
+		res = psbt_encode_to_file(raw, raw_len, encodings[i], file);
+		CHECKRES(res);
+		rewind(file);
+		assert(fread(got, 1, sizeof(got), file) == out_len);
+		assert(memcmp(got, expected, out_len) == 0);
+		fclose(file);
+
+		file = tmpfile();
+		assert(file != NULL);
+		res = psbt_encode_to_fd(raw, raw_len, encodings[i],
+					fileno(file));
+		CHECKRES(res);
+		rewind(file);
+		assert(fread(got, 1, sizeof(got), file) == out_len);
+		assert(memcmp(got, expected, out_len) == 0);
+		fclose(file);
+	}
+
+	check.len = 0;
+	check.calls = 0;
+	res = psbt_encode_to_sink(raw, raw_len, PSBT_ENCODING_RAW, check_sink,
+				  &check);
+	assert(res == PSBT_OK && check.len == raw_len);
+	assert(memcmp(got, raw, raw_len) == 0);
+
+	res = psbt_encode_raw(raw, raw_len, PSBT_ENCODING_RAW, got, raw_len - 1,
+			      &out_len);
+	assert(res == PSBT_OOB_WRITE);
+	assert(strcmp(psbt_geterr(), "psbt_encode: dest buffer too small") == 0);
+}
+
+void measure_test() {
+	static unsigned char raw[8192], encoded[16384];
+	enum psbt_encoding encodings[] = {
+		PSBT_ENCODING_RAW, PSBT_ENCODING_HEX, PSBT_ENCODING_BASE64
+	};
+	struct psbt psbt;
+	enum psbt_result res;
+	size_t size, raw_len, out_len, i;
+
+	res = psbt_measure_init(&psbt);
+	CHECKRES(res);
+	res = write_big_psbt(&psbt);
+	CHECKRES(res);
+	size = psbt_size(&psbt);
+	assert(psbt_encode(&psbt, PSBT_ENCODING_HEX, encoded, sizeof(encoded),
+			   &out_len) != PSBT_OK);
+
+	raw_len = big_psbt(raw, sizeof(raw));
+	assert(size == raw_len);
+
+	// the measured size is exactly enough
+	psbt_init(&psbt, raw, size);
+	res = write_big_psbt(&psbt);
+	CHECKRES(res);
+
+	psbt_init(&psbt, raw, size - 1);
+	res = write_big_psbt(&psbt);
+	assert(res == PSBT_OOB_WRITE);
+
+	for (i = 0; i < ARRAY_SIZE(encodings); i++) {
+		size = psbt_encoded_size(raw_len, encodings[i]);
+		res = psbt_encode_raw(raw, raw_len, encodings[i], encoded, size,
+				      &out_len);
+		CHECKRES(res);
+		res = psbt_encode_raw(raw, raw_len, encodings[i], encoded,
+				      size - 1, &out_len);
+		assert(res != PSBT_OK);
+	}
+}
+
+static void *test_realloc(void *alloc_data, void *ptr, size_t old_size,
+			  size_t new_size)
+{
+	int *calls = (int *)alloc_data;
+
+	(*calls)++;
+	if (new_size == 0) {
+		free(ptr);
+		return NULL;
+	}
+	return realloc(ptr, new_size);
+}
+
+void growable_test() {
+	static unsigned char raw[8192], arena_buf[32768];
+	struct psbt_arena arena;
+	struct psbt psbt, other;
+	enum psbt_result res;
+	size_t raw_len;
+	int calls = 0;
+
+	raw_len = big_psbt(raw, sizeof(raw));
+
+	// libc realloc, buffer doubles from 256 bytes
+	psbt_init_alloc(&psbt, test_realloc, &calls);
+	res = write_big_psbt(&psbt);
+	CHECKRES(res);
+	assert(psbt_size(&psbt) == raw_len);
+	assert(memcmp(psbt.data, raw, raw_len) == 0);
+	assert(calls > 1 && calls < 10);
+	psbt_free(&psbt);
+
+	// the newest arena block grows in place
+	psbt_arena_init(&arena, arena_buf, sizeof(arena_buf));
+	psbt_init_alloc(&psbt, psbt_arena_realloc, &arena);
+	res = write_big_psbt(&psbt);
+	CHECKRES(res);
+	assert(psbt.data == arena_buf);
+	assert(memcmp(psbt.data, raw, raw_len) == 0);
+
+	// a second psbt in the same arena copies when it grows
+	psbt_init_alloc(&other, psbt_arena_realloc, &arena);
+	res = psbt_read(raw, raw_len, &other, NULL, NULL);
+	CHECKRES(res);
+	assert(other.data > psbt.data);
+	assert(memcmp(psbt.data, raw, raw_len) == 0);
+
+	// out of arena space
+	psbt_arena_reset(&arena);
+	psbt_arena_init(&arena, arena_buf, 4096);
+	psbt_init_alloc(&psbt, psbt_arena_realloc, &arena);
+	res = write_big_psbt(&psbt);
+	assert(res == PSBT_OOB_WRITE);
+}
+
+void write_map_test() {
+	static unsigned char raw[8192], out[8192], big[6000];
+	struct psbt_record global, inputs[2];
+	struct psbt psbt;
+	enum psbt_result res;
+	size_t raw_len;
+
+	raw_len = big_psbt(raw, sizeof(raw));
+
+	global.type = PSBT_GLOBAL_UNSIGNED_TX;
+	global.key = NULL;
+	global.key_size = 0;
+	global.val = (unsigned char*)transaction;
+	global.val_size = ARRAY_SIZE(transaction);
+
+	memset(big, 0x5a, sizeof(big));
+	inputs[0].type = PSBT_IN_NON_WITNESS_UTXO;
+	inputs[0].key = NULL;
+	inputs[0].key_size = 0;
+	inputs[0].val = big;
+	inputs[0].val_size = sizeof(big);
+
+	inputs[1].type = PSBT_IN_REDEEM_SCRIPT;
+	inputs[1].key = NULL;
+	inputs[1].key_size = 0;
+	inputs[1].val = (unsigned char*)redeem_script_a;
+	inputs[1].val_size = ARRAY_SIZE(redeem_script_a);
+
+	// same bytes as the record at a time writer
+	psbt_init(&psbt, out, sizeof(out));
+	res = psbt_write_map(&psbt, PSBT_SCOPE_GLOBAL, &global, 1);
+	CHECKRES(res);
+	assert(psbt.state == PSBT_ST_GLOBAL_END);
+	res = psbt_write_map(&psbt, PSBT_SCOPE_INPUTS, &inputs[0], 1);
+	CHECKRES(res);
+	res = psbt_write_map(&psbt, PSBT_SCOPE_INPUTS, &inputs[1], 1);
+	CHECKRES(res);
+	res = psbt_write_map(&psbt, PSBT_SCOPE_OUTPUTS, NULL, 0);
+	CHECKRES(res);
+	res = psbt_finalize(&psbt);
+	CHECKRES(res);
+	assert(psbt_size(&psbt) == raw_len);
+	assert(memcmp(out, raw, raw_len) == 0);
+
+	// mixed with the single record functions
+	psbt_init(&psbt, out, sizeof(out));
+	res = psbt_write_global_record(&psbt, &global);
+	CHECKRES(res);
+	res = psbt_write_map(&psbt, PSBT_SCOPE_INPUTS, &inputs[0], 1);
+	CHECKRES(res);
+	res = psbt_write_input_record(&psbt, &inputs[1]);
+	CHECKRES(res);
+	res = psbt_new_output_record_set(&psbt);
+	CHECKRES(res);
+	res = psbt_finalize(&psbt);
+	CHECKRES(res);
+	assert(psbt_size(&psbt) == raw_len);
+	assert(memcmp(out, raw, raw_len) == 0);
+
+	// maps fill the ones opened by the new record set functions
+	psbt_init(&psbt, out, sizeof(out));
+	res = psbt_write_global_record(&psbt, &global);
+	CHECKRES(res);
+	res = psbt_new_input_record_set(&psbt);
+	CHECKRES(res);
+	res = psbt_write_map(&psbt, PSBT_SCOPE_INPUTS, &inputs[0], 1);
+	CHECKRES(res);
+	res = psbt_new_input_record_set(&psbt);
+	CHECKRES(res);
+	res = psbt_write_map(&psbt, PSBT_SCOPE_INPUTS, &inputs[1], 1);
+	CHECKRES(res);
+	res = psbt_new_output_record_set(&psbt);
+	CHECKRES(res);
+	res = psbt_write_map(&psbt, PSBT_SCOPE_OUTPUTS, NULL, 0);
+	CHECKRES(res);
+	res = psbt_finalize(&psbt);
+	CHECKRES(res);
+	assert(psbt_size(&psbt) == raw_len);
+	assert(memcmp(out, raw, raw_len) == 0);
+
+	// one capacity check for the whole map
+	psbt_init(&psbt, out, raw_len - 1);
+	res = psbt_write_map(&psbt, PSBT_SCOPE_GLOBAL, &global, 1);
+	CHECKRES(res);
+	res = psbt_write_map(&psbt, PSBT_SCOPE_INPUTS, &inputs[0], 1);
+	CHECKRES(res);
+	res = psbt_write_map(&psbt, PSBT_SCOPE_INPUTS, &inputs[1], 1);
+	CHECKRES(res);
+	res = psbt_write_map(&psbt, PSBT_SCOPE_OUTPUTS, NULL, 0);
+	assert(res == PSBT_OOB_WRITE);
+
+	// out of order
+	res = psbt_write_map(&psbt, PSBT_SCOPE_GLOBAL, &global, 1);
+	assert(res == PSBT_INVALID_STATE);
+}
+
+void iov_test() {
+	static unsigned char raw[8192], gathered[8192];
+	unsigned char scratch[512];
+	struct iovec iov[16];
+	struct psbt_iovs iovs;
+	struct psbt psbt;
+	enum psbt_result res;
+	size_t raw_len, len, i;
+
+	raw_len = big_psbt(raw, sizeof(raw));
+
+	psbt_iovs_init(&iovs, iov, ARRAY_SIZE(iov), 64);
+	psbt_init_iov(&psbt, scratch, sizeof(scratch), &iovs);
+	res = write_big_psbt(&psbt);
+	CHECKRES(res);
+	assert(psbt_size(&psbt) == raw_len);
+
+	for (i = 0, len = 0; i < iovs.count; i++) {
+		memcpy(gathered + len, iov[i].iov_base, iov[i].iov_len);
+		len += iov[i].iov_len;
+	}
+	assert(len == raw_len);
+	assert(memcmp(gathered, raw, raw_len) == 0);
+
+	// the unsigned tx, the big value and the redeem script are
+	// referenced, framing runs in between
+	assert(iovs.count == 7);
+	assert((size_t)(psbt.write_pos - scratch) <
+	       raw_len - 6000 - ARRAY_SIZE(transaction));
+
+	// encoding needs contiguous data
+	res = psbt_encode(&psbt, PSBT_ENCODING_HEX, gathered, sizeof(gathered),
+			  &len);
+	assert(res == PSBT_INVALID_STATE);
+
+	// out of iovecs
+	psbt_iovs_init(&iovs, iov, 2, 64);
+	psbt_init_iov(&psbt, scratch, sizeof(scratch), &iovs);
+	res = write_big_psbt(&psbt);
+	assert(res == PSBT_OOB_WRITE);
+}
+
+/* big_psbt, with the big value produced in place */
+static enum psbt_result write_big_psbt_inplace(struct psbt *psbt,
+					       size_t size_hint)
+{
+	struct psbt_record rec;
+	enum psbt_result res;
+
+	rec.type     = PSBT_GLOBAL_UNSIGNED_TX;
+	rec.scope    = PSBT_SCOPE_GLOBAL;
+	rec.key      = NULL;
+	rec.key_size = 0;
+	res = psbt_begin_value(psbt, &rec, size_hint);
+	if (res != PSBT_OK)
+		return res;
+	res = psbt_value_reserve(psbt, ARRAY_SIZE(transaction));
+	if (res != PSBT_OK)
+		return res;
+	memcpy(psbt->write_pos, transaction, ARRAY_SIZE(transaction));
+	psbt->write_pos += ARRAY_SIZE(transaction);
+	res = psbt_end_value(psbt);
+	if (res != PSBT_OK)
+		return res;
+
+	res = psbt_new_input_record_set(psbt);
+	if (res != PSBT_OK)
+		return res;
+
+	rec.type  = PSBT_IN_NON_WITNESS_UTXO;
+	rec.scope = PSBT_SCOPE_INPUTS;
+	res = psbt_begin_value(psbt, &rec, size_hint);
+	if (res != PSBT_OK)
+		return res;
+	res = psbt_value_reserve(psbt, 6000);
+	if (res != PSBT_OK)
+		return res;
+	memset(psbt->write_pos, 0x5a, 6000);
+	psbt->write_pos += 6000;
+	res = psbt_end_value(psbt);
+	if (res != PSBT_OK)
+		return res;
+
+	res = psbt_new_input_record_set(psbt);
+	if (res != PSBT_OK)
+		return res;
+
+	rec.type     = PSBT_IN_REDEEM_SCRIPT;
+	rec.val      = (unsigned char*)redeem_script_a;
+	rec.val_size = ARRAY_SIZE(redeem_script_a);
+	res = psbt_write_input_record(psbt, &rec);
+	if (res != PSBT_OK)
+		return res;
+
+	res = psbt_new_output_record_set(psbt);
+	if (res != PSBT_OK)
+		return res;
+
+	return psbt_finalize(psbt);
+}
+
+void begin_value_test() {
+	static unsigned char raw[8192], out[8192];
+	size_t hints[] = { 0, 100, 6000, 70000, 1ull << 33 };
+	struct psbt_record rec;
+	struct psbt psbt;
+	enum psbt_result res;
+	size_t raw_len, i;
+	int calls = 0;
+
+	raw_len = big_psbt(raw, sizeof(raw));
+
+	// the length is right whatever the hint
+	for (i = 0; i < ARRAY_SIZE(hints); i++) {
+		memset(out, 0, sizeof(out));
+		psbt_init(&psbt, out, sizeof(out));
+		res = write_big_psbt_inplace(&psbt, hints[i]);
+		CHECKRES(res);
+		assert(psbt_size(&psbt) == raw_len);
+		assert(memcmp(out, raw, raw_len) == 0);
+	}
+
+	// growable buffers move while the value is written
+	psbt_init_alloc(&psbt, test_realloc, &calls);
+	res = write_big_psbt_inplace(&psbt, 0);
+	CHECKRES(res);
+	assert(psbt_size(&psbt) == raw_len);
+	assert(memcmp(psbt.data, raw, raw_len) == 0);
+	psbt_free(&psbt);
+
+	// no other writes while a value is open
+	psbt_init(&psbt, out, sizeof(out));
+	rec.type = PSBT_GLOBAL_UNSIGNED_TX;
+	rec.scope = PSBT_SCOPE_GLOBAL;
+	rec.key = NULL;
+	rec.key_size = 0;
+	res = psbt_begin_value(&psbt, &rec, 0);
+	CHECKRES(res);
+	res = psbt_new_input_record_set(&psbt);
+	assert(res == PSBT_INVALID_STATE);
+	res = psbt_end_value(&psbt);
+	CHECKRES(res);
+	assert(psbt_end_value(&psbt) == PSBT_INVALID_STATE);
+
+	// no room to grow the length in a fixed buffer
+	psbt_init(&psbt, out, raw_len - 1);
+	res = write_big_psbt_inplace(&psbt, 0);
+	assert(res == PSBT_OOB_WRITE);
+}
+
+struct tx_parts {
+	struct psbt_tx tx;
+	struct psbt_txin txins[4];
+	struct psbt_txout txouts[4];
+	unsigned int num_inputs;
+	unsigned int num_outputs;
+};
+
+static void collect_tx(struct psbt_txelem *elem) {
+	struct tx_parts *parts = (struct tx_parts *)elem->user_data;
+
+	switch (elem->elem_type) {
+	case PSBT_TXELEM_TXIN:
+		parts->txins[parts->num_inputs++] = *elem->elem.txin;
+		break;
+	case PSBT_TXELEM_TXOUT:
+		parts->txouts[parts->num_outputs++] = *elem->elem.txout;
+		break;
+	case PSBT_TXELEM_TX:
+		parts->tx = *elem->elem.tx;
+		break;
+	default:
+		break;
+	}
+}
+
+static enum psbt_result write_tx(struct psbt *psbt, struct tx_parts *parts,
+				 size_t size)
+{
+	struct psbt_tx_writer w;
+	enum psbt_result res;
+	unsigned int i;
+
+	res = psbt_tx_begin(&w, psbt, &parts->tx, parts->num_inputs,
+			    parts->num_outputs, size);
+	if (res != PSBT_OK)
+		return res;
+
+	for (i = 0; i < parts->num_inputs; i++) {
+		res = psbt_tx_add_input(&w, &parts->txins[i]);
+		if (res != PSBT_OK)
+			return res;
+	}
+
+	for (i = 0; i < parts->num_outputs; i++) {
+		res = psbt_tx_add_output(&w, &parts->txouts[i]);
+		if (res != PSBT_OK)
+			return res;
+	}
+
+	return psbt_tx_end(&w);
+}
+
+void tx_writer_test() {
+	static unsigned char raw[512], out[512];
+	struct tx_parts parts;
+	struct psbt_tx_writer w;
+	struct psbt_record rec;
+	struct psbt psbt;
+	enum psbt_result res;
+	size_t raw_len, ins = 0, outs = 0, size;
+	unsigned int i;
+	int calls = 0;
+
+	memset(&parts, 0, sizeof(parts));
+	res = psbt_btc_tx_parse((unsigned char *)transaction,
+				ARRAY_SIZE(transaction), &parts, collect_tx);
+	CHECKRES(res);
+	assert(parts.num_inputs == 2);
+	assert(parts.num_outputs == 1);
+
+	for (i = 0; i < parts.num_inputs; i++)
+		ins += psbt_txin_size(&parts.txins[i]);
+	for (i = 0; i < parts.num_outputs; i++)
+		outs += psbt_txout_size(&parts.txouts[i]);
+	size = psbt_tx_size(parts.num_inputs, ins, parts.num_outputs, outs);
+	assert(size == ARRAY_SIZE(transaction));
+
+	psbt_init(&psbt, raw, sizeof(raw));
+	rec.type = PSBT_GLOBAL_UNSIGNED_TX;
+	rec.key = NULL;
+	rec.key_size = 0;
+	rec.val = (unsigned char *)transaction;
+	rec.val_size = ARRAY_SIZE(transaction);
+	res = psbt_write_global_record(&psbt, &rec);
+	CHECKRES(res);
+	raw_len = psbt_size(&psbt);
+
+	// exact and unknown sizes give the same bytes
+	psbt_init(&psbt, out, sizeof(out));
+	res = write_tx(&psbt, &parts, size);
+	CHECKRES(res);
+	assert(psbt_size(&psbt) == raw_len);
+	assert(memcmp(out, raw, raw_len) == 0);
+
+	psbt_init(&psbt, out, sizeof(out));
+	res = write_tx(&psbt, &parts, 0);
+	CHECKRES(res);
+	assert(psbt_size(&psbt) == raw_len);
+	assert(memcmp(out, raw, raw_len) == 0);
+
+	psbt_init_alloc(&psbt, test_realloc, &calls);
+	res = write_tx(&psbt, &parts, size);
+	CHECKRES(res);
+	assert(psbt_size(&psbt) == raw_len);
+	assert(memcmp(psbt.data, raw, raw_len) == 0);
+	psbt_free(&psbt);
+
+	// counts have to match psbt_tx_begin
+	psbt_init(&psbt, out, sizeof(out));
+	res = psbt_tx_begin(&w, &psbt, &parts.tx, 2, 1, size);
+	CHECKRES(res);
+	res = psbt_tx_add_input(&w, &parts.txins[0]);
+	CHECKRES(res);
+	assert(psbt_tx_add_output(&w, &parts.txouts[0]) == PSBT_INVALID_STATE);
+
+	psbt_init(&psbt, out, sizeof(out));
+	res = psbt_tx_begin(&w, &psbt, &parts.tx, 0, 0, 0);
+	CHECKRES(res);
+	assert(psbt_tx_add_input(&w, &parts.txins[0]) == PSBT_INVALID_STATE);
+
+	// no room for the tx
+	psbt_init(&psbt, out, raw_len - 1);
+	assert(write_tx(&psbt, &parts, size) == PSBT_OOB_WRITE);
+}
+
+
+struct witness_check {
+	unsigned int inputs;
+	unsigned int outputs;
+	unsigned int items;
+	struct psbt_tx tx;
+	struct psbt_witness_item last;
+};
+
+static void check_witness(struct psbt_txelem *elem) {
+	struct witness_check *c = (struct witness_check *)elem->user_data;
+
+	switch (elem->elem_type) {
+	case PSBT_TXELEM_TXIN:
+		c->inputs++;
+		break;
+	case PSBT_TXELEM_TXOUT:
+		c->outputs++;
+		break;
+	case PSBT_TXELEM_TX:
+		c->tx = *elem->elem.tx;
+		break;
+	case PSBT_TXELEM_WITNESS_ITEM:
+		c->last = *elem->elem.witness_item;
+		c->items++;
+		break;
+	}
+}
+
+void segwit_parse_test() {
+	static const unsigned char witness[] = {
+		0x02, 0x03, 0xaa, 0xbb, 0xcc, 0x02, 0xdd, 0xee, // input 0
+		0x00,                                           // input 1
+	};
+	unsigned char tx[sizeof(transaction) + 2 + sizeof(witness)];
+	size_t body = ARRAY_SIZE(transaction) - 8;
+	struct witness_check c;
+	unsigned int offsets[2];
+	enum psbt_result res;
+
+	// version, marker and flag, body, witness, lock time
+	memcpy(tx, transaction, 4);
+	tx[4] = 0x00;
+	tx[5] = 0x01;
+	memcpy(tx + 6, transaction + 4, body);
+	memcpy(tx + 6 + body, witness, sizeof(witness));
+	memcpy(tx + 6 + body + sizeof(witness), transaction + 4 + body, 4);
+
+	// witness stacks are skipped, not walked
+	memset(&c, 0, sizeof(c));
+	res = psbt_btc_tx_parse(tx, sizeof(tx), &c, check_witness);
+	CHECKRES(res);
+	assert(c.inputs == 2 && c.outputs == 1 && c.items == 0);
+	assert(c.tx.version == 2 && c.tx.lock_time == 0);
+	assert(c.tx.num_inputs == 2 && c.tx.num_outputs == 1);
+	assert(c.tx.witness == tx + 6 + body);
+	assert(c.tx.witness_size == sizeof(witness));
+
+	res = psbt_btc_tx_witness_index(&c.tx, offsets, ARRAY_SIZE(offsets));
+	CHECKRES(res);
+	assert(offsets[0] == 0 && offsets[1] == 8);
+
+	res = psbt_btc_tx_witness_stack(&c.tx, 0, offsets[0], &c,
+					check_witness);
+	CHECKRES(res);
+	assert(c.items == 2);
+	assert(c.last.input_index == 0 && c.last.item_index == 1);
+	assert(c.last.item_len == 2 && c.last.item[0] == 0xdd);
+
+	res = psbt_btc_tx_witness_stack(&c.tx, 1, offsets[1], &c,
+					check_witness);
+	CHECKRES(res);
+	assert(c.items == 2);
+
+	assert(psbt_btc_tx_witness_index(&c.tx, offsets, 1) == PSBT_OOB_WRITE);
+
+	// a stack count that runs past the section
+	c.tx.witness_size--;
+	res = psbt_btc_tx_witness_index(&c.tx, offsets, ARRAY_SIZE(offsets));
+	assert(res == PSBT_READ_ERROR);
+
+	// non-witness txs have no witness section
+	memset(&c, 0, sizeof(c));
+	res = psbt_btc_tx_parse((unsigned char *)transaction,
+				ARRAY_SIZE(transaction), &c, check_witness);
+	CHECKRES(res);
+	assert(c.tx.witness == NULL);
+	assert(psbt_btc_tx_witness_index(&c.tx, offsets, 2) ==
+	       PSBT_INVALID_STATE);
+
+	tx[5] = 0x02;
+	res = psbt_btc_tx_parse(tx, sizeof(tx), &c, check_witness);
+	assert(res == PSBT_READ_ERROR);
+
+	// bip144 defines no other flag bits, 0x01 has to be the whole flag
+	tx[5] = 0x03;
+	res = psbt_btc_tx_parse(tx, sizeof(tx), &c, check_witness);
+	assert(res == PSBT_READ_ERROR);
+}
+
+
+void get_output_test() {
+	unsigned char tx[sizeof(transaction) + 3];
+	size_t body = ARRAY_SIZE(transaction) - 8;
+	struct psbt_txout txout;
+	enum psbt_result res;
+
+	res = psbt_tx_get_output((unsigned char *)transaction,
+				 ARRAY_SIZE(transaction), 0, &txout);
+	CHECKRES(res);
+	assert(txout.amount == 249900000);
+	assert(txout.script_len == 23);
+	assert(txout.script == transaction + ARRAY_SIZE(transaction) - 4 - 23);
+
+	res = psbt_tx_get_output((unsigned char *)transaction,
+				 ARRAY_SIZE(transaction), 1, &txout);
+	assert(res == PSBT_READ_ERROR);
+
+	// the same tx with an empty witness for each input
+	memcpy(tx, transaction, 4);
+	tx[4] = 0x00;
+	tx[5] = 0x01;
+	memcpy(tx + 6, transaction + 4, body);
+	tx[6 + body] = 0x00;
+	memcpy(tx + 7 + body, transaction + 4 + body, 4);
+
+	res = psbt_tx_get_output(tx, sizeof(tx), 0, &txout);
+	CHECKRES(res);
+	assert(txout.amount == 249900000);
+
+	tx[5] = 0x03;
+	res = psbt_tx_get_output(tx, sizeof(tx), 0, &txout);
+	assert(res == PSBT_READ_ERROR);
+
+	res = psbt_tx_get_output((unsigned char *)transaction, 60, 0, &txout);
+	assert(res == PSBT_READ_ERROR);
+}
+
+
+static int hex_equals(const unsigned char *bytes, const char *hex) {
+	unsigned char expected[32];
+	size_t len;
+
+	assert(psbt_decode(hex, 64, expected, sizeof(expected), &len) ==
+	       PSBT_OK);
+	return memcmp(bytes, expected, 32) == 0;
+}
+
+void sha256_test() {
+	static unsigned char data[1000];
+	const unsigned int backends[] = { 0, CPU_SHA, CPU_AVX2 };
+	struct sha256_msg msgs[20];
+	unsigned char out[20][32], expected[20][32], hash[32];
+	unsigned int cpu = cpu_features();
+	size_t i, b;
+
+	sha256((const unsigned char *)"", 0, hash);
+	assert(hex_equals(hash, "e3b0c44298fc1c149afbf4c8996fb924"
+				"27ae41e4649b934ca495991b7852b855"));
+	sha256((const unsigned char *)"abc", 3, hash);
+	assert(hex_equals(hash, "ba7816bf8f01cfea414140de5dae2223"
+				"b00361a396177a9cb410ff61f20015ad"));
+
+	memset(data, 'a', sizeof(data));
+	sha256d(data, sizeof(data), hash);
+	assert(hex_equals(hash, "f2b6fd3c03e69a9201ec5826310c02da"
+				"24d154d2fe3c9041527696bb1f693dce"));
+
+	// every padding case, split over segments at odd places
+	for (i = 0; i < ARRAY_SIZE(msgs); i++) {
+		msgs[i].seg[0] = data;
+		msgs[i].len[0] = i * 37 % 300;
+		msgs[i].seg[1] = data + 300;
+		msgs[i].len[1] = i * 13 % 100;
+		msgs[i].seg[2] = data + 400;
+		msgs[i].len[2] = i * 5 % 70;
+		msgs[i].num_segs = 3;
+	}
+
+	sha256d_many_cpu(msgs, ARRAY_SIZE(msgs), expected, 0);
+
+	for (b = 0; b < ARRAY_SIZE(backends); b++) {
+		if ((backends[b] & cpu) != backends[b])
+			continue;
+		sha256d_many_cpu(msgs, ARRAY_SIZE(msgs), out, backends[b]);
+		assert(memcmp(out, expected, sizeof(out)) == 0);
+	}
+}
+
+void txid_test() {
+	static unsigned char buf[2048];
+	unsigned char tx[sizeof(transaction) + 4];
+	size_t body = ARRAY_SIZE(transaction) - 8;
+	unsigned char txid[32], txids[4][32], zero[32] = {0};
+	size_t len, num_txids;
+	enum psbt_result res;
+
+	res = psbt_txid(transaction, ARRAY_SIZE(transaction), txid);
+	CHECKRES(res);
+	assert(hex_equals(txid, "e08ee0d68f07a5ddcfbd4f684cda4345"
+				"51ab75f16b3e6d6c2fe1b9d9390af549"));
+
+	// witnesses don't change the txid
+	memcpy(tx, transaction, 4);
+	tx[4] = 0x00;
+	tx[5] = 0x01;
+	memcpy(tx + 6, transaction + 4, body);
+	tx[6 + body] = 0x00;
+	tx[7 + body] = 0x00;
+	memcpy(tx + 8 + body, transaction + 4 + body, 4);
+	res = psbt_txid(tx, sizeof(tx), txid);
+	CHECKRES(res);
+	assert(hex_equals(txid, "e08ee0d68f07a5ddcfbd4f684cda4345"
+				"51ab75f16b3e6d6c2fe1b9d9390af549"));
+
+	tx[5] = 0x03;
+	res = psbt_txid(tx, sizeof(tx), txid);
+	assert(res == PSBT_READ_ERROR);
+
+	// too large to be truncated to 32 bits, nothing is read
+	if (sizeof(size_t) > sizeof(unsigned int)) {
+		res = psbt_txid(tx, (size_t)UINT_MAX + 1, txid);
+		assert(res == PSBT_READ_ERROR);
+	}
+
+	res = psbt_decode(psbt_hex, strlen(psbt_hex), buf, sizeof(buf), &len);
+	CHECKRES(res);
+
+	res = psbt_txids(buf, len, txids, ARRAY_SIZE(txids), &num_txids);
+	CHECKRES(res);
+	assert(num_txids == 3);
+	assert(hex_equals(txids[0], "7b61d1912211bfa1df58ec6fab79bb68"
+				    "4ccb309a4d5f1af09711abd752d6ef82"));
+	// input 0 spends output 0 of its non-witness utxo
+	assert(memcmp(txids[1], buf + 8 + 5, 32) == 0);
+	// input 1 only has a witness utxo
+	assert(memcmp(txids[2], zero, 32) == 0);
+
+	res = psbt_txids(buf, len, txids, 2, &num_txids);
+	assert(res == PSBT_OOB_WRITE);
+}
+
+
+static const char *bip143_tx =
+	"0100000002fff7f7881a8099afa6940d42d1e7f6362bec38171ea3edf433541db4"
+	"e4ad969f0000000000eeffffffef51e1b804cc89d182d279655c3aa89e815b1b30"
+	"9fe287d9b2b55d57b90ec68a0100000000ffffffff02202cb206000000001976a9"
+	"148280b37df378db99f66f85c95a783a76ac7a6d5988ac9093510d000000001976"
+	"a9143bde42dbee7e4dbe6a21b2d50ce2f0167faa815988ac11000000";
+
+/* utxos of the bip143 native p2wpkh example: 6.25 btc p2pk, 6 btc p2wpkh */
+static const char *bip143_utxos[2] = {
+	"40be402500000000232103c9f4836b9a4f77fc0d81f7bcb01b7f1b35916864b947"
+	"6c241ce9fc198bd25432ac",
+	"0046c32300000000160014""1d0f172a0ecb48aee1be1f2687d2963ae33f71a1",
+};
+
+/* a tx paying the first utxo, to look it up as a non-witness utxo */
+static const char *bip143_prev_tx =
+	"010000000100000000000000000000000000000000000000000000000000000000"
+	"000000000000000000ffffffff0140be402500000000232103c9f4836b9a4f77fc"
+	"0d81f7bcb01b7f1b35916864b9476c241ce9fc198bd25432ac00000000";
+
+static size_t bip143_psbt(unsigned char *out, size_t out_size,
+			  int non_witness)
+{
+	unsigned char tx[256], utxo[2][64], prev[128];
+	struct psbt_record rec;
+	struct psbt psbt;
+	enum psbt_result res;
+	size_t tx_len, utxo_len[2], prev_len;
+	int i;
+
+	res = psbt_decode(bip143_tx, strlen(bip143_tx), tx, sizeof(tx),
+			  &tx_len);
+	CHECKRES(res);
+	res = psbt_decode(bip143_prev_tx, strlen(bip143_prev_tx), prev,
+			  sizeof(prev), &prev_len);
+	CHECKRES(res);
+	for (i = 0; i < 2; i++) {
+		res = psbt_decode(bip143_utxos[i], strlen(bip143_utxos[i]),
+				  utxo[i], sizeof(utxo[i]), &utxo_len[i]);
+		CHECKRES(res);
+	}
+
+	psbt_init(&psbt, out, out_size);
+
+	rec.type = PSBT_GLOBAL_UNSIGNED_TX;
+	rec.key = NULL;
+	rec.key_size = 0;
+	rec.val = tx;
+	rec.val_size = tx_len;
+	res = psbt_write_global_record(&psbt, &rec);
+	CHECKRES(res);
+
+	for (i = 0; i < 2; i++) {
+		res = psbt_new_input_record_set(&psbt);
+		CHECKRES(res);
+		if (i == 0 && non_witness) {
+			rec.type = PSBT_IN_NON_WITNESS_UTXO;
+			rec.val = prev;
+			rec.val_size = prev_len;
+		} else {
+			rec.type = PSBT_IN_WITNESS_UTXO;
+			rec.val = utxo[i];
+			rec.val_size = utxo_len[i];
+		}
+		res = psbt_write_input_record(&psbt, &rec);
+		CHECKRES(res);
+	}
+
+	for (i = 0; i < 2; i++) {
+		res = psbt_new_output_record_set(&psbt);
+		CHECKRES(res);
+	}
+
+	res = psbt_finalize(&psbt);
+	CHECKRES(res);
+
+	return psbt_size(&psbt);
+}
+
+void sighash_test() {
+	static unsigned char buf[1024];
+	static const struct {
+		unsigned int input;
+		unsigned int type;
+		const char *hash;
+	} v0[] = {
+		// the bip143 test vector
+		{ 1, 0x01, "c37af31116d1b27caf68aae9e3ac82f1"
+			   "477929014d5b917657d0eb49478cb670" },
+		{ 0, 0x02, "e1c22816114e542fc1209dfdd93f70a4"
+			   "f83df65d2e9ae88c8c7adef547ad640d" },
+		{ 1, 0x03, "f4fe57286dd2ca8ac0e3dfccd54c352f"
+			   "cdcacbed80f194e264b75d7a7c74e4ce" },
+		{ 0, 0x81, "8cd5534e42993301ef53042d992353b8"
+			   "301e7d36dcb5ba290c8e50cd200d412f" },
+		{ 1, 0x82, "4abb5ef58a968f8e1ab88a9fb72f2ce7"
+			   "4b3022e65d334ac7b8aeda747515dc15" },
+	}, tr[] = {
+		{ 0, 0x00, "f76a2f5086df60bd80e8bf9844efbee6"
+			   "dd671adb2c7e7e95b3b74e2476168cab" },
+		{ 1, 0x01, "5b3acb7a616329406199e44d45a16844"
+			   "cb4c581d9bfbbf87a0380922dab208ce" },
+		{ 0, 0x02, "bfd61f2a421267d1d74ea3243c5b04cd"
+			   "36d4921c031695f5e15becec02c1a3ed" },
+		{ 1, 0x03, "cb51480e5cfe487dc2e99a3fee48bb2a"
+			   "0541bd998416d6600f6e531596821d8f" },
+		{ 0, 0x81, "6970072deaee9be059ed50e039ccc499"
+			   "9ecd2d3b9adf468ce039907aa99a6f8f" },
+		{ 1, 0x83, "97afd3cc0c63f940626878a9d1ff7009"
+			   "a147aa4ae11d54e9d18c7c568fb4cb87" },
+	};
+	static const unsigned char script_code[] = {
+		0x19, 0x76, 0xa9, 0x14, 0x1d, 0x0f, 0x17, 0x2a, 0x0e, 0xcb,
+		0x48, 0xae, 0xe1, 0xbe, 0x1f, 0x26, 0x87, 0xd2, 0x96, 0x3a,
+		0xe3, 0x3f, 0x71, 0xa1, 0x88, 0xac,
+	};
+	struct psbt_sighash_input inputs[2];
+	struct psbt_sighash_output outputs[2];
+	struct psbt_sighash sh;
+	unsigned char hash[32], leaf[32];
+	enum psbt_result res;
+	size_t len, i;
+	int non_witness;
+
+	for (non_witness = 0; non_witness < 2; non_witness++) {
+		len = bip143_psbt(buf, sizeof(buf), non_witness);
+
+		psbt_sighash_init(&sh, inputs, 2, outputs, 2);
+		res = psbt_sighash_build(&sh, buf, len);
+		CHECKRES(res);
+		assert(sh.num_inputs == 2 && sh.num_outputs == 2);
+		assert(sh.have_all_utxos);
+		assert(inputs[0].amount == 625000000);
+		assert(hex_equals(sh.hash_prevouts,
+				  "96b827c8483d4e9b96712b6713a7b68d"
+				  "6e8003a781feba36c31143470b4efd37"));
+		assert(hex_equals(sh.hash_sequence,
+				  "52b0a642eea2fb7ae638c36f6252b675"
+				  "0293dbe574a806984b8e4d8548339a3b"));
+		assert(hex_equals(sh.hash_outputs,
+				  "863ef3e1a92afbfdb97f31ad0fc7683e"
+				  "e943e9abcf2501590ff8f6551f47e5e5"));
+
+		for (i = 0; i < ARRAY_SIZE(v0); i++) {
+			res = psbt_sighash_segwit_v0(&sh, v0[i].input,
+						     script_code,
+						     sizeof(script_code),
+						     v0[i].type, hash);
+			CHECKRES(res);
+			assert(hex_equals(hash, v0[i].hash));
+		}
+
+		for (i = 0; i < ARRAY_SIZE(tr); i++) {
+			res = psbt_sighash_taproot(&sh, tr[i].input, tr[i].type,
+						   NULL, 0xffffffff, hash);
+			CHECKRES(res);
+			assert(hex_equals(hash, tr[i].hash));
+		}
+	}
+
+	// script path
+	for (i = 0; i < sizeof(leaf); i++)
+		leaf[i] = (unsigned char)i;
+	res = psbt_sighash_taproot(&sh, 0, 0x00, leaf, 0xffffffff, hash);
+	CHECKRES(res);
+	assert(hex_equals(hash, "301cc3c73755eaef6fb45205e54270e7"
+				"121c50df8f5287ca3843e656b511e69b"));
+
+	assert(psbt_sighash_taproot(&sh, 0, 0x04, NULL, 0xffffffff, hash) ==
+	       PSBT_INVALID_STATE);
+	assert(psbt_sighash_taproot(&sh, 2, 0x01, NULL, 0xffffffff, hash) ==
+	       PSBT_INVALID_STATE);
+
+	// input 1 without a utxo, as psbt_sighash_build leaves it
+	inputs[1].has_utxo = 0;
+	sh.have_all_utxos = 0;
+	res = psbt_sighash_taproot(&sh, 0, 0x81, NULL, 0xffffffff, hash);
+	CHECKRES(res);
+	assert(hex_equals(hash, tr[4].hash));
+	assert(psbt_sighash_taproot(&sh, 0, 0x01, NULL, 0xffffffff, hash) ==
+	       PSBT_INVALID_STATE);
+	assert(psbt_sighash_taproot(&sh, 1, 0x83, NULL, 0xffffffff, hash) ==
+	       PSBT_INVALID_STATE);
+
+	psbt_sighash_init(&sh, inputs, 1, outputs, 2);
+	assert(psbt_sighash_build(&sh, buf, len) == PSBT_OOB_WRITE);
+}
+
+
+static size_t write_cosigner(unsigned char *out, size_t out_size,
+			     const unsigned char *tx, size_t tx_size,
+			     const struct psbt_record *in0, size_t n0,
+			     const struct psbt_record *in1, size_t n1)
+{
+	struct psbt_record global;
+	struct psbt psbt;
+	enum psbt_result res;
+
+	global.type = PSBT_GLOBAL_UNSIGNED_TX;
+	global.key = NULL;
+	global.key_size = 0;
+	global.val = (unsigned char *)tx;
+	global.val_size = tx_size;
+
+	psbt_init(&psbt, out, out_size);
+	res = psbt_write_map(&psbt, PSBT_SCOPE_GLOBAL, &global, 1);
+	CHECKRES(res);
+	res = psbt_write_map(&psbt, PSBT_SCOPE_INPUTS, in0, n0);
+	CHECKRES(res);
+	res = psbt_write_map(&psbt, PSBT_SCOPE_INPUTS, in1, n1);
+	CHECKRES(res);
+	res = psbt_write_map(&psbt, PSBT_SCOPE_OUTPUTS, NULL, 0);
+	CHECKRES(res);
+	res = psbt_finalize(&psbt);
+	CHECKRES(res);
+
+	return psbt_size(&psbt);
+}
+
+void combine_test() {
+	static unsigned char a[1024], b[1024], c[1024], expected[1024],
+		out[1024];
+	unsigned char pk_a[33], pk_b[33], sig_a[8], sig_b[8], other_tx[256];
+	struct psbt_record a0[2], b0[2], b1[1], all0[3];
+	struct psbt_combine_input inputs[3];
+	struct psbt psbt;
+	enum psbt_result res;
+	size_t expected_len;
+
+	memset(pk_a, 0x02, sizeof(pk_a));
+	memset(pk_b, 0x03, sizeof(pk_b));
+	memset(sig_a, 0xaa, sizeof(sig_a));
+	memset(sig_b, 0xbb, sizeof(sig_b));
+
+	a0[0].type = PSBT_IN_REDEEM_SCRIPT;
+	a0[0].key = NULL;
+	a0[0].key_size = 0;
+	a0[0].val = (unsigned char *)redeem_script_a;
+	a0[0].val_size = ARRAY_SIZE(redeem_script_a);
+	a0[1].type = PSBT_IN_PARTIAL_SIG;
+	a0[1].key = pk_a;
+	a0[1].key_size = sizeof(pk_a);
+	a0[1].val = sig_a;
+	a0[1].val_size = sizeof(sig_a);
+
+	// same redeem script, a second signature
+	b0[0] = a0[0];
+	b0[1] = a0[1];
+	b0[1].key = pk_b;
+	b0[1].val = sig_b;
+	b1[0] = b0[1];
+
+	all0[0] = a0[0];
+	all0[1] = a0[1];
+	all0[2] = b0[1];
+
+	inputs[0].src = a;
+	inputs[0].src_size = write_cosigner(a, sizeof(a), transaction,
+					    ARRAY_SIZE(transaction), a0, 2,
+					    NULL, 0);
+	inputs[1].src = b;
+	inputs[1].src_size = write_cosigner(b, sizeof(b), transaction,
+					    ARRAY_SIZE(transaction), b0, 2,
+					    b1, 1);
+	// combining a psbt with itself changes nothing
+	inputs[2] = inputs[0];
+
+	expected_len = write_cosigner(expected, sizeof(expected), transaction,
+				      ARRAY_SIZE(transaction), all0, 3, b1, 1);
+
+	psbt_init(&psbt, out, sizeof(out));
+	res = psbt_combine(inputs, 3, &psbt);
+	CHECKRES(res);
+	assert(psbt_size(&psbt) == expected_len);
+	assert(memcmp(out, expected, expected_len) == 0);
+
+	// the combined psbt parses
+	psbt_init(&psbt, out, sizeof(out));
+	res = psbt_read(out, expected_len, &psbt, NULL, NULL);
+	CHECKRES(res);
+
+	psbt_init(&psbt, out, sizeof(out));
+	res = psbt_combine(inputs, 1, &psbt);
+	CHECKRES(res);
+	assert(psbt_size(&psbt) == inputs[0].src_size);
+	assert(memcmp(out, a, inputs[0].src_size) == 0);
+
+	// a different unsigned tx
+	memcpy(other_tx, transaction, ARRAY_SIZE(transaction));
+	other_tx[0] = 0x01;
+	inputs[2].src = c;
+	inputs[2].src_size = write_cosigner(c, sizeof(c), other_tx,
+					    ARRAY_SIZE(transaction), a0, 2,
+					    NULL, 0);
+	psbt_init(&psbt, out, sizeof(out));
+	res = psbt_combine(inputs, 3, &psbt);
+	assert(res == PSBT_INVALID_STATE);
+
+	// a key twice in the map of one source is malformed, not combined
+	all0[2] = a0[1];
+	inputs[2].src = c;
+	inputs[2].src_size = write_cosigner(c, sizeof(c), transaction,
+					    ARRAY_SIZE(transaction), all0, 3,
+					    NULL, 0);
+	psbt_init(&psbt, out, sizeof(out));
+	res = psbt_combine(inputs, 3, &psbt);
+	assert(res == PSBT_READ_ERROR);
+	assert(strcmp(psbt_geterr(), "psbt_combine: duplicate key in map") == 0);
+
+	// trailing bytes in any source
+	b[inputs[1].src_size] = 0xde;
+	b[inputs[1].src_size + 1] = 0xad;
+	inputs[1].src_size += 2;
+	psbt_init(&psbt, out, sizeof(out));
+	res = psbt_combine(inputs, 2, &psbt);
+	assert(res == PSBT_READ_ERROR);
+	assert(strcmp(psbt_geterr(), "psbt_combine: data after end of psbt") == 0);
+	inputs[1].src_size -= 2;
+
+	// truncated
+	inputs[1].src_size -= 3;
+	psbt_init(&psbt, out, sizeof(out));
+	res = psbt_combine(inputs, 2, &psbt);
+	assert(res == PSBT_READ_ERROR);
+}
+
+
+struct canon_check {
+	struct psbt_record prev;
+	enum psbt_scope scope;
+	int index;
+	int records;
+};
+
+static void canon_check_rec(struct psbt_elem *elem) {
+	struct canon_check *c = (struct canon_check *)elem->user_data;
+	struct psbt_record *rec;
+	size_t len;
+
+	if (elem->type != PSBT_ELEM_RECORD)
+		return;
+
+	rec = elem->elem.rec;
+	if (c->records && rec->scope == c->scope && elem->index == c->index) {
+		assert(rec->type >= c->prev.type);
+		if (rec->type == c->prev.type) {
+			len = rec->key_size < c->prev.key_size
+				? rec->key_size : c->prev.key_size;
+			assert(memcmp(c->prev.key, rec->key, len) < 0 ||
+			       (memcmp(c->prev.key, rec->key, len) == 0 &&
+				c->prev.key_size < rec->key_size));
+		}
+	}
+
+	c->prev = *rec;
+	c->scope = rec->scope;
+	c->index = elem->index;
+	c->records++;
+}
+
+void canonicalize_test() {
+	static unsigned char a[8192], b[8192], out_a[8192], out_b[8192];
+	static unsigned char scratch[PSBT_CANONICALIZE_SCRATCH_SIZE(66)];
+	static unsigned char keys[64][33];
+	static struct psbt_record recs[66], shuffled[66];
+	unsigned char sig[8];
+	struct canon_check check;
+	struct psbt psbt;
+	enum psbt_result res;
+	size_t a_len, b_len, n = 0, i;
+
+	memset(sig, 0x30, sizeof(sig));
+
+	// keys sharing long prefixes, so the sort recurses a few digits deep
+	for (i = 0; i < 64; i++) {
+		memset(keys[i], 0x02, 33);
+		keys[i][20] = (unsigned char)(i & 3);
+		keys[i][32] = (unsigned char)(i * 37);
+		recs[n].type = PSBT_IN_PARTIAL_SIG;
+		recs[n].key = keys[i];
+		// a few keys are prefixes of others
+		recs[n].key_size = i == 5 || i == 6 ? 21 : 33;
+		recs[n].val = sig;
+		recs[n].val_size = sizeof(sig);
+		n++;
+	}
+
+	recs[n].type = PSBT_IN_REDEEM_SCRIPT;
+	recs[n].key = NULL;
+	recs[n].key_size = 0;
+	recs[n].val = (unsigned char *)redeem_script_a;
+	recs[n].val_size = ARRAY_SIZE(redeem_script_a);
+	n++;
+
+	recs[n] = recs[n - 1];
+	recs[n].type = PSBT_IN_NON_WITNESS_UTXO;
+	n++;
+
+	for (i = 0; i < n; i++)
+		shuffled[i] = recs[(i * 7) % n];
+
+	a_len = write_cosigner(a, sizeof(a), transaction,
+			       ARRAY_SIZE(transaction), recs, n, NULL, 0);
+	b_len = write_cosigner(b, sizeof(b), transaction,
+			       ARRAY_SIZE(transaction), shuffled, n, NULL, 0);
+	assert(a_len == b_len);
+	assert(memcmp(a, b, a_len) != 0);
+
+	psbt_init(&psbt, out_a, sizeof(out_a));
+	res = psbt_canonicalize(a, a_len, &psbt, scratch,
+				sizeof(scratch));
+	CHECKRES(res);
+	assert(psbt_size(&psbt) == a_len);
+
+	psbt_init(&psbt, out_b, sizeof(out_b));
+	res = psbt_canonicalize(b, b_len, &psbt, scratch,
+				sizeof(scratch));
+	CHECKRES(res);
+	assert(psbt_size(&psbt) == b_len);
+	assert(memcmp(out_a, out_b, a_len) == 0);
+
+	// one record short
+	psbt_init(&psbt, out_b, sizeof(out_b));
+	res = psbt_canonicalize(a, a_len, &psbt, scratch,
+				PSBT_CANONICALIZE_SCRATCH_SIZE(65));
+	assert(res == PSBT_OOB_WRITE);
+
+	// trailing bytes aren't dropped
+	a[a_len] = 0xde;
+	psbt_init(&psbt, out_b, sizeof(out_b));
+	res = psbt_canonicalize(a, a_len + 1, &psbt, scratch,
+				sizeof(scratch));
+	assert(res == PSBT_READ_ERROR);
+
+	memset(&check, 0, sizeof(check));
+	psbt_init(&psbt, out_a, sizeof(out_a));
+	psbt.strict = 1;
+	res = psbt_read(out_a, a_len, &psbt, canon_check_rec, &check);
+	CHECKRES(res);
+	assert(check.records == (int)n + 1);
+
+	// a duplicate key: accepted by default, rejected when strict
+	shuffled[1] = shuffled[0];
+	b_len = write_cosigner(b, sizeof(b), transaction,
+			       ARRAY_SIZE(transaction), shuffled, n, NULL, 0);
+
+	psbt_init(&psbt, out_b, sizeof(out_b));
+	res = psbt_read(b, b_len, &psbt, NULL, NULL);
+	CHECKRES(res);
+
+	psbt_init(&psbt, out_b, sizeof(out_b));
+	psbt.strict = 1;
+	res = psbt_read(b, b_len, &psbt, NULL, NULL);
+	assert(res == PSBT_READ_ERROR);
+
+	psbt_init(&psbt, out_b, sizeof(out_b));
+	res = psbt_canonicalize(b, b_len, &psbt, scratch,
+				sizeof(scratch));
+	assert(res == PSBT_READ_ERROR);
+
+	// the same key in different maps is fine
+	b_len = write_cosigner(b, sizeof(b), transaction,
+			       ARRAY_SIZE(transaction), recs, n, recs, n);
+	psbt_init(&psbt, out_b, sizeof(out_b));
+	psbt.strict = 1;
+	res = psbt_read(b, b_len, &psbt, NULL, NULL);
+	CHECKRES(res);
+}
+
+static void validate_fails(const unsigned char *raw, size_t len,
+			   const char *msg)
+{
+	enum psbt_result res;
+
+	res = psbt_validate(raw, len);
+	assert(res == PSBT_READ_ERROR);
+	assert(strcmp(psbt_geterr(), msg) == 0);
+}
+
+void validate_test() {
+	static unsigned char raw[4096], tx[256];
+	unsigned char pk[33], sig[8], path[12];
+	struct psbt_record recs[3];
+	enum psbt_result res;
+	size_t len, tx_len;
+
+	res = psbt_decode(psbt_hex, strlen(psbt_hex), raw, sizeof(raw), &len);
+	CHECKRES(res);
+	res = psbt_validate(raw, len);
+	CHECKRES(res);
+
+	// trailing bytes after the last output map
+	raw[len] = 0;
+	validate_fails(raw, len + 1, "psbt_read: data after end of psbt");
+
+	// the first prevout no longer names the non-witness utxo. The tx
+	// starts after the magic, key, value length, version and input count
+	raw[5 + 2 + 1 + 4 + 1] ^= 1;
+	validate_fails(raw, len, "psbt_validate: non-witness utxo does not "
+		       "match the prevout txid");
+
+	len = bip143_psbt(raw, sizeof(raw), 0);
+	res = psbt_validate(raw, len);
+	CHECKRES(res);
+
+	// bip143_prev_tx only pays the right amount, it isn't the real utxo
+	len = bip143_psbt(raw, sizeof(raw), 1);
+	validate_fails(raw, len, "psbt_validate: non-witness utxo does not "
+		       "match the prevout txid");
+
+	memset(pk, 0x02, sizeof(pk));
+	memset(sig, 0x30, sizeof(sig));
+	memset(path, 0x80, sizeof(path));
+
+	recs[0].type = PSBT_IN_PARTIAL_SIG;
+	recs[0].key = pk;
+	recs[0].key_size = sizeof(pk);
+	recs[0].val = sig;
+	recs[0].val_size = sizeof(sig);
+	recs[1].type = PSBT_IN_BIP32_DERIVATION;
+	recs[1].key = pk;
+	recs[1].key_size = sizeof(pk);
+	recs[1].val = path;
+	recs[1].val_size = sizeof(path);
+	recs[2].type = PSBT_IN_FINAL_SCRIPTSIG;
+	recs[2].key = NULL;
+	recs[2].key_size = 0;
+	recs[2].val = sig;
+	recs[2].val_size = sizeof(sig);
+
+	len = write_cosigner(raw, sizeof(raw), transaction,
+			     ARRAY_SIZE(transaction), recs, 2, &recs[2], 1);
+	res = psbt_validate(raw, len);
+	CHECKRES(res);
+
+	len = write_cosigner(raw, sizeof(raw), transaction,
+			     ARRAY_SIZE(transaction), recs, 3, NULL, 0);
+	validate_fails(raw, len, "psbt_validate: input has both final and "
+		       "partial fields");
+
+	recs[0].key_size = 32;
+	len = write_cosigner(raw, sizeof(raw), transaction,
+			     ARRAY_SIZE(transaction), recs, 1, NULL, 0);
+	validate_fails(raw, len, "psbt_validate: partial sig key is not a "
+		       "pubkey");
+
+	recs[1].val_size = 6;
+	len = write_cosigner(raw, sizeof(raw), transaction,
+			     ARRAY_SIZE(transaction), &recs[1], 1, NULL, 0);
+	validate_fails(raw, len, "psbt_validate: invalid bip32 derivation");
+
+	// a one byte scriptSig on the first input
+	tx_len = ARRAY_SIZE(transaction) + 1;
+	memcpy(tx, transaction, 41);
+	tx[41] = 1;
+	tx[42] = 0x51;
+	memcpy(tx + 43, transaction + 42, ARRAY_SIZE(transaction) - 42);
+	len = write_cosigner(raw, sizeof(raw), tx, tx_len, NULL, 0, NULL, 0);
+	validate_fails(raw, len, "psbt_validate: unsigned tx has a scriptSig");
+}
+
+/* the elems a parse hands out, in order */
+struct elem_log {
+	struct psbt_record recs[64];
+	int indexes[64];
+	int num_recs;
+	int txelems;
+};
+
+static void log_elem(struct psbt_elem *elem) {
+	struct elem_log *log = (struct elem_log *)elem->user_data;
+
+	if (elem->type == PSBT_ELEM_TXELEM) {
+		log->txelems++;
+		return;
+	}
+
+	assert(log->num_recs < 64);
+	log->indexes[log->num_recs] = elem->index;
+	log->recs[log->num_recs++] = *elem->elem.rec;
+}
+
+static void tape_matches_read(const unsigned char *raw, size_t len) {
+	static struct elem_log read_log, tape_log;
+	struct psbt_tape_rec recs[64];
+	struct psbt_tape tape;
+	struct psbt psbt;
+	enum psbt_result res;
+	int i;
+
+	memset(&read_log, 0, sizeof(read_log));
+	memset(&tape_log, 0, sizeof(tape_log));
+
+	res = psbt_read_view(raw, len, &psbt, log_elem, &read_log);
+	CHECKRES(res);
+
+	psbt_tape_init(&tape, recs, ARRAY_SIZE(recs));
+	res = psbt_tape_scan(&tape, raw, len);
+	CHECKRES(res);
+	assert(tape.size == len);
+	assert(tape.num_recs == (size_t)read_log.num_recs);
+
+	res = psbt_tape_replay(&tape, log_elem, &tape_log);
+	CHECKRES(res);
+
+	assert(tape_log.txelems == read_log.txelems);
+	assert(tape_log.num_recs == read_log.num_recs);
+	for (i = 0; i < read_log.num_recs; i++) {
+		assert(tape_log.recs[i].type == read_log.recs[i].type);
+		assert(tape_log.recs[i].key == read_log.recs[i].key);
+		assert(tape_log.recs[i].key_size == read_log.recs[i].key_size);
+		assert(tape_log.recs[i].val == read_log.recs[i].val);
+		assert(tape_log.recs[i].val_size == read_log.recs[i].val_size);
+		assert(tape_log.recs[i].scope == read_log.recs[i].scope);
+		assert(tape_log.indexes[i] == read_log.indexes[i]);
+	}
+}
+
+static int tape_calls;
+
+static void count_tape_call(struct psbt_elem *elem) {
+	tape_calls++;
+}
+
+#define BIG_MAP_RECORDS 1100
+
+/* n bip32 derivations with distinct pubkeys, more than a keyset holds */
+static void big_map(struct psbt_record *recs, unsigned char (*keys)[33],
+		    size_t n, unsigned char *path)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		memset(keys[i], 0, 33);
+		keys[i][0] = 0x02;
+		keys[i][31] = (unsigned char)(i >> 8);
+		keys[i][32] = (unsigned char)i;
+		recs[i].type = PSBT_IN_BIP32_DERIVATION;
+		recs[i].key = keys[i];
+		recs[i].key_size = 33;
+		recs[i].val = path;
+		recs[i].val_size = 8;
+	}
+}
+
+void big_map_test() {
+	static unsigned char raw[65536], out[65536], a[65536], b[65536];
+	static unsigned char scratch[PSBT_CANONICALIZE_SCRATCH_SIZE(65536 / 3)];
+	static unsigned char keys[BIG_MAP_RECORDS][33];
+	static struct psbt_record recs[BIG_MAP_RECORDS];
+	struct psbt_combine_input inputs[2];
+	unsigned char path[8];
+	struct psbt psbt;
+	enum psbt_result res;
+	size_t len;
+
+	memset(path, 0x11, sizeof(path));
+	big_map(recs, keys, BIG_MAP_RECORDS, path);
+
+	// maps past PSBT_MAP_MAX_RECORDS are fine when strict
+	len = write_cosigner(raw, sizeof(raw), transaction,
+			     ARRAY_SIZE(transaction), recs, BIG_MAP_RECORDS,
+			     NULL, 0);
+	psbt_init(&psbt, out, sizeof(out));
+	psbt.strict = 1;
+	res = psbt_read(raw, len, &psbt, NULL, NULL);
+	CHECKRES(res);
+	res = psbt_validate(raw, len);
+	CHECKRES(res);
+
+	// two overlapping halves combine into the whole map
+	inputs[0].src = a;
+	inputs[0].src_size = write_cosigner(a, sizeof(a), transaction,
+					    ARRAY_SIZE(transaction), recs, 700,
+					    NULL, 0);
+	inputs[1].src = b;
+	inputs[1].src_size = write_cosigner(b, sizeof(b), transaction,
+					    ARRAY_SIZE(transaction), recs + 400,
+					    BIG_MAP_RECORDS - 400, NULL, 0);
+	psbt_init(&psbt, out, sizeof(out));
+	res = psbt_combine(inputs, 2, &psbt);
+	CHECKRES(res);
+	assert(psbt_size(&psbt) == len);
+	assert(memcmp(out, raw, len) == 0);
+
+	// already sorted, so canonical as it is
+	psbt_init(&psbt, out, sizeof(out));
+	res = psbt_canonicalize(raw, len, &psbt, scratch, sizeof(scratch));
+	CHECKRES(res);
+	assert(psbt_size(&psbt) == len);
+	assert(memcmp(out, raw, len) == 0);
+
+	// duplicates after the keyset filled up, of a key in the keyset and
+	// of one that came after it
+	recs[1090] = recs[3];
+	len = write_cosigner(raw, sizeof(raw), transaction,
+			     ARRAY_SIZE(transaction), recs, BIG_MAP_RECORDS,
+			     NULL, 0);
+	psbt_init(&psbt, out, sizeof(out));
+	psbt.strict = 1;
+	res = psbt_read(raw, len, &psbt, NULL, NULL);
+	assert(res == PSBT_READ_ERROR);
+	validate_fails(raw, len, "psbt_read: duplicate key in map");
+
+	big_map(recs, keys, BIG_MAP_RECORDS, path);
+	recs[1090] = recs[1050];
+	len = write_cosigner(raw, sizeof(raw), transaction,
+			     ARRAY_SIZE(transaction), recs, BIG_MAP_RECORDS,
+			     NULL, 0);
+	psbt_init(&psbt, out, sizeof(out));
+	psbt.strict = 1;
+	res = psbt_read(raw, len, &psbt, NULL, NULL);
+	assert(res == PSBT_READ_ERROR);
+
+	// the same in the second source, after the keyset filled up
+	inputs[1].src_size = write_cosigner(b, sizeof(b), transaction,
+					    ARRAY_SIZE(transaction), recs + 400,
+					    BIG_MAP_RECORDS - 400, NULL, 0);
+	psbt_init(&psbt, out, sizeof(out));
+	res = psbt_combine(inputs, 2, &psbt);
+	assert(res == PSBT_READ_ERROR);
+	assert(strcmp(psbt_geterr(), "psbt_combine: duplicate key in map") == 0);
+}
+
+void tape_test() {
+	static unsigned char raw[8192];
+	struct psbt_tape_rec recs[64];
+	struct psbt_tape tape;
+	enum psbt_result res;
+	size_t len;
+
+	res = psbt_decode(psbt_hex, strlen(psbt_hex), raw, sizeof(raw), &len);
+	CHECKRES(res);
+	tape_matches_read(raw, len);
+
+	memset(&tape, 0xff, sizeof(tape));
+	psbt_tape_init(&tape, recs, ARRAY_SIZE(recs));
+	assert(tape.size == 0 && tape.num_recs == 0);
+	res = psbt_tape_scan(&tape, raw, len);
+	CHECKRES(res);
+	assert(tape.num_inputs == 2 && tape.num_outputs == 2);
+	assert(tape.recs[0].scope == PSBT_SCOPE_GLOBAL);
+	assert(tape.recs[tape.num_recs - 1].scope == PSBT_SCOPE_OUTPUTS);
+	assert(tape.recs[tape.num_recs - 1].index == 1);
+
+	// bad framing is found before any callback runs
+	res = psbt_tape_scan(&tape, raw, len - 1);
+	assert(res == PSBT_READ_ERROR);
+	assert(psbt_last_error()->offset == len - 1);
+
+	psbt_tape_init(&tape, recs, 3);
+	res = psbt_tape_scan(&tape, raw, len);
+	assert(res == PSBT_OOB_WRITE);
+
+	// like psbt_read, src holds exactly one psbt
+	psbt_tape_init(&tape, recs, ARRAY_SIZE(recs));
+	raw[len] = 0;
+	res = psbt_tape_scan(&tape, raw, len + 1);
+	assert(res == PSBT_READ_ERROR);
+	assert(psbt_last_error()->offset == len);
+
+	len = big_psbt(raw, sizeof(raw));
+	tape_matches_read(raw, len);
+
+	len = bip143_psbt(raw, sizeof(raw), 1);
+	tape_matches_read(raw, len);
+
+	// the unsigned tx is only parsed fully on replay
+	psbt_tape_init(&tape, recs, ARRAY_SIZE(recs));
+	res = psbt_tape_scan(&tape, raw, len);
+	CHECKRES(res);
+	raw[8 + 4 + 1 + 36] = 0xfd;
+	tape_calls = 0;
+	res = psbt_tape_replay(&tape, count_tape_call, NULL);
+	assert(res != PSBT_OK);
+	assert(tape_calls == 0);
+}
+
+void doc_test() {
+	static unsigned char raw[2048], block[PSBT_DOC_BLOCK_SIZE(2048)];
+	const struct psbt_doc_map *map;
+	struct psbt_record rec;
+	struct psbt_doc doc;
+	unsigned int missing[2];
+	enum psbt_result res;
+	size_t len, num_recs;
+
+	res = psbt_decode(psbt_hex, strlen(psbt_hex), raw, sizeof(raw), &len);
+	CHECKRES(res);
+
+	psbt_doc_init(&doc, block, PSBT_DOC_BLOCK_SIZE(len));
+	res = psbt_doc_build(&doc, raw, len);
+	CHECKRES(res);
+	assert(doc.tape.num_inputs == 2 && doc.tape.num_outputs == 2);
+
+	assert(psbt_doc_output_total(&doc) == 149990000 + 100000000);
+	assert(doc.script_sizes[0] == 22 && doc.script_sizes[1] == 22);
+	assert(raw[doc.script_offsets[0]] == 0x00 &&
+	       raw[doc.script_offsets[0] + 1] == 0x14);
+	assert(doc.sequences[0] == 0xffffffff);
+	assert(doc.prevout_indexes[0] == 0 && doc.prevout_indexes[1] == 1);
+	// after the magic, key, value length, version and input count
+	assert(doc.prevout_offsets[0] == 5 + 2 + 1 + 4 + 1);
+	assert(doc.prevout_offsets[1] == doc.prevout_offsets[0] + 41);
+
+	assert(psbt_doc_inputs_without(&doc, PSBT_IN_PARTIAL_SIG,
+				       missing) == 2);
+	assert(psbt_doc_inputs_without(&doc, PSBT_IN_REDEEM_SCRIPT,
+				       missing) == 0);
+	assert(psbt_doc_inputs_without(&doc, PSBT_IN_NON_WITNESS_UTXO,
+				       missing) == 1);
+	assert(missing[0] == 1);
+
+	map = psbt_doc_input_map(&doc, 1);
+	assert(map->num_recs == 5);
+	psbt_tape_record(&doc.tape, &doc.tape.recs[map->first_rec], &rec);
+	assert(rec.type == PSBT_IN_WITNESS_UTXO && rec.val_size == 32);
+
+	map = psbt_doc_output_map(&doc, 1);
+	assert(map->num_recs == 1);
+	assert(psbt_doc_output_map(&doc, 2) == NULL);
+	assert(psbt_doc_input_map(&doc, 2) == NULL);
+	num_recs = doc.tape.num_recs;
+
+	// too small for the records, then for the arrays after them
+	psbt_doc_init(&doc, block, 64);
+	res = psbt_doc_build(&doc, raw, len);
+	assert(res == PSBT_OOB_WRITE);
+
+	psbt_doc_init(&doc, block, num_recs * sizeof(struct psbt_tape_rec) + 16);
+	res = psbt_doc_build(&doc, raw, len);
+	assert(res == PSBT_OOB_WRITE);
+}
+
 int main(int argc, char *argv[])
 {
 	test_vector();
 	read_test_vector();
 	encode_decode_test();
 	empty_input_test();
+	hex_codec_test();
+	base64_decode_test();
+	base64_encode_test();
+	read_view_test();
+	index_test();
+	stream_test();
+	last_error_test();
+	batch_test();
+	compactsize_test();
+	read_encoded_test();
+	sink_test();
+	measure_test();
+	growable_test();
+	write_map_test();
+	iov_test();
+	begin_value_test();
+	tx_writer_test();
+	segwit_parse_test();
+	get_output_test();
+	sha256_test();
+	txid_test();
+	sighash_test();
+	combine_test();
+	canonicalize_test();
+	validate_test();
+	big_map_test();
+	tape_test();
+	doc_test();
 	return 0;
 }
 
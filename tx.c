@@ -4,6 +4,7 @@
 #include "tx.h"
 #include "result.h"
 #include "compactsize.h"
+#include "parser.h"
 #include "common.h"
 #include <endian.h>
 #include <assert.h>
@@ -22,17 +23,33 @@
 #define ASSERT_SPACE(s)							\
 	if (p+(s) > data + data_size) {		\
 		psbt_errmsg = "out of bounds " __FILE__ ":" STRINGIZE(__LINE__); \
-		return PSBT_READ_ERROR; \
+		return psbt_fail(PSBT_READ_ERROR); \
 	}
 
+static void
+write_le32(u8 *cursor, u32 val) {
+	val = htole32(val);
+	memcpy(cursor, &val, sizeof(val));
+}
+
+static void
+write_le64(u8 *cursor, u64 val) {
+	val = htole64(val);
+	memcpy(cursor, &val, sizeof(val));
+}
+
 static u32
 parse_le32(const u8 *cursor) {
-	return le32toh(*(u32*)cursor);
+	u32 val;
+	memcpy(&val, cursor, sizeof(val));
+	return le32toh(val);
 }
 
 static u64
 parse_le64(const u8 *cursor) {
-	return le64toh(*(u64*)cursor);
+	u64 val;
+	memcpy(&val, cursor, sizeof(val));
+	return le64toh(val);
 }
 
 static enum psbt_result
@@ -64,6 +81,7 @@ parse_txin(u8 **cursor, u8 *data, u32 data_size, struct psbt_txin *txin) {
 	txin->script_len = script_len;
 	txin->script = script_len ? p : NULL;
 
+	ASSERT_SPACE(script_len);
 	p += script_len;
 
 	ASSERT_SPACE(4);
@@ -130,6 +148,7 @@ parse_witness_item(u8 **cursor, u8 *data, u32 data_size,
 	witness_item->item = p;
 	witness_item->item_len = item_len;
 
+	ASSERT_SPACE(item_len);
 	p += item_len;
 
 	*cursor = p;
@@ -138,21 +157,19 @@ parse_witness_item(u8 **cursor, u8 *data, u32 data_size,
 }
 
 
-enum psbt_result
-psbt_btc_tx_parse(u8 *data, u32 data_size, void *user_data,
-		  psbt_txelem_handler *handler) {
+static enum psbt_result
+tx_parse(u8 *data, u32 data_size, int allow_witness, void *user_data,
+	 psbt_txelem_handler *handler) {
 	struct psbt_tx tx;
 	enum psbt_result res = PSBT_OK;
 	struct psbt_txin txin;
 	struct psbt_txout txout;
 	struct psbt_txelem txelem;
-	struct psbt_witness_item wi;
 
 	u64 count = 0;
 	u8 flag = 0;
 	u32 size_len = 0;
-	size_t inputs = 0;
-	size_t i = 0, j = 0;
+	size_t i = 0;
 
 	u8 *p = data;
 	txelem.user_data = user_data;
@@ -161,6 +178,22 @@ psbt_btc_tx_parse(u8 *data, u32 data_size, void *user_data,
 	tx.version = parse_le32(p);
 	p += 4;
 
+	// bip144 marker and flag, a zero input count can't be followed by a
+	// nonzero output count otherwise
+	ASSERT_SPACE(1);
+	if (allow_witness && *p == 0) {
+		ASSERT_SPACE(2);
+		flag = p[1];
+		if (flag != 0) {
+			if (flag != SEGREGATED_WITNESS_FLAG) {
+				psbt_errmsg = "psbt_btc_tx_parse: unknown "
+					"witness flag";
+				return psbt_fail(PSBT_READ_ERROR);
+			}
+			p += 2;
+		}
+	}
+
 	ASSERT_SPACE(1);
 	size_len = compactsize_peek_length(*p);
 
@@ -171,7 +204,7 @@ psbt_btc_tx_parse(u8 *data, u32 data_size, void *user_data,
 
 	p += size_len;
 
-	inputs = count;
+	tx.num_inputs = count;
 	debug("parsing %zu inputs\n", count);
 
 	// parse inputs
@@ -194,6 +227,8 @@ psbt_btc_tx_parse(u8 *data, u32 data_size, void *user_data,
 
 	p += size_len;
 
+	tx.num_outputs = count;
+
 	// parse outputs
 	for (i = 0; i < count; i++) {
 		res = parse_txout(&p, data, data_size, &txout);
@@ -204,30 +239,15 @@ psbt_btc_tx_parse(u8 *data, u32 data_size, void *user_data,
 		handler(&txelem);
 	}
 
-	if (flag & SEGREGATED_WITNESS_FLAG) {
-		for (i = 0; i < inputs; i++) {
-			ASSERT_SPACE(1);
-			size_len = compactsize_peek_length(*p);
-
-			ASSERT_SPACE(size_len);
-			count = compactsize_read(p, &res);
-			if (res != PSBT_OK)
-				return res;
-
-			p += size_len;
-
-			for (j = 0; j < count; j++) {
-				res = parse_witness_item(&p, data, data_size, &wi);
-				if (res != PSBT_OK)
-					return res;
-				wi.input_index = i;
-				wi.item_index = j;
-				txelem.elem_type = PSBT_TXELEM_WITNESS_ITEM;
-				txelem.elem.witness_item = &wi;
-				handler(&txelem);
-			}
-
-		}
+	// the witness section runs up to the lock time. it is only walked
+	// when asked for, see psbt_btc_tx_witness_index
+	tx.witness = NULL;
+	tx.witness_size = 0;
+	if (flag == SEGREGATED_WITNESS_FLAG) {
+		ASSERT_SPACE(4);
+		tx.witness = p;
+		tx.witness_size = data + data_size - 4 - p;
+		p += tx.witness_size;
 	}
 
 	ASSERT_SPACE(4);
@@ -236,7 +256,7 @@ psbt_btc_tx_parse(u8 *data, u32 data_size, void *user_data,
 
 	if (p != data + data_size) {
 		psbt_errmsg = "psbt_btc_tx_parse: parsing fell short";
-		return PSBT_READ_ERROR;
+		return psbt_fail(PSBT_READ_ERROR);
 	}
 
 	txelem.elem_type = PSBT_TXELEM_TX;
@@ -245,3 +265,483 @@ psbt_btc_tx_parse(u8 *data, u32 data_size, void *user_data,
 
 	return PSBT_OK;
 }
+
+enum psbt_result
+psbt_btc_tx_parse(u8 *data, u32 data_size, void *user_data,
+		  psbt_txelem_handler *handler) {
+	return tx_parse(data, data_size, 1, user_data, handler);
+}
+
+enum psbt_result
+psbt_btc_unsigned_tx_parse(u8 *data, u32 data_size, void *user_data,
+			   psbt_txelem_handler *handler) {
+	return tx_parse(data, data_size, 0, user_data, handler);
+}
+
+/* steps over a compactsize length and that many bytes */
+static enum psbt_result
+skip_bytes(u8 **cursor, u8 *data, u32 data_size) {
+	enum psbt_result res = PSBT_OK;
+	u32 size_len;
+	u64 len;
+
+	u8 *p = *cursor;
+
+	ASSERT_SPACE(1);
+	size_len = compactsize_peek_length(*p);
+
+	ASSERT_SPACE(size_len);
+	len = compactsize_read(p, &res);
+	if (res != PSBT_OK)
+		return res;
+
+	p += size_len;
+
+	ASSERT_SPACE(len);
+	*cursor = p + len;
+
+	return PSBT_OK;
+}
+
+static enum psbt_result
+skip_count(u8 **cursor, u8 *data, u32 data_size, u64 *count) {
+	enum psbt_result res = PSBT_OK;
+	u32 size_len;
+
+	u8 *p = *cursor;
+
+	ASSERT_SPACE(1);
+	size_len = compactsize_peek_length(*p);
+
+	ASSERT_SPACE(size_len);
+	*count = compactsize_read(p, &res);
+	if (res != PSBT_OK)
+		return res;
+
+	*cursor = p + size_len;
+
+	return PSBT_OK;
+}
+
+enum psbt_result
+psbt_tx_get_output(u8 *data, u32 data_size, unsigned int n,
+		   struct psbt_txout *txout)
+{
+	enum psbt_result res;
+	u64 count, i;
+
+	u8 *p = data;
+
+	ASSERT_SPACE(4);
+	p += 4;
+
+	// bip144 marker and flag, witnesses come after the outputs
+	ASSERT_SPACE(2);
+	if (p[0] == 0 && p[1] != 0) {
+		if (p[1] != SEGREGATED_WITNESS_FLAG) {
+			psbt_errmsg = "psbt_tx_get_output: unknown witness flag";
+			return psbt_fail(PSBT_READ_ERROR);
+		}
+		p += 2;
+	}
+
+	res = skip_count(&p, data, data_size, &count);
+	if (res != PSBT_OK)
+		return res;
+
+	// txid, index, script, sequence
+	for (i = 0; i < count; i++) {
+		ASSERT_SPACE(36);
+		p += 36;
+		res = skip_bytes(&p, data, data_size);
+		if (res != PSBT_OK)
+			return res;
+		ASSERT_SPACE(4);
+		p += 4;
+	}
+
+	res = skip_count(&p, data, data_size, &count);
+	if (res != PSBT_OK)
+		return res;
+
+	if (n >= count) {
+		psbt_errmsg = "psbt_tx_get_output: no such output";
+		return psbt_fail(PSBT_READ_ERROR);
+	}
+
+	// amount, script
+	for (i = 0; i < n; i++) {
+		ASSERT_SPACE(8);
+		p += 8;
+		res = skip_bytes(&p, data, data_size);
+		if (res != PSBT_OK)
+			return res;
+	}
+
+	return parse_txout(&p, data, data_size, txout);
+}
+
+enum psbt_result
+psbt_tx_txid_msg(u8 *data, u32 data_size, int allow_witness,
+		 struct sha256_msg *msg)
+{
+	enum psbt_result res;
+	u64 count, i;
+
+	u8 *p = data;
+
+	msg->seg[0] = data;
+	msg->len[0] = data_size;
+	msg->num_segs = 1;
+
+	ASSERT_SPACE(5);
+	p += 4;
+	if (!allow_witness || p[0] != 0)
+		return PSBT_OK;
+
+	ASSERT_SPACE(2);
+	if (p[1] == 0)
+		return PSBT_OK;
+	if (p[1] != SEGREGATED_WITNESS_FLAG) {
+		psbt_errmsg = "psbt_txid: unknown witness flag";
+		return psbt_fail(PSBT_READ_ERROR);
+	}
+	p += 2;
+
+	// version, everything between the flag and the witnesses, lock time
+	res = skip_count(&p, data, data_size, &count);
+	if (res != PSBT_OK)
+		return res;
+
+	for (i = 0; i < count; i++) {
+		ASSERT_SPACE(36);
+		p += 36;
+		res = skip_bytes(&p, data, data_size);
+		if (res != PSBT_OK)
+			return res;
+		ASSERT_SPACE(4);
+		p += 4;
+	}
+
+	res = skip_count(&p, data, data_size, &count);
+	if (res != PSBT_OK)
+		return res;
+
+	for (i = 0; i < count; i++) {
+		ASSERT_SPACE(8);
+		p += 8;
+		res = skip_bytes(&p, data, data_size);
+		if (res != PSBT_OK)
+			return res;
+	}
+
+	ASSERT_SPACE(4);
+
+	msg->len[0] = 4;
+	msg->seg[1] = data + 6;
+	msg->len[1] = p - (data + 6);
+	msg->seg[2] = data + data_size - 4;
+	msg->len[2] = 4;
+	msg->num_segs = 3;
+
+	return PSBT_OK;
+}
+
+/* steps over one witness stack without looking at the items */
+static enum psbt_result
+skip_witness_stack(u8 **cursor, u8 *data, u32 data_size) {
+	struct psbt_witness_item wi;
+	enum psbt_result res = PSBT_OK;
+	u32 size_len;
+	u64 count, j;
+
+	u8 *p = *cursor;
+
+	ASSERT_SPACE(1);
+	size_len = compactsize_peek_length(*p);
+
+	ASSERT_SPACE(size_len);
+	count = compactsize_read(p, &res);
+	if (res != PSBT_OK)
+		return res;
+
+	p += size_len;
+
+	for (j = 0; j < count; j++) {
+		res = parse_witness_item(&p, data, data_size, &wi);
+		if (res != PSBT_OK)
+			return res;
+	}
+
+	*cursor = p;
+
+	return PSBT_OK;
+}
+
+enum psbt_result
+psbt_btc_tx_witness_index(const struct psbt_tx *tx, unsigned int *offsets,
+			  unsigned int num_offsets)
+{
+	u8 *data = tx->witness, *p = data;
+	u32 data_size = tx->witness_size;
+	enum psbt_result res;
+	unsigned int i;
+
+	if (data == NULL) {
+		psbt_errmsg = "psbt_btc_tx_witness_index: tx has no witness";
+		return psbt_fail(PSBT_INVALID_STATE);
+	}
+
+	if (num_offsets < tx->num_inputs) {
+		psbt_errmsg = "psbt_btc_tx_witness_index: offsets array is "
+			"too small";
+		return psbt_fail(PSBT_OOB_WRITE);
+	}
+
+	for (i = 0; i < tx->num_inputs; i++) {
+		offsets[i] = p - data;
+		res = skip_witness_stack(&p, data, data_size);
+		if (res != PSBT_OK)
+			return res;
+	}
+
+	if (p != data + data_size) {
+		psbt_errmsg = "psbt_btc_tx_witness_index: witness data doesn't "
+			"match the number of inputs";
+		return psbt_fail(PSBT_READ_ERROR);
+	}
+
+	return PSBT_OK;
+}
+
+enum psbt_result
+psbt_btc_tx_witness_stack(const struct psbt_tx *tx, unsigned int input_index,
+			  unsigned int offset, void *user_data,
+			  psbt_txelem_handler *handler)
+{
+	u8 *data = tx->witness, *p;
+	u32 data_size = tx->witness_size;
+	enum psbt_result res = PSBT_OK;
+	struct psbt_witness_item wi;
+	struct psbt_txelem txelem;
+	u32 size_len;
+	u64 count, j;
+
+	if (data == NULL || input_index >= tx->num_inputs ||
+	    offset >= data_size) {
+		psbt_errmsg = "psbt_btc_tx_witness_stack: no such witness stack";
+		return psbt_fail(PSBT_INVALID_STATE);
+	}
+
+	p = data + offset;
+	txelem.user_data = user_data;
+
+	size_len = compactsize_peek_length(*p);
+
+	ASSERT_SPACE(size_len);
+	count = compactsize_read(p, &res);
+	if (res != PSBT_OK)
+		return res;
+
+	p += size_len;
+
+	for (j = 0; j < count; j++) {
+		res = parse_witness_item(&p, data, data_size, &wi);
+		if (res != PSBT_OK)
+			return res;
+		wi.input_index = input_index;
+		wi.item_index = j;
+		txelem.elem_type = PSBT_TXELEM_WITNESS_ITEM;
+		txelem.elem.witness_item = &wi;
+		handler(&txelem);
+	}
+
+	return PSBT_OK;
+}
+
+size_t
+psbt_txin_size(const struct psbt_txin *txin) {
+	return 32 + 4 + compactsize_length(txin->script_len) +
+		txin->script_len + 4;
+}
+
+size_t
+psbt_txout_size(const struct psbt_txout *txout) {
+	return 8 + compactsize_length(txout->script_len) + txout->script_len;
+}
+
+size_t
+psbt_tx_size(unsigned int num_inputs, size_t inputs_size,
+	     unsigned int num_outputs, size_t outputs_size)
+{
+	return 4 + compactsize_length(num_inputs) + inputs_size +
+		compactsize_length(num_outputs) + outputs_size + 4;
+}
+
+/* room for size more bytes of the tx at psbt->write_pos */
+static enum psbt_result
+tx_space(struct psbt_tx_writer *w, size_t size, u8 **dest) {
+	enum psbt_result res;
+
+	res = psbt_value_reserve(w->psbt, size);
+	if (res != PSBT_OK)
+		return res;
+
+	*dest = w->psbt->write_pos;
+	w->psbt->write_pos += size;
+
+	return PSBT_OK;
+}
+
+/* the output count follows the last input */
+static enum psbt_result
+tx_inputs_done(struct psbt_tx_writer *w) {
+	enum psbt_result res;
+	u8 *p;
+
+	if (w->inputs != w->num_inputs) {
+		psbt_errmsg = "psbt_tx_add_output: not all inputs were added";
+		return psbt_fail(PSBT_INVALID_STATE);
+	}
+
+	res = tx_space(w, compactsize_length(w->num_outputs), &p);
+	if (res != PSBT_OK)
+		return res;
+	compactsize_write(p, w->num_outputs);
+
+	w->outputs_started = 1;
+
+	return PSBT_OK;
+}
+
+enum psbt_result
+psbt_tx_begin(struct psbt_tx_writer *w, struct psbt *psbt,
+	      const struct psbt_tx *tx, unsigned int num_inputs,
+	      unsigned int num_outputs, size_t size)
+{
+	struct psbt_record rec;
+	enum psbt_result res;
+	u8 *p;
+
+	w->psbt = psbt;
+	w->lock_time = tx->lock_time;
+	w->num_inputs = num_inputs;
+	w->num_outputs = num_outputs;
+	w->inputs = 0;
+	w->outputs = 0;
+	w->outputs_started = 0;
+
+	rec.type = PSBT_GLOBAL_UNSIGNED_TX;
+	rec.scope = PSBT_SCOPE_GLOBAL;
+	rec.key = NULL;
+	rec.key_size = 0;
+
+	res = psbt_begin_value(psbt, &rec, size);
+	if (res != PSBT_OK)
+		return res;
+
+	// with an exact size this is the only reservation
+	if (size) {
+		res = psbt_value_reserve(psbt, size);
+		if (res != PSBT_OK)
+			return res;
+	}
+
+	res = tx_space(w, 4 + compactsize_length(num_inputs), &p);
+	if (res != PSBT_OK)
+		return res;
+
+	write_le32(p, tx->version);
+	compactsize_write(p + 4, num_inputs);
+
+	return PSBT_OK;
+}
+
+enum psbt_result
+psbt_tx_add_input(struct psbt_tx_writer *w, const struct psbt_txin *txin) {
+	enum psbt_result res;
+	u8 *p;
+
+	if (w->inputs >= w->num_inputs || w->outputs_started) {
+		psbt_errmsg = "psbt_tx_add_input: more inputs than announced "
+			"in psbt_tx_begin";
+		return psbt_fail(PSBT_INVALID_STATE);
+	}
+
+	res = tx_space(w, psbt_txin_size(txin), &p);
+	if (res != PSBT_OK)
+		return res;
+
+	memcpy(p, txin->txid, 32);
+	p += 32;
+	write_le32(p, txin->index);
+	p += 4;
+	compactsize_write(p, txin->script_len);
+	p += compactsize_length(txin->script_len);
+	if (txin->script_len)
+		memcpy(p, txin->script, txin->script_len);
+	p += txin->script_len;
+	write_le32(p, txin->sequence_number);
+
+	w->inputs++;
+
+	return PSBT_OK;
+}
+
+enum psbt_result
+psbt_tx_add_output(struct psbt_tx_writer *w, const struct psbt_txout *txout) {
+	enum psbt_result res;
+	u8 *p;
+
+	if (!w->outputs_started) {
+		res = tx_inputs_done(w);
+		if (res != PSBT_OK)
+			return res;
+	}
+
+	if (w->outputs >= w->num_outputs) {
+		psbt_errmsg = "psbt_tx_add_output: more outputs than announced "
+			"in psbt_tx_begin";
+		return psbt_fail(PSBT_INVALID_STATE);
+	}
+
+	res = tx_space(w, psbt_txout_size(txout), &p);
+	if (res != PSBT_OK)
+		return res;
+
+	write_le64(p, txout->amount);
+	p += 8;
+	compactsize_write(p, txout->script_len);
+	p += compactsize_length(txout->script_len);
+	if (txout->script_len)
+		memcpy(p, txout->script, txout->script_len);
+
+	w->outputs++;
+
+	return PSBT_OK;
+}
+
+enum psbt_result
+psbt_tx_end(struct psbt_tx_writer *w) {
+	enum psbt_result res;
+	u8 *p;
+
+	if (!w->outputs_started) {
+		res = tx_inputs_done(w);
+		if (res != PSBT_OK)
+			return res;
+	}
+
+	if (w->outputs != w->num_outputs) {
+		psbt_errmsg = "psbt_tx_end: not all outputs were added";
+		return psbt_fail(PSBT_INVALID_STATE);
+	}
+
+	res = tx_space(w, 4, &p);
+	if (res != PSBT_OK)
+		return res;
+
+	write_le32(p, w->lock_time);
+
+	return psbt_end_value(w->psbt);
+}
@@ -32,6 +32,11 @@ struct psbt_witness_item {
 struct psbt_tx {
 	unsigned int version;
 	unsigned int lock_time;
+	unsigned int num_inputs;
+	unsigned int num_outputs;
+	/* bip144 witness section, NULL for non-witness serializations */
+	unsigned char *witness;
+	unsigned int witness_size;
 };
 
 enum psbt_txelem_type {
@@ -55,9 +60,39 @@ struct psbt_txelem {
 typedef void (psbt_txelem_handler)(struct psbt_txelem *handler);
 
 
+/*
+ * Parses both serializations. Witness stacks are skipped as a whole and
+ * no PSBT_TXELEM_WITNESS_ITEM is emitted, the PSBT_TXELEM_TX elem points
+ * at the witness section for psbt_btc_tx_witness_index and
+ * psbt_btc_tx_witness_stack.
+ */
 enum psbt_result
 psbt_btc_tx_parse(unsigned char *tx, unsigned int tx_size, void *user_data,
 		  psbt_txelem_handler *handler);
 
+/* the non-witness serialization only, where zero inputs are not a marker */
+enum psbt_result
+psbt_btc_unsigned_tx_parse(unsigned char *tx, unsigned int tx_size,
+			   void *user_data, psbt_txelem_handler *handler);
+
+/* offsets[i] is where the witness stack of input i starts in tx->witness.
+ * This walks the whole witness section once and checks it. */
+enum psbt_result
+psbt_btc_tx_witness_index(const struct psbt_tx *tx, unsigned int *offsets,
+			  unsigned int num_offsets);
+
+/* emits a PSBT_TXELEM_WITNESS_ITEM per item of one input's witness stack,
+ * offset comes from psbt_btc_tx_witness_index */
+enum psbt_result
+psbt_btc_tx_witness_stack(const struct psbt_tx *tx, unsigned int input_index,
+			  unsigned int offset, void *user_data,
+			  psbt_txelem_handler *handler);
+
+/* output n of a serialized tx. Inputs and earlier outputs are skipped by
+ * their lengths, nothing else is parsed or checked. */
+enum psbt_result
+psbt_tx_get_output(unsigned char *tx, unsigned int tx_size, unsigned int n,
+		   struct psbt_txout *txout);
+
 
 #endif /* PSBT_TX_H */
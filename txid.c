@@ -0,0 +1,138 @@
+
+#include <limits.h>
+#include <string.h>
+
+#include "psbt.h"
+#include "parser.h"
+#include "sha256.h"
+#include "common.h"
+
+/* txs hashed together, a multiple of the 8 sha256 lanes */
+#define TXID_BATCH 64
+
+struct txid_batch {
+	struct sha256_msg msgs[TXID_BATCH];
+	size_t slots[TXID_BATCH];
+	size_t count;
+	unsigned char (*txids)[32];
+	size_t capacity;
+	size_t num_txids;
+	enum psbt_result res;
+};
+
+static void txid_flush(struct txid_batch *b) {
+	unsigned char out[TXID_BATCH][32];
+	size_t i;
+
+	sha256d_many(b->msgs, b->count, out);
+
+	for (i = 0; i < b->count; i++)
+		memcpy(b->txids[b->slots[i]], out[i], 32);
+
+	b->count = 0;
+}
+
+static void txid_add(struct txid_batch *b, struct psbt_record *rec,
+		     size_t slot, int allow_witness)
+{
+	enum psbt_result res;
+
+	if (slot >= b->num_txids) {
+		psbt_errmsg = "psbt_txids: non-witness utxo of an unknown input";
+		b->res = PSBT_READ_ERROR;
+		return;
+	}
+
+	res = psbt_tx_txid_msg(rec->val, rec->val_size, allow_witness,
+			       &b->msgs[b->count]);
+	if (res != PSBT_OK) {
+		b->res = res;
+		return;
+	}
+
+	b->slots[b->count++] = slot;
+	if (b->count == TXID_BATCH)
+		txid_flush(b);
+}
+
+static void txid_elem(struct psbt_elem *elem) {
+	struct txid_batch *b = (struct txid_batch *)elem->user_data;
+	struct psbt_record *rec;
+
+	if (b->res != PSBT_OK)
+		return;
+
+	// the unsigned tx is parsed before its record is handed out
+	if (elem->type == PSBT_ELEM_TXELEM) {
+		if (elem->elem.txelem->elem_type != PSBT_TXELEM_TX)
+			return;
+
+		b->num_txids = 1 + elem->elem.txelem->elem.tx->num_inputs;
+		if (b->num_txids > b->capacity) {
+			psbt_errmsg = "psbt_txids: txids array is too small";
+			b->res = PSBT_OOB_WRITE;
+			return;
+		}
+
+		memset(b->txids, 0, b->num_txids * 32);
+		return;
+	}
+
+	rec = elem->elem.rec;
+
+	if (rec->scope == PSBT_SCOPE_GLOBAL &&
+	    rec->type == PSBT_GLOBAL_UNSIGNED_TX)
+		txid_add(b, rec, 0, 0);
+	else if (rec->scope == PSBT_SCOPE_INPUTS &&
+		 rec->type == PSBT_IN_NON_WITNESS_UTXO)
+		txid_add(b, rec, 1 + elem->index, 1);
+}
+
+enum psbt_result
+psbt_txid(const unsigned char *tx, size_t tx_size, unsigned char txid[32]) {
+	struct sha256_msg msg;
+	enum psbt_result res;
+
+	// the tx parsers count in 32 bits
+	if (tx_size > UINT_MAX) {
+		psbt_errmsg = "psbt_txid: tx is too large";
+		return psbt_fail(PSBT_READ_ERROR);
+	}
+
+	res = psbt_tx_txid_msg((unsigned char *)tx, tx_size, 1, &msg);
+	if (res != PSBT_OK)
+		return res;
+
+	sha256d_many(&msg, 1, (unsigned char (*)[32])txid);
+
+	return PSBT_OK;
+}
+
+enum psbt_result
+psbt_txids(const unsigned char *psbt_data, size_t psbt_size,
+	   unsigned char (*txids)[32], size_t capacity, size_t *num_txids)
+{
+	struct txid_batch b;
+	struct psbt psbt;
+	enum psbt_result res;
+
+	b.count = 0;
+	b.txids = txids;
+	b.capacity = capacity;
+	b.num_txids = 0;
+	b.res = PSBT_OK;
+
+	res = psbt_read_view(psbt_data, psbt_size, &psbt, txid_elem, &b);
+	if (res != PSBT_OK)
+		return res;
+
+	if (b.res != PSBT_OK)
+		return psbt_fail(b.res);
+
+	if (b.count)
+		txid_flush(&b);
+
+	*num_txids = b.num_txids;
+
+	return PSBT_OK;
+}
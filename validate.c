@@ -0,0 +1,315 @@
+
+#include <string.h>
+
+#include "psbt.h"
+#include "parser.h"
+#include "compactsize.h"
+#include "sha256.h"
+#include "common.h"
+
+/* non-witness utxos hashed together, a multiple of the 8 sha256 lanes */
+#define VALIDATE_BATCH 64
+
+/* an unsigned tx input with an empty scriptSig: outpoint, 0, sequence */
+#define EMPTY_TXIN_SIZE 41
+
+#define FIELDS_PARTIAL 1
+#define FIELDS_FINAL   2
+
+struct validator {
+	enum psbt_result res;
+	int have_tx;
+	unsigned int non_witness_utxos;
+	/* the map the last record was in */
+	enum psbt_scope scope;
+	int index;
+	unsigned int fields;
+};
+
+struct utxo_checker {
+	enum psbt_result res;
+	const u8 *prevouts;
+	struct sha256_msg msgs[VALIDATE_BATCH];
+	const u8 *expected[VALIDATE_BATCH];
+	size_t count;
+};
+
+/* keeps the first error, the checks after it run on but are ignored */
+static void fail(enum psbt_result *res, char *msg) {
+	if (*res != PSBT_OK)
+		return;
+	psbt_errmsg = msg;
+	*res = PSBT_READ_ERROR;
+}
+
+static u32 read_le32(const u8 *p) {
+	return (u32)p[0] | (u32)p[1] << 8 | (u32)p[2] << 16 | (u32)p[3] << 24;
+}
+
+static int is_pubkey(const u8 *key, u32 size) {
+	if (size == 33)
+		return key[0] == 0x02 || key[0] == 0x03;
+	if (size == 65)
+		return key[0] == 0x04;
+	return 0;
+}
+
+/* a fingerprint and zero or more path indexes */
+static int is_keypath(const struct psbt_record *rec) {
+	return rec->val_size >= 4 && rec->val_size % 4 == 0;
+}
+
+static int is_txout(const struct psbt_record *rec) {
+	enum psbt_result res = PSBT_OK;
+	u32 len_size;
+	u64 script_len;
+
+	if (rec->val_size < 9)
+		return 0;
+
+	len_size = compactsize_peek_length(rec->val[8]);
+	if (rec->val_size < 8 + len_size)
+		return 0;
+
+	script_len = compactsize_read(rec->val + 8, &res);
+
+	return res == PSBT_OK &&
+		script_len == rec->val_size - 8 - len_size;
+}
+
+static void validate_input(struct validator *v, const struct psbt_record *rec) {
+	unsigned int fields = 0;
+
+	switch (rec->type) {
+	case PSBT_IN_NON_WITNESS_UTXO:
+		if (rec->key_size != 0)
+			fail(&v->res, "psbt_validate: non-witness utxo "
+			     "with a key");
+		v->non_witness_utxos++;
+		break;
+
+	case PSBT_IN_WITNESS_UTXO:
+		if (rec->key_size != 0 || !is_txout(rec))
+			fail(&v->res, "psbt_validate: invalid witness utxo");
+		break;
+
+	case PSBT_IN_PARTIAL_SIG:
+		if (!is_pubkey(rec->key, rec->key_size))
+			fail(&v->res, "psbt_validate: partial sig key "
+			     "is not a pubkey");
+		fields = FIELDS_PARTIAL;
+		break;
+
+	case PSBT_IN_SIGHASH_TYPE:
+		if (rec->key_size != 0 || rec->val_size != 4)
+			fail(&v->res, "psbt_validate: invalid sighash type");
+		fields = FIELDS_PARTIAL;
+		break;
+
+	case PSBT_IN_REDEEM_SCRIPT:
+	case PSBT_IN_WITNESS_SCRIPT:
+		if (rec->key_size != 0)
+			fail(&v->res, "psbt_validate: script with a key");
+		fields = FIELDS_PARTIAL;
+		break;
+
+	case PSBT_IN_BIP32_DERIVATION:
+		if (!is_pubkey(rec->key, rec->key_size) || !is_keypath(rec))
+			fail(&v->res, "psbt_validate: invalid bip32 "
+			     "derivation");
+		fields = FIELDS_PARTIAL;
+		break;
+
+	case PSBT_IN_FINAL_SCRIPTSIG:
+	case PSBT_IN_FINAL_SCRIPTWITNESS:
+		if (rec->key_size != 0)
+			fail(&v->res, "psbt_validate: final script "
+			     "with a key");
+		fields = FIELDS_FINAL;
+		break;
+
+	default:
+		// unknown types are kept as they are
+		break;
+	}
+
+	v->fields |= fields;
+	if (v->fields == (FIELDS_PARTIAL | FIELDS_FINAL))
+		fail(&v->res, "psbt_validate: input has both final and "
+		     "partial fields");
+}
+
+static void validate_output(struct validator *v, const struct psbt_record *rec) {
+	switch (rec->type) {
+	case PSBT_OUT_REDEEM_SCRIPT:
+	case PSBT_OUT_WITNESS_SCRIPT:
+		if (rec->key_size != 0)
+			fail(&v->res, "psbt_validate: script with a key");
+		return;
+
+	case PSBT_OUT_BIP32_DERIVATION:
+		if (!is_pubkey(rec->key, rec->key_size) || !is_keypath(rec))
+			fail(&v->res, "psbt_validate: invalid bip32 derivation");
+		return;
+
+	default:
+		return;
+	}
+}
+
+static void validate_txelem(struct validator *v, struct psbt_txelem *elem) {
+	switch (elem->elem_type) {
+	case PSBT_TXELEM_TX:
+		v->have_tx = 1;
+		return;
+	case PSBT_TXELEM_TXIN:
+		if (elem->elem.txin->script_len != 0)
+			fail(&v->res, "psbt_validate: unsigned tx has a scriptSig");
+		return;
+	default:
+		return;
+	}
+}
+
+/* the structural checks, nothing here hashes */
+static void validate_elem(struct psbt_elem *elem) {
+	struct validator *v = (struct validator *)elem->user_data;
+	struct psbt_record *rec;
+
+	if (v->res != PSBT_OK)
+		return;
+
+	if (elem->type == PSBT_ELEM_TXELEM) {
+		validate_txelem(v, elem->elem.txelem);
+		return;
+	}
+
+	rec = elem->elem.rec;
+	if (rec->scope != v->scope || elem->index != v->index) {
+		v->scope = rec->scope;
+		v->index = elem->index;
+		v->fields = 0;
+	}
+
+	switch (rec->scope) {
+	case PSBT_SCOPE_GLOBAL:
+		if (rec->type == PSBT_GLOBAL_UNSIGNED_TX && rec->key_size != 0)
+			fail(&v->res, "psbt_validate: unsigned tx with a key");
+		return;
+	case PSBT_SCOPE_INPUTS:
+		validate_input(v, rec);
+		return;
+	case PSBT_SCOPE_OUTPUTS:
+		validate_output(v, rec);
+		return;
+	}
+}
+
+static void utxo_flush(struct utxo_checker *c) {
+	u8 txids[VALIDATE_BATCH][32];
+	size_t i;
+
+	sha256d_many(c->msgs, c->count, txids);
+
+	for (i = 0; i < c->count; i++) {
+		if (memcmp(txids[i], c->expected[i], 32) != 0) {
+			fail(&c->res, "psbt_validate: non-witness utxo does "
+			     "not match the prevout txid");
+			break;
+		}
+	}
+
+	c->count = 0;
+}
+
+static void utxo_elem(struct psbt_elem *elem) {
+	struct utxo_checker *c = (struct utxo_checker *)elem->user_data;
+	struct psbt_txout txout;
+	struct psbt_record *rec;
+	const u8 *outpoint;
+	enum psbt_result res;
+
+	if (c->res != PSBT_OK || elem->type != PSBT_ELEM_RECORD)
+		return;
+
+	rec = elem->elem.rec;
+
+	// inputs with empty scriptSigs all have the same size, so input i
+	// is found without walking the ones before it
+	if (rec->scope == PSBT_SCOPE_GLOBAL &&
+	    rec->type == PSBT_GLOBAL_UNSIGNED_TX) {
+		c->prevouts = rec->val + 4 + compactsize_peek_length(rec->val[4]);
+		return;
+	}
+
+	if (rec->scope != PSBT_SCOPE_INPUTS ||
+	    rec->type != PSBT_IN_NON_WITNESS_UTXO)
+		return;
+
+	outpoint = c->prevouts + (size_t)elem->index * EMPTY_TXIN_SIZE;
+
+	res = psbt_tx_get_output(rec->val, rec->val_size,
+				 read_le32(outpoint + 32), &txout);
+	if (res != PSBT_OK) {
+		fail(&c->res, "psbt_validate: non-witness utxo has no "
+		     "output at the prevout index");
+		return;
+	}
+
+	res = psbt_tx_txid_msg(rec->val, rec->val_size, 1,
+			       &c->msgs[c->count]);
+	if (res != PSBT_OK) {
+		c->res = res;
+		return;
+	}
+
+	c->expected[c->count++] = outpoint;
+	if (c->count == VALIDATE_BATCH)
+		utxo_flush(c);
+}
+
+enum psbt_result
+psbt_validate(const unsigned char *psbt_data, size_t src_size) {
+	struct utxo_checker c;
+	struct validator v;
+	struct psbt psbt;
+	enum psbt_result res;
+
+	memset(&v, 0, sizeof(v));
+	v.index = -1;
+
+	// the map counts are checked by the parser itself, as it reads
+	// exactly as many input and output maps as the tx has
+	res = psbt_read_view_strict(psbt_data, src_size, &psbt,
+				    validate_elem, &v);
+	if (res != PSBT_OK)
+		return res;
+
+	if (v.res != PSBT_OK)
+		return psbt_fail(v.res);
+
+	if (!v.have_tx) {
+		psbt_errmsg = "psbt_validate: psbt without an unsigned tx";
+		return psbt_fail(PSBT_READ_ERROR);
+	}
+
+	if (v.non_witness_utxos == 0)
+		return PSBT_OK;
+
+	// everything is well formed, only now hash the utxos
+	c.res = PSBT_OK;
+	c.prevouts = NULL;
+	c.count = 0;
+
+	res = psbt_read_view(psbt_data, src_size, &psbt, utxo_elem, &c);
+	if (res != PSBT_OK)
+		return res;
+
+	if (c.res == PSBT_OK && c.count)
+		utxo_flush(&c);
+
+	if (c.res != PSBT_OK)
+		return psbt_fail(c.res);
+
+	return PSBT_OK;
+}